@@ -58,10 +58,16 @@
 #include "asterisk/taskprocessor.h"
 #include "asterisk/test.h"
 #include "asterisk/format_cache.h"
+#include "asterisk/json.h"
+#include "asterisk/translate.h"
+#include "asterisk/frame.h"
+#include "asterisk/callerid.h"
 
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <stdio.h>
 #include <string.h>
@@ -75,59 +81,155 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <time.h>
-//#include <dirent.h>
+#include <dirent.h>
 #include <poll.h>
+#include <sys/eventfd.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
 
 #if defined(__FreeBSD__) || defined(__OpenBSD__)
 #include <sys/wait.h>
 #endif
 
 #define IVR_CONFIG				"crsivr.conf"	// configuration file
-#define IVR_SERVER_SEC			5 				// server transaction timeout
+#define IVR_HEARTBEAT_TIMEOUT	5000			// ms a heartbeat may go unanswered
+#define IVR_OFFER_TIMEOUT		1000			// ms a protocol offer may go unanswered
+#define IVR_TIMEOUT				5500			// default ms a caller waits for a response
+#define IVR_MESSAGE_MAX			48				// message text sent, codes expanded, with the terminator
 #define IVR_CONNECT_SEC			5 				// interval between connection attempts
+#define IVR_CONNECT_TIMEOUT		2000			// default connection attempt timeout, ms
 #define IVR_PING_SEC			30 				// interval between pings
-#define IVR_CHANNELS			4				// number of IVR channels
+#define IVR_OFFER_SEC			300				// wait before offering again to a server that ignored it
+#define IVR_CHANNELS			16				// default number of IVR channels allocated at load
+#define IVR_CHANNELS_MAX		256				// default ceiling for the IVR channel pool
+#define IVR_CHANNEL_SEGMENT		64				// channels allocated per pool segment
+#define IVR_CHANNEL_SEGMENTS	1023			// maximum number of pool segments, keeping IVR_CHANNEL_PING unused
+#define IVR_CACHE_LINE			64
+#define IVR_PIPELINE			16				// default number of requests in flight on the server connection
+#define IVR_PIPELINE_MAX		256				// maximum number of requests in flight on the server connection
+#define IVR_RX_BUFFER			512				// server receive buffer
+#define IVR_TX_BUFFER			4096			// requests framed for a server and not yet sent
+#define IVR_TX_FRAME			256				// largest framed request
+#define IVR_URING_ENTRIES		64				// io_uring submission queue entries per worker
+#define IVR_SHARDS				1				// default number of worker threads
+#define IVR_SHARDS_MAX			16				// maximum number of worker threads
+#define IVR_QUEUE				1024			// default request queue cells per worker
+#define IVR_QUEUE_MAX			65536			// maximum request queue cells per worker
+#define IVR_CACHE				1024			// default verification cache entries
+#define IVR_CACHE_MAX			1048576			// maximum verification cache entries
+#define IVR_CACHE_POSITIVE_SEC	300				// default lifetime of a cached OK
+#define IVR_CACHE_NEGATIVE_SEC	30				// default lifetime of a cached INVALID or DISABLED
+#define IVR_MESSAGES			4096			// default message status entries
+#define IVR_MESSAGES_SEC		86400			// default lifetime of a message status
+#define IVR_OUTBOX				4096			// default outbox journal records
+#define IVR_RECIPIENTS_MAX		32				// recipients of one SendMessage
+#define IVR_OUTBOX_FILE			"crsivr/outbox"	// default outbox journal, under the spool directory
+#define IVR_SERVER_PORT			55001			// default server port
+#define IVR_SERVERS_MAX			8				// maximum servers in the pool
+#define IVR_HISTOGRAM_BUCKETS	32				// latency histogram buckets, powers of two usec
+#define IVR_TRACE_FILE			"crsivr-trace.json"	// default trace file, under the log directory
+#define IVR_TRACE_SAMPLE		100				// default: trace 1 request in this many
+#define IVR_TRACE_SLOW			1000			// default ms above which every request is traced
+#define IVR_TRACE_SIZE			64				// default MB before the trace file is rotated
+#define IVR_TRACE_ROTATE		5				// default rotated trace files kept
+
+#define IVR_PROMPT_DIR			"sounds/custom"	// default prompt directory, under the data directory
+#define IVR_PROMPT_CODECS		"ulaw,alaw,gsm,g722"	// default codecs prompts are held in
+#define IVR_PROMPT_CODECS_MAX	8
+
+#define IVR_OVERDIAL_WELCOME			0		// [overdial] prompts
+#define IVR_OVERDIAL_PAGER_NUMBER		1
+#define IVR_OVERDIAL_PAGER_MESSAGE		2
+#define IVR_OVERDIAL_PAGER_INVALID		3
+#define IVR_OVERDIAL_PAGER_UNAVAILABLE	4
+#define IVR_OVERDIAL_SYSTEM_UNAVAILABLE	5
+#define IVR_OVERDIAL_MESSAGE_SENT		6
+#define IVR_OVERDIAL_MESSAGE_FAILED		7
+#define IVR_OVERDIAL_MESSAGE_NOT_SENT	8
+#define IVR_OVERDIAL_PROMPTS			9
 
 #define FUNC_SENDMSG			"CRS_SendMessage"
 #define FUNC_VERIFYRECIPIENT	"CRS_VerifyRecipient"
+#define FUNC_QUERYMESSAGE		"CRS_QueryMessage"
+#define FUNC_SUBSTITUTE			"CRS_SUBSTITUTE"
+#define FUNC_PLAYBACK			"CRS_Playback"
+#define FUNC_OVERDIAL			"CRS_Overdial"
 
 typedef union
 {
-	uint64_t			raw[4];
+	uint64_t			raw[2 * IVR_CACHE_LINE / sizeof(uint64_t)];
 	struct
 	{
 		unsigned int 	index;
 		int 			id;
 		volatile int 	state;
-		int 			pipe_response_fd[2];
+		int 			event_fd;				// signalled when a response is stored
+		uint32_t		next;					// free list link (slot + 1, 0 = end of list)
+		volatile int	async;					// 1 = nobody waits; the response goes out as a CRSMessageStatus event
+		uint32_t		outbox;					// outbox record + 1 journalling an async message, 0 = none
+		volatile uint64_t result;				// (index << 32) | response
+		volatile uint64_t stamp[4];				// usec the request was dequeued, written, answered, seen
+		volatile int	position;				// queue position the server reported, -1 = none
+		char			reference[32];			// the server's message id, "" = none
 	};
-} ivr_channel_t;
+} __attribute__((aligned(IVR_CACHE_LINE))) ivr_channel_t;
+
+//
+// Channel index: the low bits select the slot, the high bits are a generation
+// counter bumped each time the slot is recycled so stale requests and
+// responses can be recognized.
+//
+#define IVR_CHANNEL_SLOT_MASK			0x0000ffff
+#define IVR_CHANNEL_GENERATION			0x00010000
+#define IVR_CHANNEL_PING				0x0000ffff		// tag of heartbeats, beyond the last slot
 
 #define IVR_CHANNEL_STATE_CLOSED		0
 #define IVR_CHANNEL_STATE_OPENING		1
 #define IVR_CHANNEL_STATE_OPEN			2
 #define IVR_CHANNEL_STATE_CLOSING		3
+#define IVR_CHANNEL_STATE_CANCELLED		4		// caller hung up; the worker frees the slot at the response
+
+typedef struct
+{
+	int						nodelay;				// TCP_NODELAY
+	int						keepalive;				// SO_KEEPALIVE
+	int						keepidle;				// TCP_KEEPIDLE sec, 0 = system default
+	int						keepintvl;				// TCP_KEEPINTVL sec, 0 = system default
+	int						keepcnt;				// TCP_KEEPCNT, 0 = system default
+	unsigned int			user_timeout;			// TCP_USER_TIMEOUT ms, 0 = system default
+	unsigned int			connect_timeout;		// ms allowed for a connection attempt
+	unsigned int			reconnect;				// sec between attempts to a failed server
+} ivr_socket_options_t;
+
+//
+// Worker configuration.  Built by load_config() and handed to each worker
+// as a reference counted object.
+//
+typedef struct
+{
+	char					client_id[20];
+	int						pipeline;
+	int						tagged;
+	int						protocol;				// IVR_PROTOCOL_* offered to the servers
+	ivr_socket_options_t	socket;
+	unsigned int			server_count;
+	struct sockaddr_in		address[IVR_SERVERS_MAX];
+	unsigned int			weight[IVR_SERVERS_MAX];	// 0 = standby, used while no weighted server is connected
+} ivr_config_t;
 
 typedef union
 {
-	uint64_t		raw[16];
+	uint64_t		raw[23];					// fits the queue cell's padding
 	
 	struct	
 	{
 		uint32_t 	code;
 		uint32_t	index;
-
-		union
-		{
-			char	param[4][30];
-
-			struct
-			{
-				struct sockaddr_in address[2]; 
-				int valid[2];
-				char client_id[20];
-			};
-		};
+		uint64_t	deadline;					// CLOCK_MONOTONIC ms the caller stops waiting, 0 = none
+		char		param[4][30];				// recipient, unused, caller, tag
+		char		message[IVR_MESSAGE_MAX];	// SendMessage text, codes expanded
 	};
 } ivr_request_t;
 
@@ -135,9 +237,70 @@ typedef union
 #define IVR_REQUEST_SENDMESSAGE					's'
 #define IVR_REQUEST_QUERYMESSAGE				'q'
 #define IVR_REQUEST_PING						'p'
+#define IVR_REQUEST_HELLO						'h'		// protocol offer, sent first on a connection
+
+#define IVR_BACKEND_PPOLL						0		// [workers] backend
+#define IVR_BACKEND_URING						1
+
+//
+// io_uring completion tags: operation, server, and the server's generation
+// when it was submitted, so completions for a closed descriptor are dropped.
+//
+#define IVR_URING_DOORBELL						1
+#define IVR_URING_RECV							2
+#define IVR_URING_SEND							3
+#define IVR_URING_CONNECT						4
+#define IVR_URING_CANCEL						5
+#define IVR_URING_DATA(op, server, generation)	(((uint64_t)(generation) << 32) | ((op) << 8) | (server))
+
+//
+// Protocol 2 frames, integers in network byte order:
+//
+//   uint16 length     bytes in the frame, these included
+//   uint8  opcode     request code, IVR_RESPONSE_FRAME or IVR_RESPONSE_UPDATE
+//   uint8  fields
+//   uint64 id         (session << 32) | channel index, echoed in the response
+//   fields            uint8 type, uint16 length, value
+//
+// A connection starts in text; [h:<client>,2] offers protocol 2, and a
+// server that answers IVR_RESPONSE_SUCCESS sends and expects frames from
+// then on.  Fields of an unknown type are skipped.
+//
+#define IVR_PROTOCOL_HELLO						0		// offer outstanding
+#define IVR_PROTOCOL_TEXT						1
+#define IVR_PROTOCOL_BINARY						2
+
+#define IVR_FRAME_HEADER						12
+#define IVR_FRAME_FIELD							3		// field header
+
+#define IVR_FIELD_RECIPIENT						1
+#define IVR_FIELD_MESSAGE						2
+#define IVR_FIELD_CALLER						3
+#define IVR_FIELD_TAG							4		// message tag
+#define IVR_FIELD_RESPONSE						5		// one response character
+#define IVR_FIELD_REFERENCE						6		// the server's message id
+#define IVR_FIELD_POSITION						7		// uint32 queue position
+#define IVR_FIELDS								8
+
+typedef struct
+{
+	const char *			value;					// into the receive buffer, not terminated
+	unsigned int			length;					// 0 = field absent
+} ivr_field_t;
+
+//
+// Request queue cell.  The sequence number tells producers and the worker
+// who owns the cell (Vyukov bounded queue): sequence == position means free
+// for the producer claiming position, position + 1 means ready for the worker.
+//
+typedef struct
+{
+	volatile unsigned int	sequence;
+	ivr_request_t			request;
+} __attribute__((aligned(IVR_CACHE_LINE))) ivr_ring_cell_t;
 
-#define IVR_REQUEST_STOP						0
-#define IVR_REQUEST_CONFIG						1
+#define IVR_RESPONSE_FRAME						'r'		// tagged response: [r:<tag>,<response>]
+#define IVR_RESPONSE_UPDATE						'u'		// message status update: [u:<message tag>,<response>]
 
 #define IVR_RESPONSE_SUCCESS					'0'
 #define IVR_RESPONSE_SUCCESS_MESSAGEQUEUED		'a'
@@ -149,1008 +312,7250 @@ typedef union
 #define IVR_RESPONSE_FAIL_INVALIDCLIENT			'4'
 #define IVR_RESPONSE_FAIL_UNKNOWNREQUEST		'5'
 
+#define IVR_RESPONSE_FAIL_QUEUEFULL				'7'
 #define IVR_RESPONSE_FAIL_INTERNAL				'8'
 #define IVR_RESPONSE_FAIL_HANGUP				'9'
+#define IVR_RESPONSE_PARTIAL					'P'		// some recipients of a list failed
+
+#define IVR_RESPONSE_PENDING					0		// no response yet (ivr_wait_all)
+
+typedef struct
+{
+	uint32_t				index;					// channel index the response is routed to
+	int						code;					// request code
+	int						done;					// 1 = response delivered out of order
+	uint32_t				tag;					// index carried in the request tag
+	int						foreign;				// 1 = tag from an earlier run (outbox replay)
+	uint64_t				sent;					// CLOCK_MONOTONIC usec
+	uint64_t				deadline;				// CLOCK_MONOTONIC ms
+} ivr_pending_t;
+
+//
+// A worker's connection to one server of the pool.  Requests are answered
+// on the connection they were sent on.
+//
+typedef struct
+{
+	struct pollfd			sock_fd;				// established connection
+	int						connect_fd;				// connection attempt in progress
+	uint64_t				connect_started;		// CLOCK_MONOTONIC usec
+	uint64_t				connect_deadline;		// CLOCK_MONOTONIC ms
+	struct sockaddr_in		address;
+	unsigned int			weight;
+
+	uint64_t				time_connectattempt;	// last connection attempt, CLOCK_MONOTONIC ms
+	uint64_t				time_receive;			// last data from the server, CLOCK_MONOTONIC ms
+	uint64_t				time_ping;				// last heartbeat sent, CLOCK_MONOTONIC ms
+
+	int 					flag_connect_notify;	// 1 = a connection failure has been logged
+	int						flag_frame_notify;		// 1 = an unmatched response has been logged
+
+	uint64_t				latency;				// moving average response time, ms << 4
+	uint64_t				ping_rtt;				// last heartbeat round trip, ms
+	unsigned int			ping_count;				// heartbeats answered on this connection
+
+	unsigned int			pending_head;
+	unsigned int			pending_tail;
+	ivr_pending_t			pending[IVR_PIPELINE_MAX];	// requests in flight, in the order sent
+
+	int						protocol;				// IVR_PROTOCOL_* spoken on the connection
+	int						protocol_max;			// IVR_PROTOCOL_TEXT while an offer went unanswered
+	uint64_t				time_offer;				// last unanswered protocol offer, CLOCK_MONOTONIC ms
+
+	unsigned int			rx_length;
+	char					rx[IVR_RX_BUFFER];		// unparsed server bytes
+
+	unsigned int			tx_length;
+	char					tx[IVR_TX_BUFFER];		// requests framed but not yet sent
+
+#ifdef HAVE_LIBURING
+	unsigned int			generation;				// bumped when the descriptors are closed
+	int						recv_armed;				// a receive into rx is outstanding
+	int						tx_busy;				// a send of tx is outstanding
+	unsigned int			connect_polled;			// generation + 1 of the poll on connect_fd, 0 = none
+#endif
+} ivr_server_t;
+
+//
+// Bounded key/value cache with per-entry expiry and LRU eviction.  Entries
+// are preallocated so the memory footprint is fixed by the capacity.
+//
+typedef struct ivr_cache_entry
+{
+	struct ivr_cache_entry * hash_next;
+	struct ivr_cache_entry * lru_prev;		// toward most recently used
+	struct ivr_cache_entry * lru_next;		// toward least recently used
+	uint64_t				expires;		// CLOCK_MONOTONIC ms
+	int						value;
+	char					key[64];
+} ivr_cache_entry_t;
+
+typedef struct
+{
+	ast_mutex_t				lock;
+	const char *			name;
+	unsigned int			capacity;
+	unsigned int			count;
+	unsigned int			bucket_count;
+	ivr_cache_entry_t *		entries;
+	ivr_cache_entry_t **	buckets;
+	ivr_cache_entry_t *		free;
+	ivr_cache_entry_t		lru;			// list head: lru.lru_next is most recent
+	uint64_t				hits;
+	uint64_t				misses;
+	unsigned int			ttl[2];			// ms: [0] negative results, [1] positive results
+} ivr_cache_t;
+
+//
+// Outbox journal record.  Records are appended in order and only their state
+// changes afterwards; the checksum covers everything after it.
+//
+typedef union
+{
+	uint64_t				raw[32];
+
+	struct
+	{
+		volatile uint32_t	state;
+		uint32_t			checksum;
+		time_t				queued;
+		char				tag[30];				// CRS_MESSAGE_TAG given to the caller
+		char				param[3][30];			// recipient, message (journals before message[]), caller
+		char				message[IVR_MESSAGE_MAX];
+	};
+} ivr_outbox_record_t;
+
+#define IVR_OUTBOX_EMPTY				0
+#define IVR_OUTBOX_PENDING				'P'
+#define IVR_OUTBOX_SENT					'S'
+#define IVR_OUTBOX_FAILED				'F'
+#define IVR_OUTBOX_HELD					'H'		// async message being sent; pending again if that fails
+
+//
+// Store-and-forward outbox: messages the server could not take are
+// journalled to a memory mapped file and resent by a drainer thread.
+//
+typedef struct
+{
+	ast_mutex_t				lock;
+	ast_cond_t				cond;
+	char					path[PATH_MAX];
+	unsigned int			capacity;				// records in the journal, 0 = outbox off
+	unsigned int			window;					// records resent at once, the server pipeline
+	int						fd;
+	ivr_outbox_record_t *	records;
+	unsigned int			head;					// oldest record that may be pending
+	unsigned int			tail;					// next record to append
+	uint64_t				written;				// journal changes made
+	uint64_t				synced;					// journal changes known to be on disk
+	int						stop;
+	pthread_t				thread;
+} ivr_outbox_t;
+
+//
+// Recipient groups from the [groups] section, for SendMessage(@<group>,...).
+//
+typedef struct
+{
+	unsigned int			count;
+
+	struct
+	{
+		char				name[32];
+		char				members[256];			// recipients separated by &
+	} group[];
+} ivr_groups_t;
+
+//
+// Canned messages from the [messagesubstitution] section, keyed by code.  A
+// table is never changed once built: readers hold a reference while they
+// look up, and a reload swaps in a new one.  Open addressing, at most half
+// the slots used.
+//
+typedef struct
+{
+	unsigned int			mask;					// slots - 1
+
+	struct
+	{
+		char				code[16];				// "" = free slot
+		char				text[IVR_MESSAGE_MAX];
+	} slot[];
+} ivr_substitutions_t;
+
+//
+// A prompt held in memory, decoded once and encoded in each codec of the
+// bank, so playing it costs neither file I/O nor transcoding.
+//
+typedef struct
+{
+	char					name[64];				// file name without the extension
+	time_t					mtime;					// of the file it was loaded from
+	off_t					size;
+	unsigned int			ms;
+
+	struct
+	{
+		struct ast_frame **	frames;
+		unsigned int		count;
+		size_t				bytes;
+	} codec[IVR_PROMPT_CODECS_MAX];
+} ivr_prompt_t;
+
+//
+// The prompts of the [prompts] directory.  Like the substitution table it
+// is replaced whole on reload; prompts whose file is unchanged are shared
+// with the previous bank rather than loaded again.
+//
+typedef struct
+{
+	char					dir[PATH_MAX];
+	unsigned int			codec_count;
+	struct ast_format *		codec[IVR_PROMPT_CODECS_MAX];
+	unsigned int			count;
+	ivr_prompt_t *			prompt[];
+} ivr_prompts_t;
+
+//
+// CRS_Overdial settings from the [overdial] section, replaced whole on reload.
+//
+typedef struct
+{
+	char					prompt[IVR_OVERDIAL_PROMPTS][128];	// prompt names, & separated
+	unsigned int			alias_digits;
+	unsigned int			alias_min_digits;			// shortest alias, verified early with option s
+	unsigned int			alias_timeout;				// ms to wait for each digit
+	unsigned int			message_digits;
+	unsigned int			message_timeout;
+} ivr_overdial_t;
+
+//
+// A verification started while the caller was still dialling, kept on the
+// channel for the ivr_verifyrecipient() that follows.
+//
+typedef struct
+{
+	char					recipient[30];
+	uint32_t				index;					// channel index the request was sent on
+	uint64_t				deadline;				// CLOCK_MONOTONIC ms
+	uint64_t				started;				// CLOCK_MONOTONIC usec
+} ivr_speculation_t;
+
+//
+// State of a prompt being played by ivr_playback_generate().
+//
+typedef struct
+{
+	const ivr_prompt_t *	prompt;
+	unsigned int			codec;
+	unsigned int			position;				// next frame
+	int						done;
+} ivr_playback_t;
+
+//
+// Latency histogram.  Bucket 0 counts samples under 1 usec, bucket n those
+// of 2^(n-1) to 2^n - 1 usec; the last bucket takes everything longer.
+//
+typedef struct
+{
+	volatile uint64_t		count;
+	volatile uint64_t		sum;					// usec
+	volatile uint64_t		max;					// usec
+	volatile uint64_t		bucket[IVR_HISTOGRAM_BUCKETS];
+} ivr_histogram_t;
+
+#define IVR_STAT_VERIFY					0
+#define IVR_STAT_SEND					1
+#define IVR_STAT_QUERY					2
+#define IVR_STAT_PING					3
+#define IVR_STAT_CONNECT				4
+#define IVR_STATS						5
+
+//
+// Module statistics.  Updated with atomic adds from the channel and worker
+// threads, read without locking.
+//
+typedef struct
+{
+	ivr_histogram_t			caller[IVR_STATS];		// request queued to response seen by the dialplan
+	ivr_histogram_t			server[IVR_STATS];		// request written to response read, or connect time
+	volatile uint64_t		queue_full;				// requests refused by a full worker queue
+	volatile uint64_t		exhausted;				// channel slots refused by an exhausted pool
+	volatile uint64_t		server_timeouts;		// connections dropped for an unanswered request
+	volatile uint64_t		expired;				// requests dropped unsent, their caller gone
+	volatile uint64_t		cancelled;				// requests dropped unsent, their caller hung up
+	volatile uint64_t		caller_timeouts;		// responses the dialplan stopped waiting for
+	volatile uint64_t		speculative;			// verifications started before the alias was complete
+	volatile uint64_t		speculative_used;		// of those, answers taken by the verification
+	volatile uint64_t		connects;				// connections established
+	volatile uint64_t		connect_failures;		// connection attempts failed or timed out
+	volatile uint64_t		disconnects;			// established connections closed
+	volatile uint64_t		responses[128];			// CRS_RESPONSE values given to the dialplan
+	time_t					reset;					// start of the counting period
+} ivr_stats_t;
+
+//
+// Stage times of one request, CLOCK_MONOTONIC usec, 0 = stage not reached.
+// The worker's stages come back in the channel slot.
+//
+typedef struct
+{
+	uint64_t				entry;					// dialplan application entered
+	uint64_t				enqueued;				// request queued for the worker
+	uint64_t				dequeued;				// taken by the worker
+	uint64_t				written;				// written to the server
+	uint64_t				read;					// response read, or failure decided
+	uint64_t				woken;					// response seen by the caller
+} ivr_trace_t;
+
+//
+// What a protocol 2 server reported besides the response to a message.
+//
+typedef struct
+{
+	char					reference[32];			// its message id, "" = none
+	int						position;				// queue position, -1 = none
+} ivr_receipt_t;
+
+//
+// Trace file: one JSON object per sampled request, rotated by size.
+//
+typedef struct
+{
+	ast_mutex_t				lock;
+	char					path[PATH_MAX];			// empty = tracing off
+	FILE *					file;
+	uint64_t				size;					// bytes before the file is rotated, 0 = never
+	unsigned int			rotate;					// rotated files kept
+	unsigned int			sample;					// 1 in sample requests written, 0 = only slow ones
+	uint64_t				slow;					// usec; slower requests are always written, 0 = off
+	volatile unsigned int	count;
+	time_t					flushed;
+} ivr_trace_log_t;
+
+typedef struct ivr_context ivr_context_t;
 
+//
+// A worker thread with its own request queue and server connections.  Each
+// channel slot is served by exactly one shard (slot % shard count).
+//
 typedef struct
 {
 //
 // Worker thread
 //
-	struct pollfd			sock_fd;
-	struct pollfd			pipe_fd;
 	char					client_id[20];
-	struct sockaddr_in * 	address[2]; 
-	struct sockaddr_in 		a[2]; 
-
-	time_t 					time_connectattempt;	// last connection attempt
-	time_t 					time_transaction;		// last server transaction
+	int						tagged;					// 1 = verify requests carry a tag
+	int						protocol;				// IVR_PROTOCOL_* offered to the servers
+	unsigned int			pipeline;				// requests allowed in flight per server
+	ivr_socket_options_t	socket;
+	unsigned int			server_count;
+	ivr_server_t			server[IVR_SERVERS_MAX];
+//
+// Shared
+//
+	ivr_context_t *			ivr;
+	unsigned int			id;
+	int						cpu;					// CPU the thread is pinned to, -1 = any
+	pthread_t				thread;
+	int						doorbell_fd;			// eventfd, rung by producers while the worker sleeps
+	volatile int			sleeping;				// 1 = the worker may be blocked in ppoll
+	volatile int			stop;					// 1 = the worker is to stop
+	ivr_config_t * volatile	config;					// configuration not yet applied, owns a reference
+	int						backend;				// IVR_BACKEND_*
+#ifdef HAVE_LIBURING
+	struct io_uring			uring;
+	int						uring_ready;			// 1 = the worker runs on io_uring
+	int						doorbell_armed;			// a read of the doorbell is outstanding
+	uint64_t				doorbell_value;
+#endif
+	ivr_ring_cell_t *		ring;					// request queue: many producers, one consumer
+	unsigned int			ring_size;				// cells, a power of two
+	unsigned int			ring_head;				// next cell to consume (worker only)
+	volatile unsigned int	ring_tail __attribute__((aligned(IVR_CACHE_LINE)));	// next cell to claim
 
+} ivr_shard_t;
 
-	int 					flag_connect_notify;	// 1 = a connection failure has been logged
+struct ivr_context
+{
 //
 // Shared
 //
 	char					tagBase[30];
-	pthread_t				thread;
+	uint32_t				session;				// high half of protocol 2 request ids
 	volatile int			initialized;
-	int						pipe_request_fd[2];
-	ivr_channel_t			channel[IVR_CHANNELS];
+	unsigned int			shard_count;
+	ivr_shard_t				shard[IVR_SHARDS_MAX];
+	ivr_channel_t *			segment[IVR_CHANNEL_SEGMENTS];	// channel pool, grown a segment at a time
+	volatile unsigned int	channel_count;					// channels allocated in the pool
+	volatile uint64_t		channel_free;					// free list head: (ABA count << 32) | (slot + 1)
 //
 // Channel threads
 //
 	int						config_ready;
-	ivr_request_t			config_request;
+	ivr_config_t *			config;
+	char					client_id[20];
+	unsigned int			verify_timeout;					// ms a caller waits for each operation
+	unsigned int			send_timeout;
+	unsigned int			query_timeout;
+	unsigned int			channel_initial;				// channels allocated at load
+	unsigned int			channel_max;					// pool growth ceiling
+	unsigned int			shards;							// worker threads to start at load
+	int						backend;						// worker event loop, IVR_BACKEND_*
+	unsigned int			queue;							// request queue cells per worker
+	int						cpus[IVR_SHARDS_MAX];			// worker CPU affinity
+	unsigned int			cpu_count;
 
-} ivr_context_t;
+};
 
 
 //
 // Function Prototypes
 //
 
-static void ivr_worker_gc(ivr_context_t * ivr);
-static void ivr_worker_connect_ip(ivr_context_t * ivr, struct sockaddr_in * address);
-static void ivr_worker_connect(ivr_context_t * ivr);
-static void ivr_worker_disconnect(ivr_context_t * ivr);
-static void ivr_worker_transact_server(ivr_context_t * ivr, const ivr_request_t * request);
-static void ivr_worker_ping_server(ivr_context_t * ivr);
+static ivr_channel_t * ivr_channel_lookup(ivr_context_t * ivr, unsigned int index);
+static void ivr_channel_push(ivr_context_t * ivr, ivr_channel_t * ivr_chan);
+static ivr_channel_t * ivr_channel_pop(ivr_context_t * ivr);
+static int ivr_channel_grow(ivr_context_t * ivr, unsigned int count);
+static ivr_shard_t * ivr_shard(ivr_context_t * ivr, unsigned int index);
+static int ivr_shard_send(ivr_shard_t * shard, const ivr_request_t * request);
+static void ivr_shard_wake(ivr_shard_t * shard);
+static ivr_request_t * ivr_ring_peek(ivr_shard_t * shard);
+static void ivr_ring_pop(ivr_shard_t * shard);
+static void ivr_worker_gc(ivr_shard_t * shard);
+static void ivr_worker_connect_notify(ivr_server_t * server, const char * failure);
+static void ivr_worker_socket_options(ivr_shard_t * shard, int fd);
+static void ivr_worker_connect_ip(ivr_shard_t * shard, ivr_server_t * server);
+static void ivr_worker_connected(ivr_shard_t * shard, ivr_server_t * server);
+static void ivr_worker_connect(ivr_shard_t * shard);
+static void ivr_worker_disconnect(ivr_shard_t * shard, ivr_server_t * server);
+static void ivr_worker_configure(ivr_shard_t * shard, const ivr_config_t * config);
+static void ivr_worker_respond(ivr_shard_t * shard, uint32_t index, uint8_t response);
+static void ivr_worker_fail_pending(ivr_shard_t * shard, ivr_server_t * server);
+static void ivr_worker_answer(ivr_shard_t * shard, uint32_t index, uint8_t response, const ivr_field_t * fields);
+static void ivr_worker_pending(ivr_server_t * server, uint32_t index, int code, uint64_t deadline);
+static uint64_t ivr_worker_deadline(const ivr_server_t * server);
+static void ivr_worker_complete(ivr_shard_t * shard, ivr_server_t * server, const uint32_t * index, int foreign, uint8_t response, const ivr_field_t * fields);
+static void ivr_worker_expire(ivr_shard_t * shard, ivr_server_t * server);
+static void ivr_worker_frame(ivr_shard_t * shard, ivr_server_t * server, const char * frame, int length);
+static void ivr_worker_receive(ivr_shard_t * shard, ivr_server_t * server);
+static int ivr_worker_flush(ivr_shard_t * shard, ivr_server_t * server);
+static void ivr_worker_parse(ivr_shard_t * shard, ivr_server_t * server, int readlen);
+static int ivr_worker_frame_binary(ivr_shard_t * shard, ivr_server_t * server, const char * data, unsigned int available);
+static void ivr_worker_hello(ivr_shard_t * shard, ivr_server_t * server);
+static uint32_t ivr_frame_get32(const char * data);
+static int ivr_frame_begin(char * frame, int opcode, uint64_t id);
+static int ivr_frame_field(char * frame, int length, int type, const char * value);
+static int ivr_frame_end(char * frame, int length);
+static int ivr_frame_fields(const char * frame, unsigned int length, ivr_field_t * fields);
+static int ivr_frame_request(ivr_shard_t * shard, const ivr_request_t * request, char * frame);
+static const char * ivr_text_field(char * buffer, size_t size, const char * value);
+static int ivr_worker_write(ivr_shard_t * shard, ivr_server_t * server, const char * frame, int length);
+static int ivr_worker_room(ivr_shard_t * shard, const ivr_server_t * server);
+#ifdef HAVE_LIBURING
+static void ivr_worker_uring_release(ivr_shard_t * shard, ivr_server_t * server);
+static void ivr_worker_uring_wait(ivr_shard_t * shard, uint64_t timeout);
+#endif
+static ivr_server_t * ivr_worker_select(ivr_shard_t * shard);
+static int ivr_worker_space(ivr_shard_t * shard);
+static void ivr_worker_transact_server(ivr_shard_t * shard, const ivr_request_t * request);
+static void ivr_worker_ping_server(ivr_shard_t * shard, ivr_server_t * server);
+static int ivr_worker_control(ivr_shard_t * shard);
 static void * ivr_worker_task(void *arg);
 
-static ivr_channel_t * ivr_channel_acquire(void);
+static ivr_channel_t * ivr_channel_acquire(ivr_context_t * ivr);
+static unsigned int ivr_channel_begin(ivr_channel_t * ivr_chan);
 static void ivr_channel_release(ivr_channel_t * ivr_chan);
-static int ivr_load(void);
-static void ivr_unload(void);
-static int ivr_wait(struct ast_channel *c, int fd);
+static void ivr_channel_cancel(ivr_channel_t * ivr_chan);
+static int ivr_load(ivr_context_t * ivr);
+static void ivr_unload(ivr_context_t * ivr);
+static int ivr_wait(struct ast_channel *c, ivr_channel_t * ivr_chan, uint64_t deadline, int typeahead);
+static void ivr_wait_all(struct ast_channel *c, ivr_channel_t ** ivr_chan, int count, int * responses, uint64_t deadline, int typeahead);
+static int ivr_wait_fd(ivr_channel_t * ivr_chan, int ms);
+static void ivr_wait_fds(ivr_channel_t ** ivr_chan, int count, int * responses, uint64_t deadline);
+static uint32_t ivr_outbox_checksum(const ivr_outbox_record_t * record);
+static int ivr_outbox_open(ivr_outbox_t * outbox);
+static int ivr_outbox_append(ivr_outbox_t * outbox, const ivr_request_t * request, const char * tag, uint32_t state, unsigned int * position);
+static int ivr_outbox_settle(ivr_outbox_t * outbox, unsigned int position, int response);
+static void ivr_outbox_replay(const ivr_outbox_record_t * records, int count, int * responses);
+static void * ivr_outbox_task(void *arg);
+static int ivr_outbox_start(ivr_outbox_t * outbox);
+static void ivr_outbox_stop(ivr_outbox_t * outbox);
 static void ivr_datastore_destroy(void *data);
 static ivr_channel_t * ivr_get_channel(struct ast_channel * chan);
-static int ivr_sendmessage(struct ast_channel * chan, const char * recipient, const char *caller, const char *request);
-static int ivr_verifyrecipient(struct ast_channel * chan, const char * recipient);
+static void ivr_detach_channel(struct ast_channel * chan, ivr_channel_t * ivr_chan);
+static void ivr_sendmessage(struct ast_channel * chan, char ** recipients, int count, const char *message, const char *caller, int async, int typeahead, int * responses, char (*tags)[30], ivr_trace_t * traces, ivr_receipt_t * receipts);
+static int ivr_recipients(const char * list, char * buffer, size_t length, char ** recipients);
+static int ivr_verifyrecipient(struct ast_channel * chan, const char * recipient, int typeahead, ivr_trace_t * trace);
+static void ivr_verify_speculate(struct ast_channel * chan, const char * recipient);
+static int ivr_speculation_take(struct ast_channel * chan, ivr_speculation_t * speculation);
+static int ivr_querymessage(struct ast_channel * chan, const char * tag, ivr_trace_t * trace);
+static void ivr_trace_collect(ivr_trace_t * trace, const ivr_channel_t * ivr_chan);
+static void ivr_receipt_collect(ivr_receipt_t * receipt, const ivr_channel_t * ivr_chan);
+static int ivr_field_fits(const char * value, size_t size, const char * name);
+static void ivr_trace_finish(struct ast_channel * chan, const char * request, const char * target, const ivr_trace_t * trace, int response, int variables);
+static void ivr_trace_write(ivr_trace_log_t * log, struct ast_json * json);
+static void ivr_trace_close(ivr_trace_log_t * log);
 static int ivr_setresponse(struct ast_channel * chan, int response);
+static void ivr_setreceipt(struct ast_channel * chan, const ivr_receipt_t * receipt, const char * suffix);
+static const char * ivr_response_name(int response);
+static int ivr_cache_configure(ivr_cache_t * cache, unsigned int capacity);
+static void ivr_cache_unlink(ivr_cache_t * cache, ivr_cache_entry_t * entry);
+static int ivr_cache_get(ivr_cache_t * cache, const char * key, int * value);
+static void ivr_cache_put(ivr_cache_t * cache, const char * key, int value, unsigned int ttl);
+static int ivr_cache_flush(ivr_cache_t * cache, const char * key);
 static int sendmsg_exec(struct ast_channel *chan, const char *data);
 static int verifyrecipient_exec(struct ast_channel *chan, const char *data);
+static int querymessage_exec(struct ast_channel *chan, const char *data);
+static int load_server(ivr_config_t * config, const char * spec, uint16_t port, unsigned int weight);
+static void load_groups(struct ast_config * cfg);
+static void load_substitutions(struct ast_config * cfg);
+static void load_prompts(struct ast_config * cfg);
+static void load_overdial(struct ast_config * cfg);
+static ivr_prompt_t * ivr_prompt_find(const ivr_prompts_t * bank, const char * name);
+static int ivr_play(struct ast_channel * chan, const char * names, const char * digits);
+static int ivr_substitute(const char * code, char * text, size_t length);
+static void load_trace(struct ast_config * cfg, ivr_trace_log_t * log);
 static int load_config(ivr_context_t * ivr, int reload);
+static int ivr_configure(ivr_context_t * ivr);
 static int load_module(void);
 static int unload_module(void);
 static int reload(void);
 
 static ivr_context_t ivr_context = {.initialized = 0};
 
-AST_MUTEX_DEFINE_STATIC(ivr_mutex);
+static ivr_stats_t ivr_stats;
 
-static const struct ast_datastore_info ivr_datastore =
+static uint64_t ivr_clock_ms(void)
 {
-	.type = "crs_ivr",
-	.destroy = ivr_datastore_destroy
-};
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
+	return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
 
-static ivr_channel_t * ivr_channel_acquire()
+static uint64_t ivr_clock_us(void)
 {
-	int i;
-	ivr_context_t * ivr = &ivr_context;
-	ivr_channel_t * ivr_chan = 0;
-	ast_mutex_lock(&ivr_mutex);
+	struct timespec ts;
 
-	for (i = 0; i != IVR_CHANNELS; ++i)
-	{
-		if (ivr->channel[i].state == IVR_CHANNEL_STATE_CLOSED)
-		{
-			ivr_chan = &ivr->channel[i];
-			ivr_chan->state = IVR_CHANNEL_STATE_OPENING;
-			break;
-		}
-	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	ast_mutex_unlock(&ivr_mutex);
+	return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
 
-	if (ivr_chan == 0)
+static void ivr_histogram_record(ivr_histogram_t * histogram, uint64_t usec)
+{
+	unsigned int bucket = (usec != 0) ? (64 - __builtin_clzll(usec)) : 0;
+	uint64_t max;
+
+	if (bucket >= IVR_HISTOGRAM_BUCKETS)
 	{
-		return 0;
+		bucket = IVR_HISTOGRAM_BUCKETS - 1;
 	}
 
-	ivr_chan->pipe_response_fd[0] = -1;
-	ivr_chan->pipe_response_fd[1] = -1;
+	__sync_fetch_and_add(&histogram->bucket[bucket], 1);
+	__sync_fetch_and_add(&histogram->sum, usec);
+	__sync_fetch_and_add(&histogram->count, 1);
 
-	if (0 != pipe(ivr_chan->pipe_response_fd))
+	while (((max = histogram->max) < usec) && !__sync_bool_compare_and_swap(&histogram->max, max, usec))
 	{
-		ast_log(LOG_ERROR, "Unable to create response pipe.\n");
-		ivr_chan->state = IVR_CHANNEL_STATE_CLOSED;
-		return 0;
 	}
-
-	return ivr_chan;
-}
-
-static void ivr_channel_release(ivr_channel_t * ivr_chan)
-{
-	ivr_chan->state = IVR_CHANNEL_STATE_CLOSING;
 }
 
-static int ivr_load()
+//
+// Estimated usec below which permille thousandths of the samples fall,
+// interpolating within the bucket.
+//
+static uint64_t ivr_histogram_percentile(const ivr_histogram_t * histogram, unsigned int permille)
 {
-	ivr_context_t * ivr = &ivr_context;
-	int i;
+	uint64_t buckets[IVR_HISTOGRAM_BUCKETS];
+	uint64_t total = 0;
+	uint64_t target;
+	uint64_t low;
+	uint64_t high;
+	unsigned int i;
+
+	for (i = 0; i != IVR_HISTOGRAM_BUCKETS; ++i)
+	{
+		buckets[i] = histogram->bucket[i];
+		total += buckets[i];
+	}
 
-	if (__sync_bool_compare_and_swap(&(ivr->initialized), 0, 1))
+	if (total == 0)
 	{
-		for (i = 0; i != IVR_CHANNELS; ++i)
-		{
-			ivr->channel[i].state = IVR_CHANNEL_STATE_CLOSED;
-			ivr->channel[i].index = i;
-			ivr->channel[i].pipe_response_fd[0] = -1;
-			ivr->channel[i].pipe_response_fd[1] = -1;
-		}
+		return 0;
+	}
 
-		snprintf(ivr->tagBase, sizeof(ivr->tagBase), "m%02x-%08x-", getpid() % 256, (unsigned int)time(0));
+	target = ((total * permille) + 999) / 1000;
 
-		ivr->pipe_request_fd[0] = -1;
-		ivr->pipe_request_fd[1] = -1;
-		ivr->thread = -1;
+	for (i = 0; (i != IVR_HISTOGRAM_BUCKETS - 1) && (target > buckets[i]); ++i)
+	{
+		target -= buckets[i];
+	}
 
-		if (0 != pipe(ivr->pipe_request_fd))
-		{
-			ast_log(LOG_ERROR, "Unable to create IVR request pipe.\n");
-			return 0;
-		}
+	low = (i != 0) ? (1ULL << (i - 1)) : 0;
+	high = (i != 0) ? (1ULL << i) : 1;
 
-		if (pthread_create(&ivr->thread, NULL, ivr_worker_task, ivr))
-		{
-			ast_log(LOG_ERROR, "Unable to create IVR worker thread.\n");
-			return 0;
-		}
+	if (high > histogram->max)
+	{
+		high = histogram->max;
+	}
 
-		ast_log(LOG_NOTICE, "IVR subsystem loaded (%u channels).\n", IVR_CHANNELS);
-		
-		return 1;
+	if (high < low)
+	{
+		return low;
 	}
 
-	return 0;
+	return low + (((high - low) * target) / buckets[i]);
 }
 
-static void ivr_unload()
+static unsigned int ivr_stats_op(int code)
 {
-	ivr_context_t * ivr = &ivr_context;
-	int i;
-
-	const ivr_request_t ivr_request_stop = 
-		{.code = IVR_REQUEST_STOP};
-
-	if (__sync_bool_compare_and_swap(&(ivr->initialized), 1, 0))
+	switch (code)
 	{
-		if (ivr->thread != -1)
-		{
-			if (sizeof(ivr_request_stop) != write(ivr->pipe_request_fd[1], &ivr_request_stop, sizeof(ivr_request_stop)))
-			{
-				return;
-			}
+		case IVR_REQUEST_VERIFYRECIPIENT:
+			return IVR_STAT_VERIFY;
 
-			if (pthread_join(ivr->thread, 0))
-			{
-				return;
-			}
-
-			ast_log(LOG_NOTICE, "IVR worker thread stopped.\n");
-
-			ivr->thread = -1;
-		}
-
-		for (i = 0; i != IVR_CHANNELS; ++i)
-		{
-			if (ivr->channel[i].pipe_response_fd[0] != -1)
-			{
-				close(ivr->channel[i].pipe_response_fd[0]);
-			}
-
-			if (ivr->channel[i].pipe_response_fd[1] != -1)
-			{
-				close(ivr->channel[i].pipe_response_fd[1]);
-			}
-		}
-
-		if (ivr->pipe_request_fd[0] != -1)
-		{
-			close(ivr->pipe_request_fd[0]);
-			ivr->pipe_request_fd[0] = -1;
-		}
+		case IVR_REQUEST_SENDMESSAGE:
+			return IVR_STAT_SEND;
 
-		if (ivr->pipe_request_fd[1] != -1)
-		{
-			close(ivr->pipe_request_fd[1]);
-			ivr->pipe_request_fd[1] = -1;
-		}
+		case IVR_REQUEST_QUERYMESSAGE:
+			return IVR_STAT_QUERY;
 
-		ast_log(LOG_NOTICE, "IVR subsystem unloaded.\n");
+		default:
+			return IVR_STAT_PING;
 	}
 }
 
-static void ivr_worker_gc(ivr_context_t * ivr)
+static void ivr_stats_reset(ivr_stats_t * stats)
 {
-	int i;
-	ivr_channel_t * ivr_chan = 0;
+	memset(stats, 0, sizeof(*stats));
+	__sync_synchronize();
+	time(&stats->reset);
+}
 
-	for (i = 0; i != IVR_CHANNELS; ++i)
-	{
-		ivr_chan = &ivr->channel[i];
+AST_MUTEX_DEFINE_STATIC(ivr_mutex);
 
-		if (ivr_chan->state == IVR_CHANNEL_STATE_CLOSING)
-		{
-			if (ivr_chan->pipe_response_fd[0] != -1)
-			{
-				close(ivr_chan->pipe_response_fd[0]);
-			}
+static ivr_cache_t ivr_verify_cache = {.lock = AST_MUTEX_INIT_VALUE, .name = "verify"};
+static ivr_cache_t ivr_message_cache = {.lock = AST_MUTEX_INIT_VALUE, .name = "message"};
+static ivr_outbox_t ivr_outbox = {.lock = AST_MUTEX_INIT_VALUE, .fd = -1, .thread = -1};
+static ivr_trace_log_t ivr_trace_log = {.lock = AST_MUTEX_INIT_VALUE};
 
-			if (ivr_chan->pipe_response_fd[1] != -1)
-			{
-				close(ivr_chan->pipe_response_fd[0]);
-			}
+static AO2_GLOBAL_OBJ_STATIC(ivr_groups);
+static AO2_GLOBAL_OBJ_STATIC(ivr_substitutions);
+static AO2_GLOBAL_OBJ_STATIC(ivr_prompts);
+static AO2_GLOBAL_OBJ_STATIC(ivr_overdial);
 
-			ivr_chan->pipe_response_fd[0] = -1;
-			ivr_chan->pipe_response_fd[1] = -1;
+static const char * ivr_overdial_keys[IVR_OVERDIAL_PROMPTS][2] =
+{
+	{"welcome", "crs-welcome-generic"},
+	{"pager_number", "crs-prompt-pager-number"},
+	{"pager_message", "crs-prompt-pager-message"},
+	{"pager_invalid", "crs-pager-invalid"},
+	{"pager_unavailable", "crs-pager-unavailable"},
+	{"system_unavailable", "crs-system-unavailable"},
+	{"message_sent", "crs-message-sent"},
+	{"message_failed", "crs-message-failed"},
+	{"message_not_sent", "crs-message-not-sent"},
+};
 
-			ivr_chan->index += 0x00000100;
-			ivr_chan->state = IVR_CHANNEL_STATE_CLOSED;
-		}
+static const struct ast_datastore_info ivr_datastore =
+{
+	.type = "crs_ivr",
+	.destroy = ivr_datastore_destroy
+};
+
+static const struct ast_datastore_info ivr_speculation_datastore =
+{
+	.type = "crs_ivr_speculation",
+	.destroy = ast_free_ptr
+};
+
+
+static ivr_channel_t * ivr_channel_lookup(ivr_context_t * ivr, unsigned int index)
+{
+	unsigned int slot = index & IVR_CHANNEL_SLOT_MASK;
+
+	if (slot >= ivr->channel_count)
+	{
+		return 0;
 	}
+
+	__sync_synchronize();
+
+	return &ivr->segment[slot / IVR_CHANNEL_SEGMENT][slot % IVR_CHANNEL_SEGMENT];
 }
 
-static void ivr_worker_connect_ip(ivr_context_t * ivr, struct sockaddr_in * address)
+static void ivr_channel_push(ivr_context_t * ivr, ivr_channel_t * ivr_chan)
 {
-	char text[50];
+	uint64_t head;
+	uint64_t next;
 
-	if (address == 0)
+	do
 	{
-		return;
+		head = ivr->channel_free;
+		ivr_chan->next = (uint32_t)head;
+		next = (((head >> 32) + 1) << 32) | ((ivr_chan->index & IVR_CHANNEL_SLOT_MASK) + 1);
 	}
+	while (!__sync_bool_compare_and_swap(&ivr->channel_free, head, next));
+}
 
-	ivr->sock_fd.fd = socket(AF_INET, SOCK_STREAM, 0);
+static ivr_channel_t * ivr_channel_pop(ivr_context_t * ivr)
+{
+	uint64_t head;
+	uint64_t next;
+	ivr_channel_t * ivr_chan;
 
-	if (ivr->sock_fd.fd < 0)
+	do
 	{
-		return;
+		head = ivr->channel_free;
+
+		if ((uint32_t)head == 0)
+		{
+			return 0;
+		}
+
+		ivr_chan = ivr_channel_lookup(ivr, (uint32_t)head - 1);
+		next = (((head >> 32) + 1) << 32) | ivr_chan->next;
+	}
+	while (!__sync_bool_compare_and_swap(&ivr->channel_free, head, next));
+
+	return ivr_chan;
+}
+
+//
+// Grow the pool by whole segments until it holds at least count channels.
+// Segments are never released while the module is loaded, so channel
+// pointers stay valid for the worker thread without locking.
+//
+static int ivr_channel_grow(ivr_context_t * ivr, unsigned int count)
+{
+	ivr_channel_t * segment;
+	unsigned int first;
+	unsigned int i;
+	int grown = 0;
+
+	ast_mutex_lock(&ivr_mutex);
+
+	if (count > ivr->channel_max)
+	{
+		count = ivr->channel_max;
 	}
 
-	if (connect(ivr->sock_fd.fd, (struct sockaddr *)address, sizeof(*address)) != 0)
+	while (ivr->channel_count < count)
 	{
-		if (ivr->flag_connect_notify == 0)
+		first = ivr->channel_count;
+
+		if ((first / IVR_CHANNEL_SEGMENT) >= IVR_CHANNEL_SEGMENTS)
 		{
-			ivr->flag_connect_notify = 1;
+			break;
+		}
 
-			if (0 != inet_ntop(AF_INET, &(address->sin_addr), text, sizeof(text)))
-			{
-				ast_log(LOG_NOTICE, "unable to connect to IVR server %s:%u.\n", text, ntohs(address->sin_port));
-			}
-			else
+		segment = mmap(0, IVR_CHANNEL_SEGMENT * sizeof(ivr_channel_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+		if (segment == MAP_FAILED)
+		{
+			ast_log(LOG_ERROR, "Unable to allocate IVR channel segment (%s).\n", strerror(errno));
+			break;
+		}
+
+		for (i = 0; i != IVR_CHANNEL_SEGMENT; ++i)
+		{
+			segment[i].state = IVR_CHANNEL_STATE_CLOSED;
+			segment[i].index = first + i;
+			segment[i].event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+			if (segment[i].event_fd < 0)
 			{
-				ast_log(LOG_NOTICE, "unable to connect to IVR server.\n");
+				ast_log(LOG_ERROR, "Unable to create IVR channel event (%s).\n", strerror(errno));
+				break;
 			}
 		}
-	
-		close(ivr->sock_fd.fd);
-		ivr->sock_fd.fd = -1;
-	}
-	else
-	{
-		ivr->flag_connect_notify = 0;
 
-		if (0 != inet_ntop(AF_INET, &(address->sin_addr), text, sizeof(text)))
+		if (i != IVR_CHANNEL_SEGMENT)
 		{
-			ast_log(LOG_NOTICE, "connected to IVR server %s:%u.\n", text, ntohs(address->sin_port));
+			while (i != 0)
+			{
+				close(segment[--i].event_fd);
+			}
+
+			munmap(segment, IVR_CHANNEL_SEGMENT * sizeof(ivr_channel_t));
+			break;
 		}
-		else
+
+		ivr->segment[first / IVR_CHANNEL_SEGMENT] = segment;
+
+		__sync_synchronize();
+
+		ivr->channel_count = first + IVR_CHANNEL_SEGMENT;
+
+		for (i = IVR_CHANNEL_SEGMENT; i != 0; --i)
 		{
-			ast_log(LOG_NOTICE, "connected to IVR server.\n");
+			ivr_channel_push(ivr, &segment[i - 1]);
 		}
+
+		grown = 1;
 	}
+
+	ast_mutex_unlock(&ivr_mutex);
+
+	return grown;
 }
 
-static void ivr_worker_connect(ivr_context_t * ivr)
+static ivr_channel_t * ivr_channel_acquire(ivr_context_t * ivr)
 {
-	time_t now;
+	ivr_channel_t * ivr_chan;
 
-	time(&now);
+	ivr_chan = ivr_channel_pop(ivr);
 
-	if ((now - ivr->time_connectattempt) < IVR_CONNECT_SEC)
+	while ((ivr_chan == 0) && ivr_channel_grow(ivr, ivr->channel_count + 1))
 	{
-		return;
+		ivr_chan = ivr_channel_pop(ivr);
 	}
 
-	if (ivr->sock_fd.fd < 0)
+	if (ivr_chan == 0)
 	{
-		ivr_worker_connect_ip(ivr, ivr->address[0]);
+		ivr_chan = ivr_channel_pop(ivr);
 	}
 
-	if (ivr->sock_fd.fd < 0)
+	if (ivr_chan == 0)
 	{
-		ivr_worker_connect_ip(ivr, ivr->address[1]);
+		__sync_fetch_and_add(&ivr_stats.exhausted, 1);
+		ast_log(LOG_WARNING, "IVR channel pool exhausted (%u channels).\n", ivr->channel_count);
+		return 0;
 	}
 
-	if (ivr->sock_fd.fd < 0)
-	{
-		ivr->time_connectattempt = now;
-	}
-}
+	ivr_chan->async = 0;
+	ivr_chan->outbox = 0;
+	ivr_chan->state = IVR_CHANNEL_STATE_OPEN;
 
-static void ivr_worker_disconnect(ivr_context_t * ivr)
-{
-	if (ivr->sock_fd.fd >= 0)
-	{
-		close(ivr->sock_fd.fd);
-		ivr->sock_fd.fd = -1;
-	}
+	return ivr_chan;
 }
 
-static void ivr_worker_ping_server(ivr_context_t * ivr)
+//
+// Start a new transaction on a channel.  The generation is bumped for every
+// request so a late response to an abandoned request is never taken as the
+// response to the next one, and each SendMessage gets a distinct tag.
+//
+static unsigned int ivr_channel_begin(ivr_channel_t * ivr_chan)
 {
-	const struct timespec wait_time = {.tv_sec = IVR_SERVER_SEC, .tv_nsec = 0};
-	uint8_t response;
-	char server_request[128];
-	int server_request_length;
-
-	time_t now;
+	uint64_t signal;
 
-	time(&now);
+	ivr_chan->index += IVR_CHANNEL_GENERATION;
+	ivr_chan->stamp[0] = 0;
+	ivr_chan->stamp[1] = 0;
+	ivr_chan->stamp[2] = 0;
+	ivr_chan->stamp[3] = 0;
+	ivr_chan->position = -1;
+	ivr_chan->reference[0] = 0;
 
-	if ((now - ivr->time_transaction) < IVR_PING_SEC)
-	{
-		return;
-	}
+	__sync_synchronize();
 
-	if (ivr->sock_fd.fd < 0)
+	while (sizeof(signal) == read(ivr_chan->event_fd, &signal, sizeof(signal)))
 	{
-		return;
 	}
 
-	server_request_length = sprintf
-	(
-		server_request,
-		"[p:%s]",
-		ivr->client_id
-	);
+	return ivr_chan->index;
+}
 
-	if (write(ivr->sock_fd.fd, server_request, server_request_length) != server_request_length)
-	{
-		ivr->time_transaction = now;
-		ivr_worker_disconnect(ivr);
-		return;
-	}	
+static void ivr_channel_release(ivr_channel_t * ivr_chan)
+{
+	ivr_chan->state = IVR_CHANNEL_STATE_CLOSING;
+}
 
-	ivr->time_transaction = now;
+//
+// Abandon the request in progress on a channel, handing the slot to the
+// worker: a request not yet sent is skipped, and the slot is freed when the
+// response arrives.  Whichever of the caller and the worker sees the other's
+// write releases it, so a response racing the hangup does not leak the slot.
+//
+static void ivr_channel_cancel(ivr_channel_t * ivr_chan)
+{
+	unsigned int index = ivr_chan->index;
 
-	if (ppoll(&ivr->sock_fd, 1, &wait_time, 0) > 0)
+	if (!__sync_bool_compare_and_swap(&ivr_chan->state, IVR_CHANNEL_STATE_OPEN, IVR_CHANNEL_STATE_CANCELLED))
 	{
-		if (sizeof(response) != read(ivr->sock_fd.fd, &response, sizeof(response)))
-		{
-			ivr_worker_disconnect(ivr);
-		}
+		return;
 	}
-	else
+
+	if ((uint32_t)(ivr_chan->result >> 32) == index)
 	{
-		ivr_worker_disconnect(ivr);
+		__sync_bool_compare_and_swap(&ivr_chan->state, IVR_CHANNEL_STATE_CANCELLED, IVR_CHANNEL_STATE_CLOSING);
 	}
 }
 
-static void ivr_worker_transact_server(ivr_context_t * ivr, const ivr_request_t * request)
+static int ivr_load(ivr_context_t * ivr)
 {
-	time_t now;
-	static uint8_t error_unknown = IVR_RESPONSE_FAIL_UNKNOWNREQUEST;
-	static uint8_t error_noserver = IVR_RESPONSE_FAIL_SYSTEMNOTAVAILABLE;
-	const struct timespec wait_time = {.tv_sec = IVR_SERVER_SEC, .tv_nsec = 0};
-
-	ivr_channel_t * ivr_chan = &ivr->channel[request->index & 0xff];
+	ivr_shard_t * shard;
+	unsigned int i;
+	unsigned int j;
 
-	char server_request[128];
-	int server_request_length;
-	uint8_t response;
-
-	if (ivr_chan->index != request->index)
+	if (__sync_bool_compare_and_swap(&(ivr->initialized), 0, 1))
 	{
-		return;
-	}
+		ivr->channel_count = 0;
+		ivr->channel_free = 0;
 
-	if (ivr->sock_fd.fd < 0)
-	{
-		if (sizeof(error_noserver) != write(ivr_chan->pipe_response_fd[1], &error_noserver, sizeof(error_noserver)))
+		if (!ivr_channel_grow(ivr, ivr->channel_initial))
 		{
-			ast_log(LOG_ERROR, "Unable to write to response pipe (1).\n");
+			ast_log(LOG_ERROR, "Unable to allocate IVR channel pool.\n");
+			return 0;
 		}
 
-		return;
-	}
-
-	if (request->code == IVR_REQUEST_VERIFYRECIPIENT)
-	{
-		server_request_length = sprintf
-		(
-			server_request,
-			"[%c:%s,%s]",
-			request->code,
-			ivr->client_id,
-			request->param[0]
-		);
-	}
+		ivr->session = time(0);
+		snprintf(ivr->tagBase, sizeof(ivr->tagBase), "m%02x-%08x-", getpid() % 256, ivr->session);
 
-	else if (request->code == IVR_REQUEST_SENDMESSAGE)
-	{
-		server_request_length = sprintf
-		(
-			server_request,
-			"[%c:%s,%s%08x,%s,%s,%s]",
-			request->code,
-			ivr->client_id,
-			ivr->tagBase,
-			ivr_chan->index,
-			request->param[0],
-			request->param[1],
-			request->param[2]
-		);
-	}
+		ivr->shard_count = ivr->shards;
 
-	else
-	{
-		if (sizeof(error_unknown) != write(ivr_chan->pipe_response_fd[1], &error_unknown, sizeof(error_unknown)))
+		for (i = 0; i != ivr->shard_count; ++i)
 		{
-			ast_log(LOG_ERROR, "Unable to write to response pipe (2).\n");
+			shard = &ivr->shard[i];
+			shard->ivr = ivr;
+			shard->id = i;
+			shard->cpu = (ivr->cpu_count != 0) ? ivr->cpus[i % ivr->cpu_count] : -1;
+			shard->doorbell_fd = -1;
+			shard->ring = 0;
+			shard->ring_size = ivr->queue;
+			shard->ring_head = 0;
+			shard->ring_tail = 0;
+			shard->sleeping = 0;
+			shard->stop = 0;
+			shard->config = 0;
+			shard->backend = ivr->backend;
+			shard->thread = -1;
 		}
 
-		return;
-	}
-
-	if (write(ivr->sock_fd.fd, server_request, server_request_length) < 0)
-	{
-		if (sizeof(error_noserver) != write(ivr_chan->pipe_response_fd[1], &error_noserver, sizeof(error_noserver)))
+		for (i = 0; i != ivr->shard_count; ++i)
 		{
-			ast_log(LOG_ERROR, "Unable to write to response pipe (3).\n");
-		}
+			shard = &ivr->shard[i];
 
-		ivr_worker_disconnect(ivr);
-		return;
-	}
+			// io_uring reads the doorbell itself, which needs a blocking eventfd
+			shard->doorbell_fd = eventfd(0, (shard->backend == IVR_BACKEND_URING) ? EFD_CLOEXEC : (EFD_NONBLOCK | EFD_CLOEXEC));
+
+			if (shard->doorbell_fd < 0)
+			{
+				ast_log(LOG_ERROR, "Unable to create IVR request doorbell.\n");
+				return 0;
+			}
 
-	time(&now);
-	ivr->time_transaction = now;
+			shard->ring = mmap(0, shard->ring_size * sizeof(ivr_ring_cell_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
 
-    if (ppoll(&ivr->sock_fd, 1, &wait_time, 0) > 0)
-	{
-		if (sizeof(response) == read(ivr->sock_fd.fd, &response, sizeof(response)))
-		{
-			if (sizeof(response) != write(ivr_chan->pipe_response_fd[1], &response, sizeof(response)))
+			if (shard->ring == MAP_FAILED)
 			{
-				ast_log(LOG_ERROR, "Unable to write to response pipe (4).\n");
+				ast_log(LOG_ERROR, "Unable to allocate IVR request queue.\n");
+				shard->ring = 0;
+				return 0;
 			}
-		}
-		else
-		{
-			if (sizeof(error_noserver) != write(ivr_chan->pipe_response_fd[1], &error_noserver, sizeof(error_noserver)))
+
+			for (j = 0; j != shard->ring_size; ++j)
 			{
-				ast_log(LOG_ERROR, "Unable to write to response pipe (5).\n");
+				shard->ring[j].sequence = j;
 			}
 
-			ivr_worker_disconnect(ivr);
-		}
-	}
-	else
-	{
-		if (sizeof(error_noserver) != write(ivr_chan->pipe_response_fd[1], &error_noserver, sizeof(error_noserver)))
-		{
-			ast_log(LOG_ERROR, "Unable to write to response pipe (6).\n");
+			if (pthread_create(&shard->thread, NULL, ivr_worker_task, shard))
+			{
+				ast_log(LOG_ERROR, "Unable to create IVR worker thread.\n");
+				shard->thread = -1;
+				return 0;
+			}
 		}
 
-		ivr_worker_disconnect(ivr);
+		ast_log(LOG_NOTICE, "IVR subsystem loaded (%u channels, %u max, %u workers).\n", ivr->channel_count, ivr->channel_max, ivr->shard_count);
+		
+		return 1;
 	}
+
+	return 0;
 }
 
-static void * ivr_worker_task(void *arg)
+static void ivr_unload(ivr_context_t * ivr)
 {
-	ivr_context_t * ivr = (ivr_context_t *)arg;
-	int i;
-	ivr_request_t request[8];
-	ivr_request_t * prequest;
-	int readlen;
-
-	const struct timespec wait_time = {.tv_sec = 2, .tv_nsec = 0};
-
-	ast_log(LOG_NOTICE, "IVR worker thread started.\n");
-
-	ivr->pipe_fd.fd = ivr->pipe_request_fd[0];
-	ivr->pipe_fd.events = POLLIN | POLLPRI;
-
-	ivr->sock_fd.fd = -1;
-	ivr->sock_fd.events = POLLIN | POLLPRI;
+	ivr_channel_t * ivr_chan;
+	ivr_shard_t * shard;
+	unsigned int running = 0;
+	unsigned int i;
 
-	while (1)
+	if (__sync_bool_compare_and_swap(&(ivr->initialized), 1, 0))
 	{
-		ivr_worker_gc(ivr);
-		ivr_worker_connect(ivr);
-		ivr_worker_ping_server(ivr);
-
-    	if (ppoll(&ivr->pipe_fd, 1, &wait_time, 0) > 0)
+		// every worker is told first, so they stop together
+		for (i = 0; i != ivr->shard_count; ++i)
 		{
-			if (0 != (ivr->pipe_fd.revents & POLLIN))
-			{
-				readlen = read(ivr->pipe_request_fd[0], request, sizeof(request));
+			shard = &ivr->shard[i];
 
-				for (i = 0; i != readlen/sizeof(ivr_request_t); ++i)
-				{
-					prequest = &request[i];
-
-					if (prequest->code == IVR_REQUEST_STOP)
-					{
-						ast_log(LOG_NOTICE, "worker thread stopped.\n");
-						return 0;
-					}
-
-					else if (prequest->code == IVR_REQUEST_CONFIG)
-					{
-						ast_copy_string(ivr->client_id, prequest->client_id, sizeof(ivr->client_id));
-
-						ivr->a[0] = prequest->address[0];
-						ivr->address[0] = &ivr->a[0];
-
-						if (prequest->valid[1])
-						{
-							ivr->a[1] = prequest->address[1];
-							ivr->address[1] = &ivr->a[1];
-						}
-						else
-						{
-							ivr->address[1] = 0;
-						}
-
-						ast_log(LOG_NOTICE, "worker thread applied configuration.\n");
-					}
-
-					else
-					{
-						ivr_worker_transact_server(ivr, prequest);
-					}
-				}
-			}
-			else if (0 != (ivr->pipe_fd.revents & (POLLERR | POLLHUP)))
+			if (shard->thread != -1)
 			{
-				ast_log(LOG_ERROR, "Error reading from request pipe.\n");
+				shard->stop = 1;
+				__sync_synchronize();
+				ivr_shard_wake(shard);
 			}
 		}
-	}
-}
 
-int ivr_wait(struct ast_channel *c, int fd)
-{
-	uint8_t response;
-	struct ast_frame *f;
-	struct ast_channel *rchan;
-	int outfd;
-	int ms = (IVR_SERVER_SEC * 1000) + 500;
+		for (i = 0; i != ivr->shard_count; ++i)
+		{
+			shard = &ivr->shard[i];
 
-	// Stop if we're a zombie or need a soft hangup
-	if (ast_test_flag(ast_channel_flags(c), AST_FLAG_ZOMBIE) || ast_check_hangup(c)) 
-	{
-		return IVR_RESPONSE_FAIL_HANGUP;
-	}
+			if (shard->thread != -1)
+			{
+				if (pthread_join(shard->thread, 0))
+				{
+					ast_log(LOG_ERROR, "Unable to join IVR worker thread %u.\n", i);
+					++running;
+					continue;
+				}
 
-	while(ms)
-	{
-		rchan = ast_waitfor_nandfds(&c, 1, &fd, 1, NULL, &outfd, &ms);
+				ast_log(LOG_NOTICE, "IVR worker thread %u stopped.\n", i);
 
-		if ((!rchan) && (outfd < 0) && (ms))
-		{ 
-			ast_log(LOG_WARNING, "ivr_wait failed (%s)\n", strerror(errno));
-			return -1;
+				shard->thread = -1;
+			}
+
+			ao2_cleanup(__sync_lock_test_and_set(&shard->config, 0));
 		}
 
-		else if (outfd > -1)
+		// what a worker still running might touch is left in place
+		if (running != 0)
+		{
+			ast_log(LOG_ERROR, "IVR subsystem unloaded with %u worker threads running.\n", running);
+			return;
+		}
+
+		for (i = 0; i != ivr->channel_count; ++i)
 		{
-			if (sizeof(response) != read(outfd, &response, sizeof(response)))
+			ivr_chan = ivr_channel_lookup(ivr, i);
+
+			if (ivr_chan->event_fd != -1)
 			{
-				return -1;
+				close(ivr_chan->event_fd);
+				ivr_chan->event_fd = -1;
 			}
-			else
+		}
+
+		for (i = 0; i != IVR_CHANNEL_SEGMENTS; ++i)
+		{
+			if (ivr->segment[i] != 0)
 			{
-				return response;
+				munmap(ivr->segment[i], IVR_CHANNEL_SEGMENT * sizeof(ivr_channel_t));
+				ivr->segment[i] = 0;
 			}
 		}
 
-		else if (rchan)
-		{
-			f = ast_read(c);
+		ivr->channel_count = 0;
+		ivr->channel_free = 0;
 
-			if (f == 0)
-			{	
-				return IVR_RESPONSE_FAIL_INTERNAL;
-          	}
+		for (i = 0; i != ivr->shard_count; ++i)
+		{
+			shard = &ivr->shard[i];
 
-			if (f->frametype == AST_FRAME_CONTROL)
+			if (shard->doorbell_fd != -1)
 			{
-				switch(f->subclass.integer)
-				{
-					case AST_CONTROL_HANGUP:
-						ast_frfree(f);
-						return IVR_RESPONSE_FAIL_HANGUP;
-
-					case AST_CONTROL_RINGING:
-					case AST_CONTROL_ANSWER:
-						break;
-
-					default:
-						ast_log(LOG_WARNING, "Unexpected control subclass '%d'\n", f->subclass.integer);
-						break;
-				}
+				close(shard->doorbell_fd);
+				shard->doorbell_fd = -1;
 			}
 
-			ast_frfree(f);
+			if (shard->ring != 0)
+			{
+				munmap(shard->ring, shard->ring_size * sizeof(ivr_ring_cell_t));
+				shard->ring = 0;
+			}
 		}
+
+		ivr->shard_count = 0;
+
+		ast_log(LOG_NOTICE, "IVR subsystem unloaded.\n");
 	}
+}
 
-	return IVR_RESPONSE_FAIL_INTERNAL; // Time is up
+static ivr_shard_t * ivr_shard(ivr_context_t * ivr, unsigned int index)
+{
+	return &ivr->shard[(index & IVR_CHANNEL_SLOT_MASK) % ivr->shard_count];
 }
 
-static void ivr_datastore_destroy(void *data)
+//
+// Queue a request for a shard's worker.  No system call is made unless the
+// worker is asleep.  Returns 0 when the queue is full.
+//
+static int ivr_shard_send(ivr_shard_t * shard, const ivr_request_t * request)
 {
-	ivr_channel_t * ivr_chan = (ivr_channel_t *)data;
+	const uint64_t signal = 1;
+	ivr_ring_cell_t * cell;
+	unsigned int tail;
+	int diff;
 
-	if (ivr_chan != 0)
+	while (1)
 	{
-		ivr_channel_release(ivr_chan);
+		tail = shard->ring_tail;
+		cell = &shard->ring[tail & (shard->ring_size - 1)];
+		diff = (int)(cell->sequence - tail);
+
+		if (diff < 0)
+		{
+			return 0;
+		}
+
+		if ((diff == 0) && __sync_bool_compare_and_swap(&shard->ring_tail, tail, tail + 1))
+		{
+			break;
+		}
+	}
+
+	cell->request = *request;
+
+	__sync_synchronize();
+
+	cell->sequence = tail + 1;
+
+	__sync_synchronize();
+
+	if (shard->sleeping)
+	{
+		if (sizeof(signal) != write(shard->doorbell_fd, &signal, sizeof(signal)))
+		{
+			ast_log(LOG_ERROR, "Unable to wake IVR worker thread %u.\n", shard->id);
+		}
 	}
+
+	return 1;
 }
 
-static ivr_channel_t * ivr_get_channel(struct ast_channel * chan)
+//
+// Ring the doorbell whether or not the worker sleeps, for a stop or a
+// configuration, which the worker takes ahead of its queue.
+//
+static void ivr_shard_wake(ivr_shard_t * shard)
 {
-	ivr_channel_t * ivr_chan;
-	struct ast_datastore * datastore;
+	const uint64_t signal = 1;
 
-	datastore = ast_channel_datastore_find(chan, &ivr_datastore, 0);
-	
-	if (datastore == 0)
+	if (sizeof(signal) != write(shard->doorbell_fd, &signal, sizeof(signal)))
 	{
-		ivr_chan = ivr_channel_acquire();
-		datastore = ast_datastore_alloc(&ivr_datastore, 0);
-		datastore->data = ivr_chan;
-		ast_channel_datastore_add(chan, datastore);
-		return ivr_chan;
+		ast_log(LOG_ERROR, "Unable to wake IVR worker thread %u.\n", shard->id);
 	}
-	else
+}
+
+static ivr_request_t * ivr_ring_peek(ivr_shard_t * shard)
+{
+	ivr_ring_cell_t * cell = &shard->ring[shard->ring_head & (shard->ring_size - 1)];
+
+	if (cell->sequence != (shard->ring_head + 1))
 	{
-		return (ivr_channel_t *)datastore->data;
+		return 0;
 	}
+
+	__sync_synchronize();
+
+	return &cell->request;
 }
 
-static int ivr_sendmessage(struct ast_channel * chan, const char * recipient, const char *message, const char * caller)
+static void ivr_ring_pop(ivr_shard_t * shard)
 {
-	ivr_context_t * ivr = &ivr_context;
-	ivr_channel_t * ivr_chan = ivr_get_channel(chan);
-	ivr_request_t request;
+	ivr_ring_cell_t * cell = &shard->ring[shard->ring_head & (shard->ring_size - 1)];
 
-	if (ivr_chan == 0)
+	__sync_synchronize();
+
+	cell->sequence = shard->ring_head + shard->ring_size;
+	++shard->ring_head;
+}
+
+static void ivr_worker_gc(ivr_shard_t * shard)
+{
+	unsigned int i;
+	unsigned int count = shard->ivr->channel_count;
+	ivr_channel_t * ivr_chan = 0;
+
+	for (i = shard->id; i < count; i += shard->ivr->shard_count)
 	{
-		return IVR_RESPONSE_FAIL_SYSTEMNOTAVAILABLE;
+		ivr_chan = ivr_channel_lookup(shard->ivr, i);
+
+		if (ivr_chan->state == IVR_CHANNEL_STATE_CLOSING)
+		{
+			ivr_chan->index += IVR_CHANNEL_GENERATION;
+			ivr_chan->state = IVR_CHANNEL_STATE_CLOSED;
+			ivr_channel_push(shard->ivr, ivr_chan);
+		}
 	}
+}
 
-	request.code = IVR_REQUEST_SENDMESSAGE;
-	request.index = ivr_chan->index;
+static void ivr_worker_connect_notify(ivr_server_t * server, const char * failure)
+{
+	struct sockaddr_in * address = &server->address;
+	char text[50];
 
-	if ((recipient == 0) || (recipient[0] == 0))
+	if (0 == inet_ntop(AF_INET, &(address->sin_addr), text, sizeof(text)))
 	{
-		return IVR_RESPONSE_FAIL_INTERNAL;
+		ast_copy_string(text, "?", sizeof(text));
 	}
-	else
+
+	if (failure != 0)
 	{
-		ast_copy_string(request.param[0], recipient, sizeof(request.param[0]));
+		__sync_fetch_and_add(&ivr_stats.connect_failures, 1);
 	}
 
-	if ((message == 0) || (message[0] == 0))
+	if (failure == 0)
 	{
-		ast_copy_string(request.param[1], "no message", sizeof(request.param[1]));
+		server->flag_connect_notify = 0;
+		server->flag_frame_notify = 0;
+		ast_log(LOG_NOTICE, "connected to IVR server %s:%u.\n", text, ntohs(address->sin_port));
 	}
-	else
+	else if (server->flag_connect_notify == 0)
 	{
-		ast_copy_string(request.param[1], message, sizeof(request.param[1]));
+		server->flag_connect_notify = 1;
+		ast_log(LOG_NOTICE, "unable to connect to IVR server %s:%u (%s).\n", text, ntohs(address->sin_port), failure);
 	}
+}
+
+static void ivr_worker_socket_options(ivr_shard_t * shard, int fd)
+{
+	const ivr_socket_options_t * options = &shard->socket;
+	int value;
+
+	value = options->nodelay;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value));
 
-	if ((caller == 0) || (caller[0] == 0))
+	value = options->keepalive;
+	setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &value, sizeof(value));
+
+	if (options->keepalive && (options->keepidle != 0))
 	{
-		ast_copy_string(request.param[2], "unknown caller", sizeof(request.param[2]));
+		setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &options->keepidle, sizeof(options->keepidle));
 	}
-	else
+
+	if (options->keepalive && (options->keepintvl != 0))
 	{
-		ast_copy_string(request.param[2], caller, sizeof(request.param[2]));
+		setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &options->keepintvl, sizeof(options->keepintvl));
 	}
 
-	request.param[3][0] = 0;
+	if (options->keepalive && (options->keepcnt != 0))
+	{
+		setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &options->keepcnt, sizeof(options->keepcnt));
+	}
 
-	if (write(ivr->pipe_request_fd[1], &request, sizeof(request)) != sizeof(request))
+	if (options->user_timeout != 0)
 	{
-		return IVR_RESPONSE_FAIL_INTERNAL;
+		setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &options->user_timeout, sizeof(options->user_timeout));
 	}
+}
 
-	return ivr_wait(chan, ivr_chan->pipe_response_fd[0]);
-} 
+//
+// Start a non-blocking connection attempt.  It completes in
+// ivr_worker_connected() or is abandoned by ivr_worker_connect() once the
+// connect timeout passes.
+//
+static void ivr_worker_connect_ip(ivr_shard_t * shard, ivr_server_t * server)
+{
+	int fd;
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+	if (fd < 0)
+	{
+		ivr_worker_connect_notify(server, strerror(errno));
+		return;
+	}
+
+	ivr_worker_socket_options(shard, fd);
 
-static int ivr_verifyrecipient(struct ast_channel * chan, const char * recipient)
+	server->connect_fd = fd;
+	server->connect_started = ivr_clock_us();
+	server->connect_deadline = ivr_clock_ms() + shard->socket.connect_timeout;
+
+	if (connect(fd, (struct sockaddr *)&server->address, sizeof(server->address)) == 0)
+	{
+		ivr_worker_connected(shard, server);
+	}
+	else if (errno != EINPROGRESS)
+	{
+		ivr_worker_connect_notify(server, strerror(errno));
+		close(fd);
+		server->connect_fd = -1;
+	}
+}
+
+static void ivr_worker_connected(ivr_shard_t * shard, ivr_server_t * server)
 {
-	ivr_context_t * ivr = &ivr_context;
-	ivr_channel_t * ivr_chan = ivr_get_channel(chan);
-	ivr_request_t request;
+	int error = 0;
+	socklen_t length = sizeof(error);
+	int fd = server->connect_fd;
 
-	if (ivr_chan == 0)
+	server->connect_fd = -1;
+
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) != 0)
 	{
-		return IVR_RESPONSE_FAIL_SYSTEMNOTAVAILABLE;
+		error = errno;
 	}
 
-	request.code = IVR_REQUEST_VERIFYRECIPIENT;
-	request.index = ivr_chan->index;
-	ast_copy_string(request.param[0], recipient, sizeof(request.param[0]));
-	request.param[1][0] = 0;
-	request.param[2][0] = 0;
-	request.param[3][0] = 0;
+	if (error != 0)
+	{
+		ivr_worker_connect_notify(server, strerror(error));
+		close(fd);
+		return;
+	}
 
-	if (write(ivr->pipe_request_fd[1], &request, sizeof(request)) != sizeof(request))
+#ifdef HAVE_LIBURING
+	// io_uring waits for the socket itself, but only on a blocking one
+	if (shard->uring_ready)
 	{
-		return IVR_RESPONSE_FAIL_INTERNAL;
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
 	}
+#endif
 
-	return ivr_wait(chan, ivr_chan->pipe_response_fd[0]);
-} 
+	__sync_fetch_and_add(&ivr_stats.connects, 1);
+	ivr_histogram_record(&ivr_stats.server[IVR_STAT_CONNECT], ivr_clock_us() - server->connect_started);
 
-static int ivr_setresponse(struct ast_channel * chan, int response)
+	server->sock_fd.fd = fd;
+	server->latency = 0;
+	server->ping_rtt = 0;
+	server->ping_count = 0;
+	server->rx_length = 0;
+	server->time_receive = ivr_clock_ms();
+	server->protocol = IVR_PROTOCOL_TEXT;
+
+	ivr_worker_connect_notify(server, 0);
+
+	// a server upgraded since it ignored the offer is found on a later connection
+	if ((server->protocol_max == IVR_PROTOCOL_TEXT) && ((server->time_receive - server->time_offer) >= (IVR_OFFER_SEC * 1000)))
+	{
+		server->protocol_max = IVR_PROTOCOL_BINARY;
+	}
+
+	if (MIN(shard->protocol, server->protocol_max) == IVR_PROTOCOL_BINARY)
+	{
+		ivr_worker_hello(shard, server);
+	}
+}
+
+//
+// Start connection attempts to every server that is down, in parallel, and
+// abandon attempts that ran past the connect timeout.  A server that fails
+// is retried after the reconnect interval.
+//
+static void ivr_worker_connect(ivr_shard_t * shard)
 {
-	switch(response)
+	ivr_server_t * server;
+	unsigned int i;
+	uint64_t now = ivr_clock_ms();
+
+	for (i = 0; i != shard->server_count; ++i)
 	{
-		case IVR_RESPONSE_SUCCESS:
+		server = &shard->server[i];
+
+		if ((server->connect_fd >= 0) && (now >= server->connect_deadline))
+		{
+			ivr_worker_connect_notify(server, "timed out");
+#ifdef HAVE_LIBURING
+			ivr_worker_uring_release(shard, server);
+#endif
+			close(server->connect_fd);
+			server->connect_fd = -1;
+			server->time_connectattempt = now;
+		}
+
+		if ((server->sock_fd.fd >= 0) || (server->connect_fd >= 0) || ((server->time_connectattempt != 0) && ((now - server->time_connectattempt) < (shard->socket.reconnect * 1000ULL))))
+		{
+			continue;
+		}
+
+		server->time_connectattempt = now;
+
+		ivr_worker_connect_ip(shard, server);
+	}
+}
+
+static void ivr_worker_disconnect(ivr_shard_t * shard, ivr_server_t * server)
+{
+#ifdef HAVE_LIBURING
+	ivr_worker_uring_release(shard, server);
+#endif
+
+	server->tx_length = 0;
+
+	if (server->sock_fd.fd >= 0)
+	{
+		__sync_fetch_and_add(&ivr_stats.disconnects, 1);
+		close(server->sock_fd.fd);
+		server->sock_fd.fd = -1;
+	}
+
+	if (server->connect_fd >= 0)
+	{
+		close(server->connect_fd);
+		server->connect_fd = -1;
+	}
+
+	server->rx_length = 0;
+	ivr_worker_fail_pending(shard, server);
+}
+
+//
+// Apply a new configuration.  Servers whose address is unchanged keep their
+// connection and the requests in flight on it.
+//
+static void ivr_worker_configure(ivr_shard_t * shard, const ivr_config_t * config)
+{
+	ivr_server_t * server;
+	unsigned int i;
+
+	ast_copy_string(shard->client_id, config->client_id, sizeof(shard->client_id));
+
+	shard->pipeline = config->pipeline;
+	shard->tagged = config->tagged;
+	shard->protocol = config->protocol;
+	shard->socket = config->socket;
+
+	for (i = 0; i != IVR_SERVERS_MAX; ++i)
+	{
+		server = &shard->server[i];
+
+		if ((i < shard->server_count) && (i < config->server_count) && (0 == memcmp(&server->address, &config->address[i], sizeof(server->address))))
+		{
+			server->weight = config->weight[i];
+			continue;
+		}
+
+		ivr_worker_disconnect(shard, server);
+
+		if (i < config->server_count)
+		{
+			server->address = config->address[i];
+			server->weight = config->weight[i];
+			server->time_connectattempt = 0;
+			server->flag_connect_notify = 0;
+			server->protocol_max = IVR_PROTOCOL_BINARY;
+		}
+	}
+
+	shard->server_count = config->server_count;
+
+	ivr_worker_connect(shard);
+}
+
+static void ivr_worker_respond(ivr_shard_t * shard, uint32_t index, uint8_t response)
+{
+	ivr_worker_answer(shard, index, response, 0);
+}
+
+//
+// Store a response, with the message id and queue position a protocol 2
+// server may add, and wake the caller.  Both are written on every response
+// so a slot never shows those of an earlier request.
+//
+static void ivr_worker_answer(ivr_shard_t * shard, uint32_t index, uint8_t response, const ivr_field_t * fields)
+{
+	ivr_channel_t * ivr_chan = ivr_channel_lookup(shard->ivr, index);
+	const uint64_t signal = 1;
+	unsigned int length;
+	char details[80];
+
+	if ((ivr_chan == 0) || (ivr_chan->index != index))
+	{
+		return;
+	}
+
+	length = (fields != 0) ? MIN(fields[IVR_FIELD_REFERENCE].length, sizeof(ivr_chan->reference) - 1) : 0;
+	memcpy(ivr_chan->reference, (length != 0) ? fields[IVR_FIELD_REFERENCE].value : "", length);
+	ivr_chan->reference[length] = 0;
+	ivr_chan->position = ((fields != 0) && (fields[IVR_FIELD_POSITION].length == 4)) ? (int)MIN(ivr_frame_get32(fields[IVR_FIELD_POSITION].value), INT_MAX) : -1;
+
+	__sync_synchronize();
+
+	ivr_chan->stamp[2] = ivr_clock_us();
+	ivr_chan->result = ((uint64_t)index << 32) | response;
+
+	if (ivr_chan->async)
+	{
+		// left to the outbox drainer, the message is as good as queued
+		if ((ivr_chan->outbox != 0) && ivr_outbox_settle(&ivr_outbox, ivr_chan->outbox - 1, response))
+		{
+			response = IVR_RESPONSE_SUCCESS_MESSAGEQUEUED;
+		}
+
+		details[0] = 0;
+		length = 0;
+
+		if (ivr_chan->reference[0] != 0)
+		{
+			length += snprintf(&details[length], sizeof(details) - length, "ServerMessageId: %s\r\n", ivr_chan->reference);
+		}
+
+		if (ivr_chan->position >= 0)
+		{
+			snprintf(&details[length], sizeof(details) - length, "QueuePosition: %d\r\n", ivr_chan->position);
+		}
+
+		manager_event(EVENT_FLAG_CALL, "CRSMessageStatus",
+			"Tag: %s%08x\r\n"
+			"Response: %s\r\n"
+			"%s",
+			shard->ivr->tagBase, index, ivr_response_name(response), details);
+	}
+
+	__sync_synchronize();
+
+	// nobody is waiting: let ivr_worker_gc() have the slot back
+	if (__sync_bool_compare_and_swap(&ivr_chan->state, IVR_CHANNEL_STATE_CANCELLED, IVR_CHANNEL_STATE_CLOSING))
+	{
+		return;
+	}
+
+	if (sizeof(signal) != write(ivr_chan->event_fd, &signal, sizeof(signal)))
+	{
+		ast_log(LOG_ERROR, "Unable to signal IVR channel (%08x).\n", index);
+	}
+}
+
+static void ivr_worker_fail_pending(ivr_shard_t * shard, ivr_server_t * server)
+{
+	ivr_pending_t * pending;
+
+	while (server->pending_head != server->pending_tail)
+	{
+		pending = &server->pending[server->pending_head % IVR_PIPELINE_MAX];
+
+		if (!pending->done && (pending->code != IVR_REQUEST_PING) && (pending->code != IVR_REQUEST_HELLO))
+		{
+			ivr_worker_respond(shard, pending->index, IVR_RESPONSE_FAIL_SYSTEMNOTAVAILABLE);
+		}
+
+		++server->pending_head;
+	}
+
+	server->pending_head = 0;
+	server->pending_tail = 0;
+}
+
+//
+// Record a request sent to a server, to be answered by the deadline
+// (CLOCK_MONOTONIC ms) its caller waits until.
+//
+static void ivr_worker_pending(ivr_server_t * server, uint32_t index, int code, uint64_t deadline)
+{
+	ivr_pending_t * pending = &server->pending[server->pending_tail % IVR_PIPELINE_MAX];
+
+	pending->index = index;
+	pending->code = code;
+	pending->done = 0;
+	pending->tag = index;
+	pending->foreign = 0;
+	pending->sent = ivr_clock_us();
+	pending->deadline = deadline;
+	++server->pending_tail;
+}
+
+//
+// The earliest deadline of the requests still unanswered on a server, 0 =
+// none.  Callers wait for different times, so it need not be the oldest's.
+//
+static uint64_t ivr_worker_deadline(const ivr_server_t * server)
+{
+	const ivr_pending_t * pending;
+	uint64_t deadline = 0;
+	unsigned int i;
+
+	for (i = server->pending_head; i != server->pending_tail; ++i)
+	{
+		pending = &server->pending[i % IVR_PIPELINE_MAX];
+
+		if (!pending->done && ((deadline == 0) || (pending->deadline < deadline)))
+		{
+			deadline = pending->deadline;
+		}
+	}
+
+	return deadline;
+}
+
+//
+// Deliver a response to the request in flight with the given channel index,
+// or to the oldest request in flight when the server answered without a tag.
+// Untagged responses rely on the server answering in order.
+//
+static void ivr_worker_complete(ivr_shard_t * shard, ivr_server_t * server, const uint32_t * index, int foreign, uint8_t response, const ivr_field_t * fields)
+{
+	ivr_pending_t * pending;
+	ivr_channel_t * ivr_chan;
+	uint64_t elapsed;
+	unsigned int i;
+
+	for (i = server->pending_head; i != server->pending_tail; ++i)
+	{
+		pending = &server->pending[i % IVR_PIPELINE_MAX];
+
+		if (pending->done)
+		{
+			continue;
+		}
+
+		if ((index != 0) && ((*index != pending->tag) || (foreign != pending->foreign)))
+		{
+			continue;
+		}
+
+		pending->done = 1;
+		elapsed = ivr_clock_us() - pending->sent;
+
+		ivr_histogram_record(&ivr_stats.server[ivr_stats_op(pending->code)], elapsed);
+
+		if (pending->code == IVR_REQUEST_PING)
+		{
+			server->ping_rtt = elapsed / 1000;
+			++server->ping_count;
+		}
+		else if (pending->code == IVR_REQUEST_HELLO)
+		{
+			server->protocol = (response == IVR_RESPONSE_SUCCESS) ? IVR_PROTOCOL_BINARY : IVR_PROTOCOL_TEXT;
+		}
+		else
+		{
+			server->latency += ((elapsed / 1000) << 1) - (server->latency >> 3);
+
+			// a message already on the wire stays on record after its caller hangs up
+			ivr_chan = ivr_channel_lookup(shard->ivr, pending->index);
+
+			if ((pending->code == IVR_REQUEST_SENDMESSAGE) && (ivr_chan != 0) && (ivr_chan->index == pending->index) && (ivr_chan->state == IVR_CHANNEL_STATE_CANCELLED) && !ivr_chan->async)
+			{
+				ast_log(LOG_NOTICE, "IVR message %s%08x, sent for a caller who hung up, answered %s.\n", shard->ivr->tagBase, pending->index, ivr_response_name(response));
+			}
+
+			ivr_worker_answer(shard, pending->index, response, fields);
+		}
+
+		break;
+	}
+
+	if ((i == server->pending_tail) && (server->flag_frame_notify == 0))
+	{
+		server->flag_frame_notify = 1;
+		ast_log(LOG_WARNING, "IVR server sent a response with no matching request.\n");
+	}
+
+	while ((server->pending_head != server->pending_tail) && server->pending[server->pending_head % IVR_PIPELINE_MAX].done)
+	{
+		++server->pending_head;
+	}
+}
+
+static void ivr_worker_expire(ivr_shard_t * shard, ivr_server_t * server)
+{
+	uint64_t deadline;
+
+	if (server->pending_head == server->pending_tail)
+	{
+		return;
+	}
+
+	deadline = ivr_worker_deadline(server);
+
+	if ((deadline == 0) || (ivr_clock_ms() < deadline))
+	{
+		return;
+	}
+
+	// a server that ignores the offer is spoken to in text until IVR_OFFER_SEC has passed
+	if (server->protocol == IVR_PROTOCOL_HELLO)
+	{
+		server->protocol_max = IVR_PROTOCOL_TEXT;
+		server->time_offer = ivr_clock_ms();
+		ast_log(LOG_WARNING, "IVR server did not answer the protocol offer; reconnecting in text for %d seconds.\n", IVR_OFFER_SEC);
+
+		// nothing else is wrong with the server, so it is not held off for the reconnect interval
+		ivr_worker_disconnect(shard, server);
+		server->time_connectattempt = 0;
+		return;
+	}
+
+	__sync_fetch_and_add(&ivr_stats.server_timeouts, 1);
+	ast_log(LOG_WARNING, "IVR server transaction timed out (%u in flight).\n", server->pending_tail - server->pending_head);
+
+	ivr_worker_disconnect(shard, server);
+}
+
+//
+// Tagged response: r:<tagBase><index>,<response>
+//
+static void ivr_worker_frame(ivr_shard_t * shard, ivr_server_t * server, const char * frame, int length)
+{
+	int base = strlen(shard->ivr->tagBase);
+	char tag[64];
+	uint32_t index;
+
+	//
+	// Unsolicited message status: u:<message tag>,<response>
+	//
+	if ((frame[0] == IVR_RESPONSE_UPDATE) && (length > 4) && (length < (int)sizeof(tag)) && (frame[1] == ':') && (frame[length - 2] == ','))
+	{
+		memcpy(tag, &frame[2], length - 4);
+		tag[length - 4] = 0;
+		ivr_cache_put(&ivr_message_cache, tag, frame[length - 1], ivr_message_cache.ttl[1]);
+		return;
+	}
+
+	if ((length != (base + 12)) || (frame[0] != IVR_RESPONSE_FRAME) || (frame[1] != ':') || (frame[base + 10] != ','))
+	{
+		if (server->flag_frame_notify == 0)
+		{
+			server->flag_frame_notify = 1;
+			ast_log(LOG_WARNING, "IVR server sent an unrecognized response (%.*s).\n", length, frame);
+		}
+
+		return;
+	}
+
+	memcpy(tag, &frame[base + 2], 8);
+	tag[8] = 0;
+	index = strtoul(tag, 0, 16);
+
+	ivr_worker_complete(shard, server, &index, 0 != memcmp(&frame[2], shard->ivr->tagBase, base), frame[base + 11], 0);
+}
+
+//
+// One protocol 2 frame at the start of data.  Returns its length, 0 when it
+// has not all arrived, or -1 when the stream cannot be followed.  Fields are
+// read where they lie in the receive buffer.
+//
+static int ivr_worker_frame_binary(ivr_shard_t * shard, ivr_server_t * server, const char * data, unsigned int available)
+{
+	const unsigned char * frame = (const unsigned char *)data;
+	ivr_field_t fields[IVR_FIELDS];
+	unsigned int length;
+	uint64_t id;
+	uint32_t index;
+	char tag[64];
+
+	if (available < 2)
+	{
+		return 0;
+	}
+
+	length = (frame[0] << 8) | frame[1];
+
+	if ((length < IVR_FRAME_HEADER) || (length > sizeof(server->rx)))
+	{
+		ast_log(LOG_WARNING, "IVR server sent a frame of %u bytes.\n", length);
+		return -1;
+	}
+
+	if (available < length)
+	{
+		return 0;
+	}
+
+	if (!ivr_frame_fields(data, length, fields))
+	{
+		ast_log(LOG_WARNING, "IVR server sent a malformed frame.\n");
+		return -1;
+	}
+
+	id = ((uint64_t)ivr_frame_get32(&data[4]) << 32) | ivr_frame_get32(&data[8]);
+	index = (uint32_t)id;
+
+	if ((frame[2] == IVR_RESPONSE_FRAME) && (fields[IVR_FIELD_RESPONSE].length == 1))
+	{
+		ivr_worker_complete(shard, server, &index, (id >> 32) != shard->ivr->session, fields[IVR_FIELD_RESPONSE].value[0], fields);
+	}
+	else if ((frame[2] == IVR_RESPONSE_UPDATE) && (fields[IVR_FIELD_RESPONSE].length == 1) && (fields[IVR_FIELD_TAG].length != 0) && (fields[IVR_FIELD_TAG].length < sizeof(tag)))
+	{
+		memcpy(tag, fields[IVR_FIELD_TAG].value, fields[IVR_FIELD_TAG].length);
+		tag[fields[IVR_FIELD_TAG].length] = 0;
+		ivr_cache_put(&ivr_message_cache, tag, fields[IVR_FIELD_RESPONSE].value[0], ivr_message_cache.ttl[1]);
+	}
+	else if (server->flag_frame_notify == 0)
+	{
+		server->flag_frame_notify = 1;
+		ast_log(LOG_WARNING, "IVR server sent an unrecognized frame (opcode %u).\n", frame[2]);
+	}
+
+	return length;
+}
+
+static void ivr_worker_receive(ivr_shard_t * shard, ivr_server_t * server)
+{
+	int readlen = read(server->sock_fd.fd, &server->rx[server->rx_length], sizeof(server->rx) - server->rx_length);
+
+	if ((readlen < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)))
+	{
+		return;
+	}
+
+	ivr_worker_parse(shard, server, readlen);
+}
+
+//
+// Send what is left in tx once the connection takes more.  Returns 0 when
+// the connection failed.
+//
+static int ivr_worker_flush(ivr_shard_t * shard, ivr_server_t * server)
+{
+	int written = write(server->sock_fd.fd, server->tx, server->tx_length);
+
+	if (written < 0)
+	{
+		return (errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR);
+	}
+
+	server->tx_length -= written;
+	memmove(server->tx, &server->tx[written], server->tx_length);
+
+	return 1;
+}
+
+//
+// Handle readlen bytes received at the end of rx; 0 or less means the
+// connection was closed or failed.
+//
+static void ivr_worker_parse(ivr_shard_t * shard, ivr_server_t * server, int readlen)
+{
+	unsigned int i;
+	char * end;
+	int length;
+
+	if (readlen <= 0)
+	{
+		ivr_worker_disconnect(shard, server);
+		return;
+	}
+
+	server->rx_length += readlen;
+	server->time_receive = ivr_clock_ms();
+
+	for (i = 0; i != server->rx_length; )
+	{
+		// checked at every frame: the answer to the offer switches the stream
+		if (server->protocol == IVR_PROTOCOL_BINARY)
+		{
+			length = ivr_worker_frame_binary(shard, server, &server->rx[i], server->rx_length - i);
+
+			if (length < 0)
+			{
+				ivr_worker_disconnect(shard, server);
+				return;
+			}
+
+			if (length == 0)
+			{
+				break;
+			}
+
+			i += length;
+			continue;
+		}
+
+		if (server->rx[i] != '[')
+		{
+			ivr_worker_complete(shard, server, 0, 0, server->rx[i], 0);
+			++i;
+			continue;
+		}
+
+		end = memchr(&server->rx[i], ']', server->rx_length - i);
+
+		if (end == 0)
+		{
+			break;
+		}
+
+		ivr_worker_frame(shard, server, &server->rx[i + 1], end - &server->rx[i + 1]);
+		i = (end - server->rx) + 1;
+	}
+
+	if ((i == 0) && (server->rx_length == sizeof(server->rx)))
+	{
+		ast_log(LOG_WARNING, "IVR server response overflowed the receive buffer.\n");
+		ivr_worker_disconnect(shard, server);
+		return;
+	}
+
+	server->rx_length -= i;
+	memmove(server->rx, &server->rx[i], server->rx_length);
+}
+
+//
+// Heartbeat a connection the server has been quiet on for IVR_PING_SEC; any
+// response counts as proof of life.  The ping goes in flight like a request,
+// so its reply is matched by tag, or by order on an untagged link, and a
+// missing reply times the connection out.
+//
+static void ivr_worker_ping_server(ivr_shard_t * shard, ivr_server_t * server)
+{
+	char server_request[128];
+	int server_request_length;
+	uint64_t now;
+
+	if (server->sock_fd.fd < 0)
+	{
+		return;
+	}
+
+	now = ivr_clock_ms();
+
+	if (((now - server->time_receive) < (IVR_PING_SEC * 1000)) || ((now - server->time_ping) < (IVR_PING_SEC * 1000)))
+	{
+		return;
+	}
+
+	if (((server->pending_tail - server->pending_head) >= IVR_PIPELINE_MAX) || (ivr_worker_room(shard, server) == 0))
+	{
+		return;
+	}
+
+	if (server->protocol == IVR_PROTOCOL_BINARY)
+	{
+		server_request_length = ivr_frame_end(server_request, ivr_frame_begin(server_request, IVR_REQUEST_PING, ((uint64_t)shard->ivr->session << 32) | IVR_CHANNEL_PING));
+	}
+	else if (shard->tagged)
+	{
+		server_request_length = sprintf
+		(
+			server_request,
+			"[%c:%s,%s%08x]",
+			IVR_REQUEST_PING,
+			shard->client_id,
+			shard->ivr->tagBase,
+			IVR_CHANNEL_PING
+		);
+	}
+	else
+	{
+		server_request_length = sprintf
+		(
+			server_request,
+			"[%c:%s]",
+			IVR_REQUEST_PING,
+			shard->client_id
+		);
+	}
+
+	server->time_ping = now;
+
+	if (!ivr_worker_write(shard, server, server_request, server_request_length))
+	{
+		ivr_worker_disconnect(shard, server);
+		return;
+	}	
+
+	ivr_worker_pending(server, IVR_CHANNEL_PING, IVR_REQUEST_PING, now + IVR_HEARTBEAT_TIMEOUT);
+}
+
+//
+// Offer protocol 2 on a new connection.  Nothing else is sent until the
+// answer, so it is matched like a heartbeat whether or not the server tags
+// it, and a server that does not know the request keeps the text protocol.
+//
+static void ivr_worker_hello(ivr_shard_t * shard, ivr_server_t * server)
+{
+	char server_request[128];
+	int server_request_length;
+
+	if (shard->tagged)
+	{
+		server_request_length = sprintf
+		(
+			server_request,
+			"[%c:%s,%s%08x,%d]",
+			IVR_REQUEST_HELLO,
+			shard->client_id,
+			shard->ivr->tagBase,
+			IVR_CHANNEL_PING,
+			IVR_PROTOCOL_BINARY
+		);
+	}
+	else
+	{
+		server_request_length = sprintf
+		(
+			server_request,
+			"[%c:%s,%d]",
+			IVR_REQUEST_HELLO,
+			shard->client_id,
+			IVR_PROTOCOL_BINARY
+		);
+	}
+
+	server->protocol = IVR_PROTOCOL_HELLO;
+
+	if (!ivr_worker_write(shard, server, server_request, server_request_length))
+	{
+		ivr_worker_disconnect(shard, server);
+		return;
+	}
+
+	ivr_worker_pending(server, IVR_CHANNEL_PING, IVR_REQUEST_HELLO, ivr_clock_ms() + IVR_OFFER_TIMEOUT);
+}
+
+//
+// Pick the connection with the lowest expected wait: its recent response
+// time scaled by the requests already outstanding on it, divided by its
+// weight.  Standby servers (weight 0) are used only while no weighted server
+// is connected.  Returns 0 when no connection has room.
+//
+static ivr_server_t * ivr_worker_select(ivr_shard_t * shard)
+{
+	ivr_server_t * server;
+	ivr_server_t * best = 0;
+	uint64_t score;
+	uint64_t best_score = 0;
+	unsigned int outstanding;
+	int standby = 1;
+	unsigned int i;
+
+	for (i = 0; i != shard->server_count; ++i)
+	{
+		if ((shard->server[i].sock_fd.fd >= 0) && (shard->server[i].weight != 0))
+		{
+			standby = 0;
+			break;
+		}
+	}
+
+	for (i = 0; i != shard->server_count; ++i)
+	{
+		server = &shard->server[i];
+		outstanding = server->pending_tail - server->pending_head;
+
+		if ((server->sock_fd.fd < 0) || (outstanding >= shard->pipeline) || (ivr_worker_room(shard, server) == 0) || ((server->weight == 0) != standby))
+		{
+			continue;
+		}
+
+		score = ((server->latency + 16) * (outstanding + 1) * 1024) / ((server->weight != 0) ? server->weight : 1);
+
+		if ((best == 0) || (score < best_score))
+		{
+			best = server;
+			best_score = score;
+		}
+	}
+
+	return best;
+}
+
+//
+// Requests the worker can send right now.  With no connection up every
+// queued request can be taken, and is failed straight away, unless a first
+// connection attempt is still in progress.  Those hold the queue for at most
+// the connect timeout.
+//
+static int ivr_worker_space(ivr_shard_t * shard)
+{
+	ivr_server_t * server;
+	int connected = 0;
+	int connecting = 0;
+	int space = 0;
+	int standby = 1;
+	unsigned int i;
+
+	for (i = 0; i != shard->server_count; ++i)
+	{
+		if ((shard->server[i].sock_fd.fd >= 0) && (shard->server[i].weight != 0))
+		{
+			standby = 0;
+			break;
+		}
+	}
+
+	for (i = 0; i != shard->server_count; ++i)
+	{
+		server = &shard->server[i];
+
+		if ((server->connect_fd >= 0) && (server->flag_connect_notify == 0))
+		{
+			connecting = 1;
+		}
+
+		if ((server->sock_fd.fd < 0) || ((server->weight == 0) != standby))
+		{
+			continue;
+		}
+
+		connected = 1;
+		space += MIN((int)(shard->pipeline - (server->pending_tail - server->pending_head)), ivr_worker_room(shard, server));
+	}
+
+	if (connected)
+	{
+		return space;
+	}
+
+	return connecting ? 0 : (int)shard->pipeline;
+}
+
+//
+// Frames a connection can still take before its next send: none while the
+// protocol offer is outstanding.  With io_uring they are batched in tx, sent
+// once per loop, and one send at a time keeps them in order.  With ppoll
+// each frame is written directly, and only what the socket does not take
+// waits in tx, so the room is limited while tx holds anything.
+//
+static int ivr_worker_room(ivr_shard_t * shard, const ivr_server_t * server)
+{
+	if (server->protocol == IVR_PROTOCOL_HELLO)
+	{
+		return 0;
+	}
+
+#ifdef HAVE_LIBURING
+	if (shard->uring_ready)
+	{
+		return server->tx_busy ? 0 : (int)((sizeof(server->tx) - server->tx_length) / IVR_TX_FRAME);
+	}
+#endif
+
+	return (server->tx_length == 0) ? IVR_PIPELINE_MAX : (int)((sizeof(server->tx) - server->tx_length) / IVR_TX_FRAME);
+}
+
+//
+// Write one framed request, never blocking: what the socket does not take
+// is kept in tx, behind anything already there, until it drains.  Returns 0
+// when the connection failed.
+//
+static int ivr_worker_write(ivr_shard_t * shard, ivr_server_t * server, const char * frame, int length)
+{
+	int written = 0;
+
+#ifdef HAVE_LIBURING
+	if (shard->uring_ready)
+	{
+		memcpy(&server->tx[server->tx_length], frame, length);
+		server->tx_length += length;
+		return 1;
+	}
+#endif
+
+	if (server->tx_length == 0)
+	{
+		written = write(server->sock_fd.fd, frame, length);
+
+		if (written == length)
+		{
+			return 1;
+		}
+
+		if ((written < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+		{
+			return 0;
+		}
+
+		written = MAX(written, 0);
+	}
+
+	memcpy(&server->tx[server->tx_length], &frame[written], length - written);
+	server->tx_length += length - written;
+
+	return 1;
+}
+
+static void ivr_worker_transact_server(ivr_shard_t * shard, const ivr_request_t * request)
+{
+	ivr_channel_t * ivr_chan = ivr_channel_lookup(shard->ivr, request->index);
+	ivr_server_t * server;
+	ivr_pending_t * pending;
+
+	char server_request[IVR_TX_FRAME];
+	int server_request_length;
+	char text[3][IVR_MESSAGE_MAX];
+
+	if ((ivr_chan == 0) || (ivr_chan->index != request->index))
+	{
+		return;
+	}
+
+	// Only a message still goes out once its caller has hung up.
+	if ((ivr_chan->state == IVR_CHANNEL_STATE_CANCELLED) && (request->code != IVR_REQUEST_SENDMESSAGE))
+	{
+		__sync_fetch_and_add(&ivr_stats.cancelled, 1);
+		ivr_worker_respond(shard, request->index, IVR_RESPONSE_FAIL_HANGUP);
+		return;
+	}
+
+	ivr_chan->stamp[0] = ivr_clock_us();
+
+	server = ivr_worker_select(shard);
+
+	if (server == 0)
+	{
+		ivr_worker_respond(shard, request->index, IVR_RESPONSE_FAIL_SYSTEMNOTAVAILABLE);
+		return;
+	}
+
+	if (server->protocol == IVR_PROTOCOL_BINARY)
+	{
+		server_request_length = ivr_frame_request(shard, request, server_request);
+	}
+
+	else if ((request->code == IVR_REQUEST_VERIFYRECIPIENT) && shard->tagged)
+	{
+		server_request_length = sprintf
+		(
+			server_request,
+			"[%c:%s,%s%08x,%s]",
+			request->code,
+			shard->client_id,
+			shard->ivr->tagBase,
+			ivr_chan->index,
+			ivr_text_field(text[0], sizeof(text[0]), request->param[0])
+		);
+	}
+
+	else if (request->code == IVR_REQUEST_VERIFYRECIPIENT)
+	{
+		server_request_length = sprintf
+		(
+			server_request,
+			"[%c:%s,%s]",
+			request->code,
+			shard->client_id,
+			ivr_text_field(text[0], sizeof(text[0]), request->param[0])
+		);
+	}
+
+	// Outbox replays keep the tag the caller was given, in param[3].
+	else if ((request->code == IVR_REQUEST_SENDMESSAGE) && (request->param[3][0] != 0))
+	{
+		server_request_length = sprintf
+		(
+			server_request,
+			"[%c:%s,%s,%s,%s,%s]",
+			request->code,
+			shard->client_id,
+			request->param[3],
+			ivr_text_field(text[0], sizeof(text[0]), request->param[0]),
+			ivr_text_field(text[1], sizeof(text[1]), request->message),
+			ivr_text_field(text[2], sizeof(text[2]), request->param[2])
+		);
+	}
+
+	else if (request->code == IVR_REQUEST_SENDMESSAGE)
+	{
+		server_request_length = sprintf
+		(
+			server_request,
+			"[%c:%s,%s%08x,%s,%s,%s]",
+			request->code,
+			shard->client_id,
+			shard->ivr->tagBase,
+			ivr_chan->index,
+			ivr_text_field(text[0], sizeof(text[0]), request->param[0]),
+			ivr_text_field(text[1], sizeof(text[1]), request->message),
+			ivr_text_field(text[2], sizeof(text[2]), request->param[2])
+		);
+	}
+
+	else if (request->code == IVR_REQUEST_QUERYMESSAGE)
+	{
+		server_request_length = sprintf
+		(
+			server_request,
+			"[%c:%s,%s%08x,%s]",
+			request->code,
+			shard->client_id,
+			shard->ivr->tagBase,
+			ivr_chan->index,
+			ivr_text_field(text[0], sizeof(text[0]), request->param[0])
+		);
+	}
+
+	else
+	{
+		server_request_length = 0;
+	}
+
+	if (server_request_length == 0)
+	{
+		ivr_worker_respond(shard, request->index, IVR_RESPONSE_FAIL_UNKNOWNREQUEST);
+		return;
+	}
+
+	if (!ivr_worker_write(shard, server, server_request, server_request_length))
+	{
+		ivr_worker_respond(shard, request->index, IVR_RESPONSE_FAIL_SYSTEMNOTAVAILABLE);
+		ivr_worker_disconnect(shard, server);
+		return;
+	}
+
+	// an async send has no caller waiting, so gets the send timeout
+	ivr_worker_pending(server, request->index, request->code, (request->deadline != 0) ? request->deadline : ivr_clock_ms() + shard->ivr->send_timeout);
+
+	ivr_chan->stamp[1] = server->pending[(server->pending_tail - 1) % IVR_PIPELINE_MAX].sent;
+
+	// protocol 2 responses carry the request id instead of the message tag
+	if ((request->code == IVR_REQUEST_SENDMESSAGE) && (request->param[3][0] != 0) && (server->protocol != IVR_PROTOCOL_BINARY))
+	{
+		pending = &server->pending[(server->pending_tail - 1) % IVR_PIPELINE_MAX];
+		server_request_length = strlen(request->param[3]);
+		pending->tag = (server_request_length > 8) ? strtoul(&request->param[3][server_request_length - 8], 0, 16) : 0;
+		pending->foreign = (0 != strncmp(request->param[3], shard->ivr->tagBase, strlen(shard->ivr->tagBase)));
+	}
+}
+
+static uint32_t ivr_frame_get32(const char * data)
+{
+	const unsigned char * bytes = (const unsigned char *)data;
+
+	return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | bytes[3];
+}
+
+//
+// Start a protocol 2 frame; fields are appended with ivr_frame_field() and
+// the length is filled in by ivr_frame_end().  Returns the length so far.
+//
+static int ivr_frame_begin(char * frame, int opcode, uint64_t id)
+{
+	int i;
+
+	frame[2] = opcode;
+	frame[3] = 0;
+
+	for (i = 0; i != 8; ++i)
+	{
+		frame[4 + i] = (char)(id >> (56 - (i * 8)));
+	}
+
+	return IVR_FRAME_HEADER;
+}
+
+static int ivr_frame_field(char * frame, int length, int type, const char * value)
+{
+	int size = strlen(value);
+
+	frame[length] = type;
+	frame[length + 1] = (char)(size >> 8);
+	frame[length + 2] = (char)size;
+	memcpy(&frame[length + IVR_FRAME_FIELD], value, size);
+	++frame[3];
+
+	return length + IVR_FRAME_FIELD + size;
+}
+
+static int ivr_frame_end(char * frame, int length)
+{
+	frame[0] = (char)(length >> 8);
+	frame[1] = (char)length;
+
+	return length;
+}
+
+//
+// Point fields[type] at each field of a complete frame, without copying.
+// Returns 0 when the fields overrun the frame or leave bytes after them.
+//
+static int ivr_frame_fields(const char * frame, unsigned int length, ivr_field_t * fields)
+{
+	const unsigned char * bytes = (const unsigned char *)frame;
+	unsigned int count = bytes[3];
+	unsigned int i = IVR_FRAME_HEADER;
+	unsigned int size;
+	unsigned int type;
+
+	memset(fields, 0, IVR_FIELDS * sizeof(*fields));
+
+	while (count-- != 0)
+	{
+		if ((i + IVR_FRAME_FIELD) > length)
+		{
+			return 0;
+		}
+
+		type = bytes[i];
+		size = (bytes[i + 1] << 8) | bytes[i + 2];
+		i += IVR_FRAME_FIELD;
+
+		if ((i + size) > length)
+		{
+			return 0;
+		}
+
+		if (type < IVR_FIELDS)
+		{
+			fields[type].value = &frame[i];
+			fields[type].length = size;
+		}
+
+		i += size;
+	}
+
+	return i == length;
+}
+
+//
+// Frame a request in protocol 2.  The id carries the channel index, and a
+// message its tag: the one the caller was given, or for an outbox replay
+// the one given before.  Returns 0 for an unknown request.
+//
+static int ivr_frame_request(ivr_shard_t * shard, const ivr_request_t * request, char * frame)
+{
+	char tag[40];
+	int length;
+
+	length = ivr_frame_begin(frame, request->code, ((uint64_t)shard->ivr->session << 32) | request->index);
+
+	switch (request->code)
+	{
+		case IVR_REQUEST_VERIFYRECIPIENT:
+			length = ivr_frame_field(frame, length, IVR_FIELD_RECIPIENT, request->param[0]);
+			break;
+
+		case IVR_REQUEST_SENDMESSAGE:
+			if (request->param[3][0] == 0)
+			{
+				snprintf(tag, sizeof(tag), "%s%08x", shard->ivr->tagBase, request->index);
+			}
+
+			length = ivr_frame_field(frame, length, IVR_FIELD_TAG, (request->param[3][0] != 0) ? request->param[3] : tag);
+			length = ivr_frame_field(frame, length, IVR_FIELD_RECIPIENT, request->param[0]);
+			length = ivr_frame_field(frame, length, IVR_FIELD_MESSAGE, request->message);
+			length = ivr_frame_field(frame, length, IVR_FIELD_CALLER, request->param[2]);
+			break;
+
+		case IVR_REQUEST_QUERYMESSAGE:
+			length = ivr_frame_field(frame, length, IVR_FIELD_TAG, request->param[0]);
+			break;
+
+		default:
+			return 0;
+	}
+
+	return ivr_frame_end(frame, length);
+}
+
+//
+// Text frames cannot carry their delimiters, so [, ] and , in a field go as
+// spaces.  Protocol 2 sends fields as they are.
+//
+static const char * ivr_text_field(char * buffer, size_t size, const char * value)
+{
+	char * delimiter = buffer;
+
+	ast_copy_string(buffer, value, size);
+
+	while ((delimiter = strpbrk(delimiter, "[],")) != 0)
+	{
+		*delimiter++ = ' ';
+	}
+
+	return buffer;
+}
+
+//
+// Take a stop or a new configuration, which do not wait in the queue
+// behind requests.  Returns 0 when the worker should stop.
+//
+static int ivr_worker_control(ivr_shard_t * shard)
+{
+	ivr_config_t * config;
+	unsigned int i;
+
+	if (shard->stop)
+	{
+		for (i = 0; i != shard->server_count; ++i)
+		{
+			ivr_worker_disconnect(shard, &shard->server[i]);
+		}
+
+		ast_log(LOG_NOTICE, "worker thread %u stopped.\n", shard->id);
+		return 0;
+	}
+
+	config = __sync_lock_test_and_set(&shard->config, 0);
+
+	if (config != 0)
+	{
+		ivr_worker_configure(shard, config);
+		ao2_ref(config, -1);
+
+		ast_log(LOG_NOTICE, "worker thread %u applied configuration (%u servers).\n", shard->id, shard->server_count);
+	}
+
+	return 1;
+}
+
+#ifdef HAVE_LIBURING
+//
+// Before a server's descriptors are closed, wake what is outstanding on
+// them: a shut down socket completes its receive and send, a connection
+// attempt's poll is cancelled.  Their completions carry the old generation
+// and are dropped.
+//
+static void ivr_worker_uring_release(ivr_shard_t * shard, ivr_server_t * server)
+{
+	struct io_uring_sqe * sqe;
+
+	if (!shard->uring_ready)
+	{
+		return;
+	}
+
+	if ((server->sock_fd.fd >= 0) && (server->recv_armed || server->tx_busy))
+	{
+		shutdown(server->sock_fd.fd, SHUT_RDWR);
+	}
+
+	if ((server->connect_fd >= 0) && (server->connect_polled == server->generation + 1) && ((sqe = io_uring_get_sqe(&shard->uring)) != 0))
+	{
+		io_uring_prep_cancel64(sqe, IVR_URING_DATA(IVR_URING_CONNECT, server - shard->server, server->generation), 0);
+		io_uring_sqe_set_data64(sqe, IVR_URING_DATA(IVR_URING_CANCEL, 0, 0));
+	}
+
+	server->connect_polled = 0;
+	++server->generation;
+}
+
+static void ivr_worker_uring_complete(ivr_shard_t * shard, uint64_t data, int res)
+{
+	ivr_server_t * server = &shard->server[data & 0xff];
+	int current = ((uint32_t)(data >> 32) == server->generation);
+
+	switch ((data >> 8) & 0xff)
+	{
+		case IVR_URING_DOORBELL:
+			shard->doorbell_armed = 0;
+			break;
+
+		case IVR_URING_RECV:
+			server->recv_armed = 0;
+
+			if (current)
+			{
+				ivr_worker_parse(shard, server, res);
+			}
+			break;
+
+		// a short send leaves the rest in tx for the next pass
+		case IVR_URING_SEND:
+			server->tx_busy = 0;
+
+			if (current && (res <= 0))
+			{
+				ivr_worker_disconnect(shard, server);
+			}
+			else if (current)
+			{
+				server->tx_length -= res;
+				memmove(server->tx, &server->tx[res], server->tx_length);
+			}
+			break;
+
+		case IVR_URING_CONNECT:
+			if (current && (server->connect_polled == server->generation + 1))
+			{
+				server->connect_polled = 0;
+				ivr_worker_connected(shard, server);
+			}
+			break;
+	}
+}
+
+//
+// The io_uring loop: the doorbell read, the batched sends, a receive on
+// every connection and a poll on every connection attempt are kept
+// outstanding, submitted and waited for in one system call, and every
+// completion is handled before the next pass.
+//
+static void ivr_worker_uring_wait(ivr_shard_t * shard, uint64_t timeout)
+{
+	struct io_uring_sqe * sqe;
+	struct io_uring_cqe * cqe;
+	struct __kernel_timespec wait_time;
+	ivr_server_t * server;
+	unsigned int head;
+	unsigned int count = 0;
+	unsigned int i;
+
+	if (!shard->doorbell_armed && ((sqe = io_uring_get_sqe(&shard->uring)) != 0))
+	{
+		io_uring_prep_read(sqe, shard->doorbell_fd, &shard->doorbell_value, sizeof(shard->doorbell_value), 0);
+		io_uring_sqe_set_data64(sqe, IVR_URING_DATA(IVR_URING_DOORBELL, 0, 0));
+		shard->doorbell_armed = 1;
+	}
+
+	for (i = 0; i != shard->server_count; ++i)
+	{
+		server = &shard->server[i];
+
+		if ((server->sock_fd.fd >= 0) && (server->tx_length != 0) && !server->tx_busy && ((sqe = io_uring_get_sqe(&shard->uring)) != 0))
+		{
+			io_uring_prep_send(sqe, server->sock_fd.fd, server->tx, server->tx_length, MSG_NOSIGNAL);
+			io_uring_sqe_set_data64(sqe, IVR_URING_DATA(IVR_URING_SEND, i, server->generation));
+			server->tx_busy = 1;
+		}
+
+		if ((server->sock_fd.fd >= 0) && !server->recv_armed && ((sqe = io_uring_get_sqe(&shard->uring)) != 0))
+		{
+			io_uring_prep_recv(sqe, server->sock_fd.fd, &server->rx[server->rx_length], sizeof(server->rx) - server->rx_length, 0);
+			io_uring_sqe_set_data64(sqe, IVR_URING_DATA(IVR_URING_RECV, i, server->generation));
+			server->recv_armed = 1;
+		}
+
+		if ((server->connect_fd >= 0) && (server->connect_polled != server->generation + 1) && ((sqe = io_uring_get_sqe(&shard->uring)) != 0))
+		{
+			io_uring_prep_poll_add(sqe, server->connect_fd, POLLOUT);
+			io_uring_sqe_set_data64(sqe, IVR_URING_DATA(IVR_URING_CONNECT, i, server->generation));
+			server->connect_polled = server->generation + 1;
+		}
+	}
+
+	wait_time.tv_sec = timeout / 1000;
+	wait_time.tv_nsec = (timeout % 1000) * 1000000;
+
+	if (io_uring_submit_and_wait_timeout(&shard->uring, &cqe, 1, &wait_time, 0) < 0)
+	{
+		return;
+	}
+
+	io_uring_for_each_cqe(&shard->uring, head, cqe)
+	{
+		ivr_worker_uring_complete(shard, io_uring_cqe_get_data64(cqe), cqe->res);
+		++count;
+	}
+
+	io_uring_cq_advance(&shard->uring, count);
+}
+#endif
+
+static void * ivr_worker_task(void *arg)
+{
+	ivr_shard_t * shard = (ivr_shard_t *)arg;
+	ivr_server_t * server;
+	cpu_set_t cpus;
+	ivr_request_t * request;
+	uint64_t signal;
+	int space;
+	uint64_t now;
+	uint64_t deadline;
+	uint64_t expiry;
+	struct timespec wait_time;
+	struct pollfd fds[1 + IVR_SERVERS_MAX];
+	unsigned int i;
+#ifdef HAVE_LIBURING
+	int error;
+#endif
+
+	ast_log(LOG_NOTICE, "IVR worker thread %u started.\n", shard->id);
+
+	if (shard->cpu >= 0)
+	{
+		CPU_ZERO(&cpus);
+		CPU_SET(shard->cpu, &cpus);
+
+		if (0 != pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus))
+		{
+			ast_log(LOG_WARNING, "Unable to pin IVR worker thread %u to CPU %d.\n", shard->id, shard->cpu);
+		}
+	}
+
+	for (i = 0; i != IVR_SERVERS_MAX; ++i)
+	{
+		server = &shard->server[i];
+		server->sock_fd.fd = -1;
+		server->sock_fd.events = POLLIN | POLLPRI;
+		server->connect_fd = -1;
+		server->pending_head = 0;
+		server->pending_tail = 0;
+		server->rx_length = 0;
+		server->tx_length = 0;
+		server->protocol = IVR_PROTOCOL_TEXT;
+		server->protocol_max = IVR_PROTOCOL_BINARY;
+	}
+
+	shard->server_count = 0;
+	shard->protocol = IVR_PROTOCOL_TEXT;
+	shard->pipeline = IVR_PIPELINE;
+	shard->socket.connect_timeout = IVR_CONNECT_TIMEOUT;
+	shard->socket.reconnect = IVR_CONNECT_SEC;
+
+	fds[0].fd = shard->doorbell_fd;
+	fds[0].events = POLLIN;
+
+#ifdef HAVE_LIBURING
+	if (shard->backend == IVR_BACKEND_URING)
+	{
+		error = -io_uring_queue_init(IVR_URING_ENTRIES, &shard->uring, 0);
+		shard->uring_ready = (error == 0);
+		shard->doorbell_armed = 0;
+
+		if (!shard->uring_ready)
+		{
+			ast_log(LOG_WARNING, "IVR worker thread %u: io_uring unavailable (%s), using ppoll.\n", shard->id, strerror(error));
+		}
+	}
+#endif
+
+	while (1)
+	{
+		if (!ivr_worker_control(shard))
+		{
+#ifdef HAVE_LIBURING
+			if (shard->uring_ready)
+			{
+				io_uring_queue_exit(&shard->uring);
+				shard->uring_ready = 0;
+			}
+#endif
+			return 0;
+		}
+
+		ivr_worker_gc(shard);
+		ivr_worker_connect(shard);
+
+		for (i = 0; i != shard->server_count; ++i)
+		{
+			ivr_worker_ping_server(shard, &shard->server[i]);
+			ivr_worker_expire(shard, &shard->server[i]);
+		}
+
+		//
+		// Handle queued requests in place, up to the room left in the
+		// pipelines.  The rest wait in the queue until responses make room.
+		//
+		space = ivr_worker_space(shard);
+		now = ivr_clock_ms();
+
+		while ((request = ivr_ring_peek(shard)) != 0)
+		{
+			// A request whose caller has stopped waiting is dropped unsent, room or not.
+			if ((request->deadline != 0) && (request->deadline <= now))
+			{
+				__sync_fetch_and_add(&ivr_stats.expired, 1);
+				ivr_worker_respond(shard, request->index, IVR_RESPONSE_FAIL_INTERNAL);
+				ivr_ring_pop(shard);
+				continue;
+			}
+
+			if (space <= 0)
+			{
+				break;
+			}
+
+			ivr_worker_transact_server(shard, request);
+			ivr_ring_pop(shard);
+			space = ivr_worker_space(shard);
+		}
+
+		now = ivr_clock_ms();
+		deadline = now + 2000;
+
+		for (i = 0; i != shard->server_count; ++i)
+		{
+			server = &shard->server[i];
+			fds[1 + i] = server->sock_fd;
+
+			if (server->tx_length != 0)
+			{
+				fds[1 + i].events |= POLLOUT;
+			}
+
+			if (server->connect_fd >= 0)
+			{
+				fds[1 + i].fd = server->connect_fd;
+				fds[1 + i].events = POLLOUT;
+
+				if (server->connect_deadline < deadline)
+				{
+					deadline = server->connect_deadline;
+				}
+			}
+
+			expiry = ivr_worker_deadline(server);
+
+			if ((expiry != 0) && (expiry < deadline))
+			{
+				deadline = expiry;
+			}
+		}
+
+		// a request left waiting for room is dropped when its caller gives up
+		if ((request != 0) && (request->deadline != 0) && (request->deadline < deadline))
+		{
+			deadline = request->deadline;
+		}
+
+		//
+		// Producers only ring the doorbell while the worker is asleep; check
+		// the queue again after announcing it so no request is missed.  With
+		// no room the doorbell still brings a stop or a configuration.
+		//
+		if (space > 0)
+		{
+			shard->sleeping = 1;
+
+			__sync_synchronize();
+
+			if (ivr_ring_peek(shard) != 0)
+			{
+				deadline = now;
+			}
+		}
+
+		if (shard->stop || (shard->config != 0))
+		{
+			deadline = now;
+		}
+
+		deadline = (deadline > now) ? (deadline - now) : 0;
+
+#ifdef HAVE_LIBURING
+		if (shard->uring_ready)
+		{
+			ivr_worker_uring_wait(shard, deadline);
+			shard->sleeping = 0;
+			continue;
+		}
+#endif
+
+		wait_time.tv_sec = deadline / 1000;
+		wait_time.tv_nsec = (deadline % 1000) * 1000000;
+
+		if (ppoll(fds, 1 + shard->server_count, &wait_time, 0) <= 0)
+		{
+			shard->sleeping = 0;
+			continue;
+		}
+
+		shard->sleeping = 0;
+
+		if (0 != (fds[0].revents & POLLIN))
+		{
+			if (sizeof(signal) != read(shard->doorbell_fd, &signal, sizeof(signal)))
+			{
+				ast_log(LOG_ERROR, "Error reading IVR request doorbell.\n");
+			}
+		}
+
+		for (i = 0; i != shard->server_count; ++i)
+		{
+			server = &shard->server[i];
+
+			if (0 == (fds[1 + i].revents & (POLLIN | POLLPRI | POLLOUT | POLLERR | POLLHUP)))
+			{
+				continue;
+			}
+
+			if (fds[1 + i].fd == server->connect_fd)
+			{
+				ivr_worker_connected(shard, server);
+				continue;
+			}
+
+			if ((0 != (fds[1 + i].revents & POLLOUT)) && !ivr_worker_flush(shard, server))
+			{
+				ivr_worker_disconnect(shard, server);
+				continue;
+			}
+
+			if (0 != (fds[1 + i].revents & (POLLIN | POLLPRI | POLLERR | POLLHUP)))
+			{
+				ivr_worker_receive(shard, server);
+			}
+		}
+	}
+}
+
+int ivr_wait(struct ast_channel *c, ivr_channel_t * ivr_chan, uint64_t deadline, int typeahead)
+{
+	int response = IVR_RESPONSE_PENDING;
+
+	ivr_wait_all(c, &ivr_chan, 1, &response, deadline, typeahead);
+
+	return response;
+}
+
+//
+// Wait for the responses to requests made on several slots at once.  Slots
+// whose response is IVR_RESPONSE_PENDING are waited on until the deadline
+// (CLOCK_MONOTONIC ms); any still pending when the wait ends get HANGUP, or
+// ERROR_INTERNAL on timeout.  Digits dialled meanwhile are discarded, or
+// with typeahead queued back on the channel for the next read.
+//
+static void ivr_wait_all(struct ast_channel *c, ivr_channel_t ** ivr_chan, int count, int * responses, uint64_t deadline, int typeahead)
+{
+	uint64_t signal;
+	uint64_t result;
+	struct ast_frame *f;
+	struct ast_channel *rchan;
+	int fds[IVR_RECIPIENTS_MAX];
+	int slots[IVR_RECIPIENTS_MAX];
+	int failure = IVR_RESPONSE_FAIL_INTERNAL;
+	int outfd;
+	char digits[32];							// digits dialled meanwhile, kept for the next read
+	int typed = 0;
+	uint64_t now = ivr_clock_ms();
+	int ms = (deadline > now) ? (int)(deadline - now) : 0;
+	int n;
+	int i;
+
+	// Stop if we're a zombie or need a soft hangup
+	if (ast_test_flag(ast_channel_flags(c), AST_FLAG_ZOMBIE) || ast_check_hangup(c)) 
+	{
+		failure = IVR_RESPONSE_FAIL_HANGUP;
+		ms = 0;
+	}
+
+	while(ms)
+	{
+		for (i = 0, n = 0; i != count; ++i)
+		{
+			if (responses[i] == IVR_RESPONSE_PENDING)
+			{
+				fds[n] = ivr_chan[i]->event_fd;
+				slots[n++] = i;
+			}
+		}
+
+		if (n == 0)
+		{
+			return;
+		}
+
+		rchan = ast_waitfor_nandfds(&c, 1, fds, n, NULL, &outfd, &ms);
+
+		if ((!rchan) && (outfd < 0) && (ms))
+		{ 
+			ast_log(LOG_WARNING, "ivr_wait failed (%s)\n", strerror(errno));
+			break;
+		}
+
+		else if (outfd > -1)
+		{
+			for (i = 0; (i != n) && (fds[i] != outfd); ++i)
+			{
+			}
+
+			if (i == n)
+			{
+				continue;
+			}
+
+			if (sizeof(signal) != read(outfd, &signal, sizeof(signal)))
+			{
+				if (errno != EAGAIN)
+				{
+					break;
+				}
+			}
+
+			result = ivr_chan[slots[i]]->result;
+
+			if ((uint32_t)(result >> 32) == ivr_chan[slots[i]]->index)
+			{
+				ivr_chan[slots[i]]->stamp[3] = ivr_clock_us();
+				responses[slots[i]] = (uint8_t)result;
+			}
+		}
+
+		else if (rchan)
+		{
+			f = ast_read(c);
+
+			if (f == 0)
+			{	
+				break;
+          	}
+
+			if (f->frametype == AST_FRAME_CONTROL)
+			{
+				switch(f->subclass.integer)
+				{
+					case AST_CONTROL_HANGUP:
+						ast_frfree(f);
+						failure = IVR_RESPONSE_FAIL_HANGUP;
+						ms = 0;
+						continue;
+
+					case AST_CONTROL_RINGING:
+					case AST_CONTROL_ANSWER:
+						break;
+
+					default:
+						ast_log(LOG_WARNING, "Unexpected control subclass '%d'\n", f->subclass.integer);
+						break;
+				}
+			}
+
+			else if (typeahead && (f->frametype == AST_FRAME_DTMF) && (typed != sizeof(digits)))
+			{
+				digits[typed++] = f->subclass.integer;
+			}
+
+			ast_frfree(f);
+		}
+	}
+
+	for (i = 0; (failure != IVR_RESPONSE_FAIL_HANGUP) && (i != typed); ++i)
+	{
+		struct ast_frame digit = {.frametype = AST_FRAME_DTMF};
+
+		digit.subclass.integer = digits[i];
+		ast_queue_frame(c, &digit);
+	}
+
+	for (i = 0; i != count; ++i)
+	{
+		if (responses[i] == IVR_RESPONSE_PENDING)
+		{
+			if (failure == IVR_RESPONSE_FAIL_INTERNAL)
+			{
+				__sync_fetch_and_add(&ivr_stats.caller_timeouts, 1);
+			}
+			else
+			{
+				ivr_channel_cancel(ivr_chan[i]);
+				ivr_detach_channel(c, ivr_chan[i]);
+			}
+
+			responses[i] = failure; // Time is up
+		}
+	}
+}
+
+static ivr_cache_entry_t ** ivr_cache_bucket(ivr_cache_t * cache, const char * key)
+{
+	return &cache->buckets[(unsigned int)ast_str_hash(key) % cache->bucket_count];
+}
+
+//
+// Size the cache, dropping every entry.  A capacity of 0 disables it.
+//
+static int ivr_cache_configure(ivr_cache_t * cache, unsigned int capacity)
+{
+	ivr_cache_entry_t * entries = 0;
+	ivr_cache_entry_t ** buckets = 0;
+	unsigned int i;
+
+	if (capacity != 0)
+	{
+		entries = ast_calloc(capacity, sizeof(*entries));
+		buckets = ast_calloc(capacity, sizeof(*buckets));
+
+		if ((entries == 0) || (buckets == 0))
+		{
+			ast_free(entries);
+			ast_free(buckets);
+			return 0;
+		}
+
+		for (i = 0; i != capacity; ++i)
+		{
+			entries[i].hash_next = (i + 1 != capacity) ? &entries[i + 1] : 0;
+		}
+	}
+
+	ast_mutex_lock(&cache->lock);
+
+	ast_free(cache->entries);
+	ast_free(cache->buckets);
+
+	cache->entries = entries;
+	cache->buckets = buckets;
+	cache->free = entries;
+	cache->capacity = capacity;
+	cache->bucket_count = capacity;
+	cache->count = 0;
+	cache->lru.lru_next = &cache->lru;
+	cache->lru.lru_prev = &cache->lru;
+
+	ast_mutex_unlock(&cache->lock);
+
+	return 1;
+}
+
+// Caller holds the cache lock.
+static void ivr_cache_unlink(ivr_cache_t * cache, ivr_cache_entry_t * entry)
+{
+	ivr_cache_entry_t ** link = ivr_cache_bucket(cache, entry->key);
+
+	while (*link != entry)
+	{
+		link = &(*link)->hash_next;
+	}
+
+	*link = entry->hash_next;
+
+	entry->lru_prev->lru_next = entry->lru_next;
+	entry->lru_next->lru_prev = entry->lru_prev;
+
+	entry->hash_next = cache->free;
+	cache->free = entry;
+	--cache->count;
+}
+
+static int ivr_cache_get(ivr_cache_t * cache, const char * key, int * value)
+{
+	ivr_cache_entry_t * entry;
+	int found = 0;
+
+	if (cache->capacity == 0)
+	{
+		return 0;
+	}
+
+	ast_mutex_lock(&cache->lock);
+
+	if (cache->capacity != 0)
+	{
+		for (entry = *ivr_cache_bucket(cache, key); entry != 0; entry = entry->hash_next)
+		{
+			if (0 == strcmp(entry->key, key))
+			{
+				break;
+			}
+		}
+
+		if ((entry != 0) && (entry->expires <= ivr_clock_ms()))
+		{
+			ivr_cache_unlink(cache, entry);
+			entry = 0;
+		}
+
+		if (entry != 0)
+		{
+			entry->lru_prev->lru_next = entry->lru_next;
+			entry->lru_next->lru_prev = entry->lru_prev;
+			entry->lru_next = cache->lru.lru_next;
+			entry->lru_prev = &cache->lru;
+			cache->lru.lru_next->lru_prev = entry;
+			cache->lru.lru_next = entry;
+
+			*value = entry->value;
+			found = 1;
+			++cache->hits;
+		}
+		else
+		{
+			++cache->misses;
+		}
+	}
+
+	ast_mutex_unlock(&cache->lock);
+
+	return found;
+}
+
+static void ivr_cache_put(ivr_cache_t * cache, const char * key, int value, unsigned int ttl)
+{
+	ivr_cache_entry_t ** bucket;
+	ivr_cache_entry_t * entry;
+
+	if ((cache->capacity == 0) || (ttl == 0))
+	{
+		return;
+	}
+
+	ast_mutex_lock(&cache->lock);
+
+	if (cache->capacity != 0)
+	{
+		for (entry = *ivr_cache_bucket(cache, key); entry != 0; entry = entry->hash_next)
+		{
+			if (0 == strcmp(entry->key, key))
+			{
+				ivr_cache_unlink(cache, entry);
+				break;
+			}
+		}
+
+		if (cache->free == 0)
+		{
+			ivr_cache_unlink(cache, cache->lru.lru_prev);
+		}
+
+		entry = cache->free;
+		cache->free = entry->hash_next;
+
+		ast_copy_string(entry->key, key, sizeof(entry->key));
+		entry->value = value;
+		entry->expires = ivr_clock_ms() + ttl;
+
+		bucket = ivr_cache_bucket(cache, entry->key);
+		entry->hash_next = *bucket;
+		*bucket = entry;
+
+		entry->lru_next = cache->lru.lru_next;
+		entry->lru_prev = &cache->lru;
+		cache->lru.lru_next->lru_prev = entry;
+		cache->lru.lru_next = entry;
+
+		++cache->count;
+	}
+
+	ast_mutex_unlock(&cache->lock);
+}
+
+//
+// Drop one key, or every entry when key is 0.  Returns the number dropped.
+//
+static int ivr_cache_flush(ivr_cache_t * cache, const char * key)
+{
+	ivr_cache_entry_t * entry;
+	int count = 0;
+
+	ast_mutex_lock(&cache->lock);
+
+	if (cache->capacity != 0)
+	{
+		for (entry = cache->lru.lru_next; entry != &cache->lru; )
+		{
+			entry = entry->lru_next;
+
+			if ((key == 0) || (0 == strcmp(entry->lru_prev->key, key)))
+			{
+				ivr_cache_unlink(cache, entry->lru_prev);
+				++count;
+			}
+		}
+	}
+
+	ast_mutex_unlock(&cache->lock);
+
+	return count;
+}
+
+//
+// Wait for the response to a request made without a channel, from a module
+// thread such as the outbox drainer.
+//
+static int ivr_wait_fd(ivr_channel_t * ivr_chan, int ms)
+{
+	int response = IVR_RESPONSE_PENDING;
+
+	ivr_wait_fds(&ivr_chan, 1, &response, ivr_clock_ms() + ms);
+
+	return response;
+}
+
+//
+// ivr_wait_all without a channel: slots whose response is
+// IVR_RESPONSE_PENDING are waited on until the deadline (CLOCK_MONOTONIC
+// ms), and any still pending then get ERROR_INTERNAL.
+//
+static void ivr_wait_fds(ivr_channel_t ** ivr_chan, int count, int * responses, uint64_t deadline)
+{
+	struct pollfd fds[IVR_PIPELINE_MAX];
+	int slots[IVR_PIPELINE_MAX];
+	uint64_t signal;
+	uint64_t result;
+	uint64_t now;
+	int n;
+	int i;
+
+	while ((now = ivr_clock_ms()) < deadline)
+	{
+		for (i = 0, n = 0; (i != count) && (n != IVR_PIPELINE_MAX); ++i)
+		{
+			if (responses[i] == IVR_RESPONSE_PENDING)
+			{
+				fds[n].fd = ivr_chan[i]->event_fd;
+				fds[n].events = POLLIN;
+				fds[n].revents = 0;
+				slots[n++] = i;
+			}
+		}
+
+		if (n == 0)
+		{
+			return;
+		}
+
+		if ((poll(fds, n, (int)(deadline - now)) < 0) && (errno != EINTR))
+		{
+			ast_log(LOG_WARNING, "ivr_wait_fds failed (%s)\n", strerror(errno));
+			break;
+		}
+
+		for (i = 0; i != n; ++i)
+		{
+			if (((fds[i].revents & POLLIN) == 0) || (sizeof(signal) != read(fds[i].fd, &signal, sizeof(signal))))
+			{
+				continue;
+			}
+
+			result = ivr_chan[slots[i]]->result;
+
+			if ((uint32_t)(result >> 32) == ivr_chan[slots[i]]->index)
+			{
+				responses[slots[i]] = (uint8_t)result;
+			}
+		}
+	}
+
+	for (i = 0; i != count; ++i)
+	{
+		if (responses[i] == IVR_RESPONSE_PENDING)
+		{
+			responses[i] = IVR_RESPONSE_FAIL_INTERNAL; // Time is up
+		}
+	}
+}
+
+static uint32_t ivr_outbox_checksum(const ivr_outbox_record_t * record)
+{
+	const uint8_t * p = (const uint8_t *)&record->queued;
+	const uint8_t * end = (const uint8_t *)(record + 1);
+	uint32_t hash = 2166136261u;
+
+	while (p != end)
+	{
+		hash = (hash ^ *p++) * 16777619u;
+	}
+
+	return hash;
+}
+
+//
+// Map the journal and find the messages a previous run left unsent.
+//
+static int ivr_outbox_open(ivr_outbox_t * outbox)
+{
+	ivr_outbox_record_t * record;
+	size_t size = outbox->capacity * sizeof(ivr_outbox_record_t);
+	char * dir;
+	unsigned int pending = 0;
+	unsigned int i;
+
+	dir = ast_strdupa(outbox->path);
+
+	if (strrchr(dir, '/') != 0)
+	{
+		*strrchr(dir, '/') = 0;
+		ast_mkdir(dir, 0755);
+	}
+
+	outbox->fd = open(outbox->path, O_RDWR | O_CREAT | O_CLOEXEC, 0640);
+
+	if (outbox->fd < 0)
+	{
+		ast_log(LOG_ERROR, "Unable to open IVR outbox %s (%s).\n", outbox->path, strerror(errno));
+		return 0;
+	}
+
+	if (ftruncate(outbox->fd, size) != 0)
+	{
+		ast_log(LOG_ERROR, "Unable to size IVR outbox %s (%s).\n", outbox->path, strerror(errno));
+		close(outbox->fd);
+		outbox->fd = -1;
+		return 0;
+	}
+
+	outbox->records = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, outbox->fd, 0);
+
+	if (outbox->records == MAP_FAILED)
+	{
+		ast_log(LOG_ERROR, "Unable to map IVR outbox %s (%s).\n", outbox->path, strerror(errno));
+		outbox->records = 0;
+		close(outbox->fd);
+		outbox->fd = -1;
+		return 0;
+	}
+
+	outbox->head = outbox->capacity;
+	outbox->tail = 0;
+
+	for (i = 0; i != outbox->capacity; ++i)
+	{
+		record = &outbox->records[i];
+
+		if (record->state == IVR_OUTBOX_EMPTY)
+		{
+			continue;
+		}
+
+		outbox->tail = i + 1;
+
+		// an async message that was with a worker may not have been sent
+		if (record->state == IVR_OUTBOX_HELD)
+		{
+			record->state = IVR_OUTBOX_PENDING;
+		}
+
+		if (record->state != IVR_OUTBOX_PENDING)
+		{
+			continue;
+		}
+
+		if (record->checksum != ivr_outbox_checksum(record))
+		{
+			ast_log(LOG_WARNING, "IVR outbox record %u is damaged, dropping it.\n", i);
+			record->state = IVR_OUTBOX_FAILED;
+			continue;
+		}
+
+		if (outbox->head == outbox->capacity)
+		{
+			outbox->head = i;
+		}
+
+		++pending;
+	}
+
+	if (outbox->head > outbox->tail)
+	{
+		outbox->head = outbox->tail;
+	}
+
+	if (pending != 0)
+	{
+		ast_log(LOG_NOTICE, "IVR outbox holds %u unsent messages, resending.\n", pending);
+	}
+
+	return 1;
+}
+
+//
+// Journal a message the server could not take, PENDING, or an async message
+// about to be sent, HELD, and store its record in position if given.
+// Returns once the record is on disk; appends that arrive while the drainer
+// is syncing share the next sync.  Returns 0 when the outbox is off or full.
+//
+static int ivr_outbox_append(ivr_outbox_t * outbox, const ivr_request_t * request, const char * tag, uint32_t state, unsigned int * position)
+{
+	ivr_outbox_record_t * record;
+	uint64_t sequence;
+	int durable;
+
+	if (outbox->records == 0)
+	{
+		return 0;
+	}
+
+	ast_mutex_lock(&outbox->lock);
+
+	if ((outbox->tail == outbox->capacity) && (outbox->head == outbox->tail))
+	{
+		outbox->head = 0;
+		outbox->tail = 0;
+	}
+
+	if ((outbox->records == 0) || (outbox->tail == outbox->capacity))
+	{
+		ast_mutex_unlock(&outbox->lock);
+		ast_log(LOG_WARNING, "IVR outbox is full, message to %s lost.\n", request->param[0]);
+		return 0;
+	}
+
+	record = &outbox->records[outbox->tail];
+	memset(record, 0, sizeof(*record));
+	record->queued = time(0);
+	ast_copy_string(record->tag, tag, sizeof(record->tag));
+	memcpy(record->param, request->param, sizeof(record->param));
+	memcpy(record->message, request->message, sizeof(record->message));
+	record->checksum = ivr_outbox_checksum(record);
+
+	__sync_synchronize();
+
+	record->state = state;
+
+	if (position != 0)
+	{
+		*position = outbox->tail;
+	}
+
+	++outbox->tail;
+	sequence = ++outbox->written;
+
+	ast_cond_broadcast(&outbox->cond);
+
+	while ((outbox->synced < sequence) && !outbox->stop)
+	{
+		ast_cond_wait(&outbox->cond, &outbox->lock);
+	}
+
+	durable = (outbox->synced >= sequence);
+
+	ast_mutex_unlock(&outbox->lock);
+
+	return durable;
+}
+
+//
+// Settle a HELD record with the response to its message: sent, refused, or
+// pending again for the drainer when the server was unavailable.  Returns 1
+// in the last case.  Called by the workers, so never waits for the sync.
+//
+static int ivr_outbox_settle(ivr_outbox_t * outbox, unsigned int position, int response)
+{
+	int pending = 0;
+
+	ast_mutex_lock(&outbox->lock);
+
+	if ((outbox->records != 0) && (position < outbox->capacity) && (outbox->records[position].state == IVR_OUTBOX_HELD))
+	{
+		switch (response)
+		{
+			case IVR_RESPONSE_FAIL_SYSTEMNOTAVAILABLE:
+			case IVR_RESPONSE_FAIL_QUEUEFULL:
+			case IVR_RESPONSE_FAIL_INTERNAL:
+				outbox->records[position].state = IVR_OUTBOX_PENDING;
+				pending = 1;
+				break;
+
+			case IVR_RESPONSE_SUCCESS:
+			case IVR_RESPONSE_SUCCESS_MESSAGEQUEUED:
+			case IVR_RESPONSE_SUCCESS_MESSAGEDELIVERED:
+			case IVR_RESPONSE_SUCCESS_MESSAGEREAD:
+				outbox->records[position].state = IVR_OUTBOX_SENT;
+				break;
+
+			default:
+				outbox->records[position].state = IVR_OUTBOX_FAILED;
+				break;
+		}
+
+		++outbox->written;		// the state change rides on the next sync
+		ast_cond_broadcast(&outbox->cond);
+	}
+
+	ast_mutex_unlock(&outbox->lock);
+
+	return pending;
+}
+
+//
+// Send journalled messages together, each on a slot of the drainer's own,
+// and collect their responses.
+//
+static void ivr_outbox_replay(const ivr_outbox_record_t * records, int count, int * responses)
+{
+	ivr_context_t * ivr = &ivr_context;
+	ivr_channel_t * ivr_chan[IVR_PIPELINE_MAX];
+	ivr_request_t request;
+	uint64_t deadline = ivr_clock_ms() + ivr->send_timeout + IVR_CONNECT_TIMEOUT;
+	int i;
+
+	for (i = 0; i != count; ++i)
+	{
+		responses[i] = IVR_RESPONSE_PENDING;
+		ivr_chan[i] = ivr_channel_acquire(ivr);
+
+		if (ivr_chan[i] == 0)
+		{
+			responses[i] = IVR_RESPONSE_FAIL_SYSTEMNOTAVAILABLE;
+			continue;
+		}
+
+		request.code = IVR_REQUEST_SENDMESSAGE;
+		request.index = ivr_channel_begin(ivr_chan[i]);
+		request.deadline = deadline;
+		memcpy(request.param, records[i].param, sizeof(records[i].param));
+		ast_copy_string(request.message, (records[i].message[0] != 0) ? records[i].message : records[i].param[1], sizeof(request.message));
+		ast_copy_string(request.param[3], records[i].tag, sizeof(request.param[3]));
+
+		if (!ivr_shard_send(ivr_shard(ivr, request.index), &request))
+		{
+			responses[i] = IVR_RESPONSE_FAIL_QUEUEFULL;
+		}
+	}
+
+	ivr_wait_fds(ivr_chan, count, responses, deadline);
+
+	for (i = 0; i != count; ++i)
+	{
+		if (ivr_chan[i] != 0)
+		{
+			ivr_channel_release(ivr_chan[i]);
+		}
+	}
+}
+
+//
+// Group commit and replay.  Syncs the journal whenever appenders are
+// waiting, then resends pending records in order, up to the server
+// pipeline at once, backing off while the server is unavailable.  A HELD
+// record is waited for, as its message is still with a worker and may yet
+// become pending.
+//
+static void * ivr_outbox_task(void *arg)
+{
+	ivr_outbox_t * outbox = (ivr_outbox_t *)arg;
+	ivr_outbox_record_t * batch = ast_calloc(IVR_PIPELINE_MAX, sizeof(ivr_outbox_record_t));
+	unsigned int positions[IVR_PIPELINE_MAX];
+	int responses[IVR_PIPELINE_MAX];
+	struct timespec until;
+	struct timeval tv;
+	uint64_t sequence;
+	uint64_t retry = 0;
+	unsigned int position;
+	int count;
+	int i;
+
+	if (batch == 0)
+	{
+		ast_log(LOG_ERROR, "Unable to allocate IVR outbox replay batch.\n");
+		return 0;
+	}
+
+	ast_mutex_lock(&outbox->lock);
+
+	while (!outbox->stop)
+	{
+		if (outbox->synced != outbox->written)
+		{
+			sequence = outbox->written;
+			ast_mutex_unlock(&outbox->lock);
+
+			if (msync(outbox->records, outbox->capacity * sizeof(ivr_outbox_record_t), MS_SYNC) != 0)
+			{
+				ast_log(LOG_ERROR, "Unable to sync IVR outbox (%s).\n", strerror(errno));
+			}
+
+			ast_mutex_lock(&outbox->lock);
+			outbox->synced = sequence;
+			ast_cond_broadcast(&outbox->cond);
+			continue;
+		}
+
+		while ((outbox->head != outbox->tail) && (outbox->records[outbox->head].state != IVR_OUTBOX_PENDING) && (outbox->records[outbox->head].state != IVR_OUTBOX_HELD))
+		{
+			++outbox->head;
+		}
+
+		if ((outbox->head == outbox->tail) || (outbox->records[outbox->head].state == IVR_OUTBOX_HELD) || (ivr_clock_ms() < retry))
+		{
+			if ((outbox->head == outbox->tail) && (outbox->tail != 0))
+			{
+				outbox->head = 0;
+				outbox->tail = 0;
+			}
+
+			tv = ast_tvnow();
+			until.tv_sec = tv.tv_sec + 1;
+			until.tv_nsec = tv.tv_usec * 1000;
+			ast_cond_timedwait(&outbox->cond, &outbox->lock, &until);
+			continue;
+		}
+
+		// the pending records up to the next HELD one
+		for (position = outbox->head, count = 0; (position != outbox->tail) && (count < (int)outbox->window); ++position)
+		{
+			if (outbox->records[position].state == IVR_OUTBOX_HELD)
+			{
+				break;
+			}
+
+			if (outbox->records[position].state == IVR_OUTBOX_PENDING)
+			{
+				batch[count] = outbox->records[position];
+				positions[count++] = position;
+			}
+		}
+
+		ast_mutex_unlock(&outbox->lock);
+
+		ivr_outbox_replay(batch, count, responses);
+
+		ast_mutex_lock(&outbox->lock);
+
+		// settled in journal order; one the server could not take stays pending
+		for (i = 0; i != count; ++i)
+		{
+			switch (responses[i])
+			{
+				case IVR_RESPONSE_FAIL_SYSTEMNOTAVAILABLE:
+				case IVR_RESPONSE_FAIL_QUEUEFULL:
+				case IVR_RESPONSE_FAIL_INTERNAL:
+					retry = ivr_clock_ms() + (IVR_CONNECT_SEC * 1000);
+					break;
+
+				case IVR_RESPONSE_SUCCESS:
+				case IVR_RESPONSE_SUCCESS_MESSAGEQUEUED:
+				case IVR_RESPONSE_SUCCESS_MESSAGEDELIVERED:
+				case IVR_RESPONSE_SUCCESS_MESSAGEREAD:
+					outbox->records[positions[i]].state = IVR_OUTBOX_SENT;
+					++outbox->written;		// the state change rides on the next sync
+					break;
+
+				default:
+					ast_log(LOG_WARNING, "IVR outbox message %s to %s refused (%s).\n", batch[i].tag, batch[i].param[0], ivr_response_name(responses[i]));
+					outbox->records[positions[i]].state = IVR_OUTBOX_FAILED;
+					++outbox->written;
+					break;
+			}
+		}
+	}
+
+	ast_mutex_unlock(&outbox->lock);
+
+	ast_free(batch);
+
+	return 0;
+}
+
+static int ivr_outbox_start(ivr_outbox_t * outbox)
+{
+	if (!ivr_outbox_open(outbox))
+	{
+		return 0;
+	}
+
+	ast_cond_init(&outbox->cond, NULL);
+	outbox->stop = 0;
+
+	if (pthread_create(&outbox->thread, NULL, ivr_outbox_task, outbox))
+	{
+		ast_log(LOG_ERROR, "Unable to create IVR outbox thread.\n");
+		outbox->thread = -1;
+		return 0;
+	}
+
+	return 1;
+}
+
+static void ivr_outbox_stop(ivr_outbox_t * outbox)
+{
+	if (outbox->thread != -1)
+	{
+		ast_mutex_lock(&outbox->lock);
+		outbox->stop = 1;
+		ast_cond_broadcast(&outbox->cond);
+		ast_mutex_unlock(&outbox->lock);
+
+		pthread_join(outbox->thread, 0);
+		outbox->thread = -1;
+
+		ast_cond_destroy(&outbox->cond);
+	}
+
+	// the workers may still settle records
+	ast_mutex_lock(&outbox->lock);
+
+	if (outbox->records != 0)
+	{
+		msync(outbox->records, outbox->capacity * sizeof(ivr_outbox_record_t), MS_SYNC);
+		munmap(outbox->records, outbox->capacity * sizeof(ivr_outbox_record_t));
+		outbox->records = 0;
+	}
+
+	ast_mutex_unlock(&outbox->lock);
+
+	if (outbox->fd >= 0)
+	{
+		close(outbox->fd);
+		outbox->fd = -1;
+	}
+}
+
+static void ivr_datastore_destroy(void *data)
+{
+	ivr_channel_t * ivr_chan = (ivr_channel_t *)data;
+
+	if (ivr_chan != 0)
+	{
+		ivr_channel_release(ivr_chan);
+	}
+}
+
+//
+// Forget the channel's slot once it has been handed to the worker by
+// ivr_channel_cancel(), so ivr_datastore_destroy() does not release it again.
+//
+static void ivr_detach_channel(struct ast_channel * chan, ivr_channel_t * ivr_chan)
+{
+	struct ast_datastore * datastore;
+
+	ast_channel_lock(chan);
+
+	datastore = ast_channel_datastore_find(chan, &ivr_datastore, 0);
+
+	if ((datastore != 0) && (datastore->data == ivr_chan))
+	{
+		datastore->data = 0;
+		ast_channel_datastore_remove(chan, datastore);
+		ast_datastore_free(datastore);
+	}
+
+	ast_channel_unlock(chan);
+}
+
+static ivr_channel_t * ivr_get_channel(struct ast_channel * chan)
+{
+	ivr_channel_t * ivr_chan;
+	struct ast_datastore * datastore;
+
+	datastore = ast_channel_datastore_find(chan, &ivr_datastore, 0);
+	
+	if (datastore == 0)
+	{
+		ivr_chan = ivr_channel_acquire(&ivr_context);
+		datastore = ast_datastore_alloc(&ivr_datastore, 0);
+		datastore->data = ivr_chan;
+		ast_channel_datastore_add(chan, datastore);
+		return ivr_chan;
+	}
+	else
+	{
+		return (ivr_channel_t *)datastore->data;
+	}
+}
+
+//
+// Send one message to each recipient in parallel: the first uses the
+// channel's slot, the others borrow slots from the pool for the duration.
+// tags[i] receives the message tag CRS_QueryMessage takes.  With async the
+// caller does not wait: each queued message is QUEUED at once and its slot
+// handed to the worker, which reports the response in a CRSMessageStatus
+// manager event, whether or not the channel is still there.  With typeahead
+// digits dialled during the wait are kept for the next read.
+//
+static void ivr_sendmessage(struct ast_channel * chan, char ** recipients, int count, const char *message, const char * caller, int async, int typeahead, int * responses, char (*tags)[30], ivr_trace_t * traces, ivr_receipt_t * receipts)
+{
+	ivr_context_t * ivr = &ivr_context;
+	ivr_channel_t * ivr_chan[IVR_RECIPIENTS_MAX];
+	ivr_request_t request[IVR_RECIPIENTS_MAX];
+	uint64_t started = ivr_clock_us();
+	uint64_t deadline = ivr_clock_ms() + ivr->send_timeout;
+	uint64_t elapsed;
+	char text[IVR_MESSAGE_MAX];
+	unsigned int position;
+	int i;
+
+	for (i = 0; i != count; ++i)
+	{
+		tags[i][0] = 0;
+		responses[i] = IVR_RESPONSE_FAIL_SYSTEMNOTAVAILABLE;
+		receipts[i].reference[0] = 0;
+		receipts[i].position = -1;
+	}
+
+	if ((ivr_chan[0] = ivr_get_channel(chan)) == 0)
+	{
+		return;
+	}
+
+	if ((message == 0) || (message[0] == 0))
+	{
+		message = "no message";
+	}
+	else if (ivr_substitute(message, text, sizeof(text)))
+	{
+		message = text;
+	}
+	else
+	{
+		ivr_field_fits(message, IVR_MESSAGE_MAX, "message");
+	}
+
+	if ((caller != 0) && (caller[0] != 0))
+	{
+		ivr_field_fits(caller, sizeof(request[0].param[2]), "caller");
+	}
+
+	for (i = 0; i != count; ++i)
+	{
+		if ((i != 0) && ((ivr_chan[i] = ivr_channel_acquire(ivr)) == 0))
+		{
+			responses[i] = IVR_RESPONSE_FAIL_SYSTEMNOTAVAILABLE;
+			continue;
+		}
+
+		request[i].code = IVR_REQUEST_SENDMESSAGE;
+		request[i].index = ivr_channel_begin(ivr_chan[i]);
+		request[i].deadline = async ? 0 : deadline;		// nobody to stop waiting
+
+		if ((recipients[i] == 0) || (recipients[i][0] == 0) || !ivr_field_fits(recipients[i], sizeof(request[i].param[0]), "recipient"))
+		{
+			responses[i] = IVR_RESPONSE_FAIL_INTERNAL;
+			continue;
+		}
+		else
+		{
+			ast_copy_string(request[i].param[0], recipients[i], sizeof(request[i].param[0]));
+		}
+
+		ast_copy_string(request[i].message, message, sizeof(request[i].message));
+		request[i].param[1][0] = 0;
+
+		if ((caller == 0) || (caller[0] == 0))
+		{
+			ast_copy_string(request[i].param[2], "unknown caller", sizeof(request[i].param[2]));
+		}
+		else
+		{
+			ast_copy_string(request[i].param[2], caller, sizeof(request[i].param[2]));
+		}
+
+		request[i].param[3][0] = 0;
+
+		snprintf(tags[i], sizeof(tags[i]), "%s%08x", ivr->tagBase, request[i].index);
+
+		traces[i].enqueued = ivr_clock_us();
+
+		// set before the request can be answered
+		ivr_chan[i]->async = async;
+		ivr_chan[i]->outbox = 0;
+
+		// nobody will be there to journal it if the server is down
+		if (async && ivr_outbox_append(&ivr_outbox, &request[i], tags[i], IVR_OUTBOX_HELD, &position))
+		{
+			ivr_chan[i]->outbox = position + 1;
+		}
+
+		if (!ivr_shard_send(ivr_shard(ivr, request[i].index), &request[i]))
+		{
+			ivr_chan[i]->async = 0;
+			__sync_fetch_and_add(&ivr_stats.queue_full, 1);
+			responses[i] = IVR_RESPONSE_FAIL_QUEUEFULL;
+
+			if ((ivr_chan[i]->outbox != 0) && ivr_outbox_settle(&ivr_outbox, ivr_chan[i]->outbox - 1, responses[i]))
+			{
+				responses[i] = IVR_RESPONSE_SUCCESS_MESSAGEQUEUED;
+			}
+
+			ivr_chan[i]->outbox = 0;
+		}
+		else if (async)
+		{
+			ivr_channel_cancel(ivr_chan[i]);
+
+			if (i == 0)
+			{
+				ivr_detach_channel(chan, ivr_chan[i]);
+			}
+
+			// the slot now belongs to the worker
+			ivr_chan[i] = 0;
+			responses[i] = IVR_RESPONSE_SUCCESS_MESSAGEQUEUED;
+		}
+		else
+		{
+			responses[i] = IVR_RESPONSE_PENDING;
+		}
+	}
+
+	ivr_wait_all(chan, ivr_chan, count, responses, deadline, typeahead);
+
+	elapsed = ivr_clock_us() - started;
+
+	for (i = 0; i != count; ++i)
+	{
+		if ((tags[i][0] == 0) || (ivr_chan[i] == 0))
+		{
+			continue;
+		}
+
+		ivr_histogram_record(&ivr_stats.caller[IVR_STAT_SEND], elapsed);
+		ivr_trace_collect(&traces[i], ivr_chan[i]);
+		ivr_receipt_collect(&receipts[i], ivr_chan[i]);
+
+		if (((responses[i] == IVR_RESPONSE_FAIL_SYSTEMNOTAVAILABLE) || (responses[i] == IVR_RESPONSE_FAIL_QUEUEFULL)) && ivr_outbox_append(&ivr_outbox, &request[i], tags[i], IVR_OUTBOX_PENDING, 0))
+		{
+			responses[i] = IVR_RESPONSE_SUCCESS_MESSAGEQUEUED;
+		}
+	}
+
+	for (i = 1; i != count; ++i)
+	{
+		// a slot abandoned at hangup now belongs to the worker
+		if ((ivr_chan[i] != 0) && (responses[i] != IVR_RESPONSE_FAIL_HANGUP))
+		{
+			ivr_channel_release(ivr_chan[i]);
+		}
+	}
+} 
+
+//
+// Copy the text of a [messagesubstitution] code into text.  Returns 0 when
+// code has no substitution.
+//
+static int ivr_substitute(const char * code, char * text, size_t length)
+{
+	ivr_substitutions_t * table = ao2_global_obj_ref(ivr_substitutions);
+	unsigned int i;
+	int found = 0;
+
+	if (table == 0)
+	{
+		return 0;
+	}
+
+	for (i = ast_str_hash(code) & table->mask; table->slot[i].code[0] != 0; i = (i + 1) & table->mask)
+	{
+		if (!strcmp(table->slot[i].code, code))
+		{
+			ast_copy_string(text, table->slot[i].text, length);
+			found = 1;
+			break;
+		}
+	}
+
+	ao2_ref(table, -1);
+
+	return found;
+}
+
+//
+// Expand a recipient list (a&b&@group) into buffer, groups coming from the
+// [groups] section, and split it.  Returns the number of recipients.
+//
+static int ivr_recipients(const char * list, char * buffer, size_t length, char ** recipients)
+{
+	ivr_groups_t * groups = ao2_global_obj_ref(ivr_groups);
+	char * copy = ast_strdupa(list);
+	char * item;
+	char * next = buffer;
+	char * remaining = buffer;
+	unsigned int i;
+	int count = 0;
+
+	buffer[0] = 0;
+
+	while ((item = strsep(&copy, "&")) != 0)
+	{
+		item = ast_strip(item);
+
+		if (item[0] != '@')
+		{
+			ast_build_string(&next, &length, "%s&", item);
+			continue;
+		}
+
+		for (i = 0; (groups != 0) && (i != groups->count); ++i)
+		{
+			if (0 == strcasecmp(groups->group[i].name, &item[1]))
+			{
+				break;
+			}
+		}
+
+		if ((groups == 0) || (i == groups->count))
+		{
+			ast_log(LOG_WARNING, FUNC_SENDMSG ": unknown recipient group %s\n", &item[1]);
+			continue;
+		}
+
+		ast_build_string(&next, &length, "%s&", groups->group[i].members);
+	}
+
+	ao2_cleanup(groups);
+
+	while (((item = strsep(&remaining, "&")) != 0) && (count != IVR_RECIPIENTS_MAX))
+	{
+		item = ast_strip(item);
+
+		if (item[0] != 0)
+		{
+			recipients[count++] = item;
+		}
+	}
+
+	return count;
+}
+
+//
+// A verification the caller started early (ivr_verify_speculate) is taken
+// over when it is for the same recipient and is still in time, or has been
+// answered for the recipient; otherwise the request is sent now.
+//
+static int ivr_verifyrecipient(struct ast_channel * chan, const char * recipient, int typeahead, ivr_trace_t * trace)
+{
+	ivr_context_t * ivr = &ivr_context;
+	ivr_channel_t * ivr_chan;
+	ivr_request_t request;
+	ivr_speculation_t speculation;
+	int speculated;
+	uint64_t result;
+	uint64_t started;
+	char key[64];
+	int response;
+
+	speculated = ivr_speculation_take(chan, &speculation);
+
+	if (!ivr_field_fits(recipient, sizeof(request.param[0]), "recipient"))
+	{
+		return IVR_RESPONSE_FAIL_INTERNAL;
+	}
+
+	snprintf(key, sizeof(key), "%s,%s", ivr->client_id, recipient);
+
+	if (ivr_cache_get(&ivr_verify_cache, key, &response))
+	{
+		return response;
+	}
+
+	ivr_chan = ivr_get_channel(chan);
+
+	if (ivr_chan == 0)
+	{
+		return IVR_RESPONSE_FAIL_SYSTEMNOTAVAILABLE;
+	}
+
+	started = ivr_clock_us();
+	result = ivr_chan->result;
+
+	if (speculated && ((speculation.index != ivr_chan->index) || strcmp(speculation.recipient, recipient)))
+	{
+		speculated = 0;
+	}
+	else if (speculated && ((uint32_t)(result >> 32) == speculation.index))
+	{
+		speculated = ((uint8_t)result == IVR_RESPONSE_SUCCESS) ||
+			((uint8_t)result == IVR_RESPONSE_FAIL_RECIPIENTNOTFOUND) ||
+			((uint8_t)result == IVR_RESPONSE_FAIL_RECIPIENTDISABLED);
+	}
+	else if (speculated)
+	{
+		speculated = (speculation.deadline > started / 1000);
+	}
+
+	if (speculated)
+	{
+		__sync_fetch_and_add(&ivr_stats.speculative_used, 1);
+
+		request.deadline = speculation.deadline;
+		trace->enqueued = speculation.started;
+	}
+	else
+	{
+		request.code = IVR_REQUEST_VERIFYRECIPIENT;
+		request.index = ivr_channel_begin(ivr_chan);
+		request.deadline = (started / 1000) + ivr->verify_timeout;
+		ast_copy_string(request.param[0], recipient, sizeof(request.param[0]));
+		request.param[1][0] = 0;
+		request.param[2][0] = 0;
+		request.param[3][0] = 0;
+
+		trace->enqueued = started;
+
+		if (!ivr_shard_send(ivr_shard(ivr, request.index), &request))
+		{
+			__sync_fetch_and_add(&ivr_stats.queue_full, 1);
+			return IVR_RESPONSE_FAIL_QUEUEFULL;
+		}
+	}
+
+	response = ivr_wait(chan, ivr_chan, request.deadline, typeahead);
+
+	ivr_histogram_record(&ivr_stats.caller[IVR_STAT_VERIFY], ivr_clock_us() - started);
+	ivr_trace_collect(trace, ivr_chan);
+
+	switch (response)
+	{
+		case IVR_RESPONSE_SUCCESS:
+			ivr_cache_put(&ivr_verify_cache, key, response, ivr_verify_cache.ttl[1]);
+			break;
+
+		case IVR_RESPONSE_FAIL_RECIPIENTNOTFOUND:
+		case IVR_RESPONSE_FAIL_RECIPIENTDISABLED:
+			ivr_cache_put(&ivr_verify_cache, key, response, ivr_verify_cache.ttl[0]);
+			break;
+	}
+
+	return response;
+} 
+
+//
+// Start verifying a recipient the caller may still be dialling, without
+// waiting for the answer.  A later candidate supersedes an earlier one: the
+// slot's generation moves on and the earlier answer is dropped when it comes.
+//
+static void ivr_verify_speculate(struct ast_channel * chan, const char * recipient)
+{
+	ivr_context_t * ivr = &ivr_context;
+	ivr_channel_t * ivr_chan;
+	ivr_request_t request;
+	ivr_speculation_t * speculation;
+	struct ast_datastore * datastore;
+	char key[64];
+	int response;
+
+	// too long to send; the verification that follows says so
+	if (strlen(recipient) >= sizeof(request.param[0]))
+	{
+		return;
+	}
+
+	snprintf(key, sizeof(key), "%s,%s", ivr->client_id, recipient);
+
+	if (ivr_cache_get(&ivr_verify_cache, key, &response))
+	{
+		return;
+	}
+
+	ivr_chan = ivr_get_channel(chan);
+
+	if (ivr_chan == 0)
+	{
+		return;
+	}
+
+	ast_channel_lock(chan);
+
+	datastore = ast_channel_datastore_find(chan, &ivr_speculation_datastore, 0);
+
+	if (datastore == 0)
+	{
+		datastore = ast_datastore_alloc(&ivr_speculation_datastore, 0);
+
+		if ((datastore != 0) && ((datastore->data = ast_calloc(1, sizeof(ivr_speculation_t))) == 0))
+		{
+			ast_datastore_free(datastore);
+			datastore = 0;
+		}
+
+		if (datastore != 0)
+		{
+			ast_channel_datastore_add(chan, datastore);
+		}
+	}
+
+	ast_channel_unlock(chan);
+
+	if (datastore == 0)
+	{
+		return;
+	}
+
+	request.code = IVR_REQUEST_VERIFYRECIPIENT;
+	request.index = ivr_channel_begin(ivr_chan);
+	request.deadline = ivr_clock_ms() + ivr->verify_timeout;
+	ast_copy_string(request.param[0], recipient, sizeof(request.param[0]));
+	request.param[1][0] = 0;
+	request.param[2][0] = 0;
+	request.param[3][0] = 0;
+
+	speculation = (ivr_speculation_t *)datastore->data;
+	speculation->index = 0;
+
+	if (!ivr_shard_send(ivr_shard(ivr, request.index), &request))
+	{
+		return;
+	}
+
+	__sync_fetch_and_add(&ivr_stats.speculative, 1);
+
+	ast_copy_string(speculation->recipient, recipient, sizeof(speculation->recipient));
+	speculation->index = request.index;
+	speculation->deadline = request.deadline;
+	speculation->started = ivr_clock_us();
+}
+
+//
+// Remove the channel's early verification, if any.  Returns 1 with it copied
+// to speculation, 0 when there was none.
+//
+static int ivr_speculation_take(struct ast_channel * chan, ivr_speculation_t * speculation)
+{
+	struct ast_datastore * datastore;
+	int found = 0;
+
+	ast_channel_lock(chan);
+
+	datastore = ast_channel_datastore_find(chan, &ivr_speculation_datastore, 0);
+
+	if (datastore != 0)
+	{
+		*speculation = *(ivr_speculation_t *)datastore->data;
+		found = (speculation->index != 0);
+
+		ast_channel_datastore_remove(chan, datastore);
+		ast_datastore_free(datastore);
+	}
+
+	ast_channel_unlock(chan);
+
+	return found;
+}
+
+//
+// The status table answers repeat queries for messages already read; any
+// other status may still change, so it is asked of the server.  Status
+// updates the server pushes land in the same table.
+//
+static int ivr_querymessage(struct ast_channel * chan, const char * tag, ivr_trace_t * trace)
+{
+	ivr_context_t * ivr = &ivr_context;
+	ivr_channel_t * ivr_chan;
+	ivr_request_t request;
+	uint64_t started;
+	int response;
+
+	if (ivr_cache_get(&ivr_message_cache, tag, &response) && (response == IVR_RESPONSE_SUCCESS_MESSAGEREAD))
+	{
+		return response;
+	}
+
+	if (!ivr_field_fits(tag, sizeof(request.param[0]), "message tag"))
+	{
+		return IVR_RESPONSE_FAIL_INTERNAL;
+	}
+
+	ivr_chan = ivr_get_channel(chan);
+
+	if (ivr_chan == 0)
+	{
+		return IVR_RESPONSE_FAIL_SYSTEMNOTAVAILABLE;
+	}
+
+	request.code = IVR_REQUEST_QUERYMESSAGE;
+	request.index = ivr_channel_begin(ivr_chan);
+	request.deadline = ivr_clock_ms() + ivr->query_timeout;
+	ast_copy_string(request.param[0], tag, sizeof(request.param[0]));
+	request.param[1][0] = 0;
+	request.param[2][0] = 0;
+	request.param[3][0] = 0;
+
+	started = ivr_clock_us();
+	trace->enqueued = started;
+
+	if (!ivr_shard_send(ivr_shard(ivr, request.index), &request))
+	{
+		__sync_fetch_and_add(&ivr_stats.queue_full, 1);
+		return IVR_RESPONSE_FAIL_QUEUEFULL;
+	}
+
+	response = ivr_wait(chan, ivr_chan, request.deadline, 0);
+
+	ivr_histogram_record(&ivr_stats.caller[IVR_STAT_QUERY], ivr_clock_us() - started);
+	ivr_trace_collect(trace, ivr_chan);
+
+	switch (response)
+	{
+		case IVR_RESPONSE_SUCCESS_MESSAGEQUEUED:
+		case IVR_RESPONSE_SUCCESS_MESSAGEDELIVERED:
+		case IVR_RESPONSE_SUCCESS_MESSAGEREAD:
+			ivr_cache_put(&ivr_message_cache, tag, response, ivr_message_cache.ttl[1]);
+			break;
+	}
+
+	return response;
+}
+
+static void ivr_trace_collect(ivr_trace_t * trace, const ivr_channel_t * ivr_chan)
+{
+	trace->dequeued = ivr_chan->stamp[0];
+	trace->written = ivr_chan->stamp[1];
+	trace->read = ivr_chan->stamp[2];
+	trace->woken = ivr_chan->stamp[3];
+}
+
+//
+// The server's message id and queue position, once the response is in:
+// the worker stores them before the response.
+//
+static void ivr_receipt_collect(ivr_receipt_t * receipt, const ivr_channel_t * ivr_chan)
+{
+	if ((uint32_t)(ivr_chan->result >> 32) != ivr_chan->index)
+	{
+		return;
+	}
+
+	__sync_synchronize();
+
+	ast_copy_string(receipt->reference, ivr_chan->reference, sizeof(receipt->reference));
+	receipt->position = ivr_chan->position;
+}
+
+//
+// Request fields are bounded by the queue cell they travel in.  Returns 0,
+// having said so, when value is too long for its field.
+//
+static int ivr_field_fits(const char * value, size_t size, const char * name)
+{
+	if (strlen(value) < size)
+	{
+		return 1;
+	}
+
+	ast_log(LOG_WARNING, "IVR %s '%s' is longer than %d characters.\n", name, value, (int)size - 1);
+	return 0;
+}
+
+static long long ivr_trace_span(uint64_t from, uint64_t to)
+{
+	return ((from != 0) && (to >= from)) ? (long long)(to - from) : -1;
+}
+
+//
+// Report a finished request: stage durations go to channel variables, for
+// the CDR, and sampled or slow requests to the trace file.  Durations of
+// stages not reached are -1.
+//
+static void ivr_trace_finish(struct ast_channel * chan, const char * request, const char * target, const ivr_trace_t * trace, int response, int variables)
+{
+	static const char * names[] = {"ENQUEUE", "QUEUE", "DISPATCH", "SERVER", "WAKEUP", "TOTAL"};
+	ivr_trace_log_t * log = &ivr_trace_log;
+	struct ast_json * json;
+	struct timeval now = ast_tvnow();
+	long long span[ARRAY_LEN(names)];
+	char name[32];
+	char value[32];
+	unsigned int i;
+
+	span[0] = ivr_trace_span(trace->entry, trace->enqueued);
+	span[1] = ivr_trace_span(trace->enqueued, trace->dequeued);
+	span[2] = ivr_trace_span(trace->dequeued, trace->written);
+	span[3] = ivr_trace_span(trace->written, trace->read);
+	span[4] = ivr_trace_span(trace->read, trace->woken);
+	span[5] = ivr_trace_span(trace->entry, ivr_clock_us());
+
+	if (variables)
+	{
+		for (i = 0; i != ARRAY_LEN(names); ++i)
+		{
+			snprintf(name, sizeof(name), "CRS_TRACE_%s", names[i]);
+			snprintf(value, sizeof(value), "%.3f", (span[i] >= 0) ? span[i] / 1000.0 : -1.0);
+			pbx_builtin_setvar_helper(chan, name, value);
+		}
+	}
+
+	if ((log->path[0] == 0) || !(((log->slow != 0) && (span[5] >= (long long)log->slow)) || ((log->sample != 0) && ((__sync_fetch_and_add(&log->count, 1) % log->sample) == 0))))
+	{
+		return;
+	}
+
+	json = ast_json_pack("{s: I, s: s, s: s, s: s, s: s, s: s, s: I, s: I, s: I, s: I, s: I, s: I}",
+		"time", (ast_json_int_t)((now.tv_sec * 1000LL) + (now.tv_usec / 1000)),
+		"channel", ast_channel_name(chan),
+		"uniqueid", ast_channel_uniqueid(chan),
+		"request", request,
+		"target", S_OR(target, ""),
+		"response", ivr_response_name(response),
+		"enqueue", (ast_json_int_t)span[0],
+		"queue", (ast_json_int_t)span[1],
+		"dispatch", (ast_json_int_t)span[2],
+		"server", (ast_json_int_t)span[3],
+		"wakeup", (ast_json_int_t)span[4],
+		"total", (ast_json_int_t)span[5]);
+
+	if (json != 0)
+	{
+		ivr_trace_write(log, json);
+		ast_json_unref(json);
+	}
+}
+
+//
+// Append one line to the trace file, rotating it once it reaches the size
+// limit: file becomes file.1, file.1 becomes file.2, and so on.
+//
+static void ivr_trace_write(ivr_trace_log_t * log, struct ast_json * json)
+{
+	char * line = ast_json_dump_string(json);
+	char from[PATH_MAX + 16];
+	char to[PATH_MAX + 16];
+	unsigned int i;
+	time_t now;
+
+	if (line == 0)
+	{
+		return;
+	}
+
+	ast_mutex_lock(&log->lock);
+
+	if ((log->file != 0) && (log->size != 0) && ((uint64_t)ftell(log->file) >= log->size))
+	{
+		fclose(log->file);
+		log->file = 0;
+
+		for (i = log->rotate; i > 0; --i)
+		{
+			if (i == 1)
+			{
+				ast_copy_string(from, log->path, sizeof(from));
+			}
+			else
+			{
+				snprintf(from, sizeof(from), "%s.%u", log->path, i - 1);
+			}
+
+			snprintf(to, sizeof(to), "%s.%u", log->path, i);
+			rename(from, to);
+		}
+
+		if (log->rotate == 0)
+		{
+			unlink(log->path);
+		}
+	}
+
+	if ((log->file == 0) && (log->path[0] != 0) && ((log->file = fopen(log->path, "a")) == 0))
+	{
+		ast_log(LOG_WARNING, "Unable to open IVR trace file %s (%s).\n", log->path, strerror(errno));
+		log->path[0] = 0;
+	}
+
+	if (log->file != 0)
+	{
+		fprintf(log->file, "%s\n", line);
+
+		// Lines are written out at least once a second.
+		if (time(&now) != log->flushed)
+		{
+			fflush(log->file);
+			log->flushed = now;
+		}
+	}
+
+	ast_mutex_unlock(&log->lock);
+
+	ast_json_free(line);
+}
+
+static void ivr_trace_close(ivr_trace_log_t * log)
+{
+	ast_mutex_lock(&log->lock);
+
+	if (log->file != 0)
+	{
+		fclose(log->file);
+		log->file = 0;
+	}
+
+	ast_mutex_unlock(&log->lock);
+}
+
+static const char * ivr_response_name(int response)
+{
+	switch(response)
+	{
+		case IVR_RESPONSE_SUCCESS:
+			return "OK";
+
+		case IVR_RESPONSE_SUCCESS_MESSAGEQUEUED:
+			return "QUEUED";
+
+		case IVR_RESPONSE_SUCCESS_MESSAGEDELIVERED:
+			return "DELIVERED";
+
+		case IVR_RESPONSE_SUCCESS_MESSAGEREAD:
+			return "READ";
+
+		case IVR_RESPONSE_FAIL_UNKNOWNREQUEST:
+			return "UNKNOWN_REQ";
+
+		case IVR_RESPONSE_FAIL_RECIPIENTNOTFOUND:
+			return "RECIPIENT_INVALID";
+
+		case IVR_RESPONSE_FAIL_RECIPIENTDISABLED:
+			return "RECIPIENT_DISABLED";
+
+		case IVR_RESPONSE_FAIL_SYSTEMNOTAVAILABLE:
+			return "SYSTEM_UNAVAIL";
+
+		case IVR_RESPONSE_FAIL_QUEUEFULL:
+			return "QUEUE_FULL";
+
+		case IVR_RESPONSE_FAIL_HANGUP:
+			return "HANGUP";
+
+		case IVR_RESPONSE_PARTIAL:
+			return "PARTIAL";
+
+		default:
+		case IVR_RESPONSE_FAIL_INTERNAL:
+			return "ERROR_INTERNAL";
+	}
+}
+
+static int ivr_setresponse(struct ast_channel * chan, int response)
+{
+	__sync_fetch_and_add(&ivr_stats.responses[response & 0x7f], 1);
+	pbx_builtin_setvar_helper(chan, "CRS_RESPONSE", ivr_response_name(response));
+	return 0;
+}
+
+//
+// CRS_SERVER_MESSAGE_ID<suffix> and CRS_QUEUE_POSITION<suffix>, empty when
+// the server did not report them.
+//
+static void ivr_setreceipt(struct ast_channel * chan, const ivr_receipt_t * receipt, const char * suffix)
+{
+	char name[40];
+	char position[16] = "";
+
+	if (receipt->position >= 0)
+	{
+		snprintf(position, sizeof(position), "%d", receipt->position);
+	}
+
+	snprintf(name, sizeof(name), "CRS_SERVER_MESSAGE_ID%s", suffix);
+	pbx_builtin_setvar_helper(chan, name, receipt->reference);
+	snprintf(name, sizeof(name), "CRS_QUEUE_POSITION%s", suffix);
+	pbx_builtin_setvar_helper(chan, name, position);
+}
+
+static const char * sendmsg_name =
+	FUNC_SENDMSG;
+
+static const char * sendmsg_synopsis =
+	"Send a text message to the server.";
+
+static const char sendmsg_description[] =
+	FUNC_SENDMSG "(<recipient>,<message>[,<caller>[,<options>]])\n"
+	"  Sends a message to the server, specifying the recipient, the\n"
+	"  message, and an optional caller.  On success CRS_MESSAGE_TAG is\n"
+	"  set to the tag " FUNC_QUERYMESSAGE " takes, and with a protocol 2\n"
+	"  server CRS_SERVER_MESSAGE_ID and CRS_QUEUE_POSITION to what it\n"
+	"  reported, if anything; when nothing is sent they are cleared.\n"
+	"  <recipient> may be a list, recipient&recipient&@group, groups\n"
+	"  coming from the [groups] section of crsivr.conf.  All are sent\n"
+	"  at once; CRS_RECIPIENT_COUNT is set, and CRS_RECIPIENT_<n>,\n"
+	"  CRS_RESPONSE_<n>, CRS_MESSAGE_TAG_<n>, CRS_SERVER_MESSAGE_ID_<n>\n"
+	"  and CRS_QUEUE_POSITION_<n> for n = 1 up.\n"
+	"  CRS_RESPONSE is OK (or QUEUED) when all succeed, PARTIAL when\n"
+	"  some do, otherwise the first recipient's failure.\n"
+	"  A <message> that is a code of the [messagesubstitution] section\n"
+	"  is sent as its text; see " FUNC_SUBSTITUTE "().\n"
+	"  CRS_TRACE_ENQUEUE, _QUEUE, _DISPATCH, _SERVER, _WAKEUP and _TOTAL\n"
+	"  give the ms the first recipient's request spent in each stage.\n"
+	"  Options:\n"
+	"    a - do not wait for the server: CRS_RESPONSE is QUEUED once the\n"
+	"        message is queued, and its response is sent as a manager\n"
+	"        event CRSMessageStatus (Tag, Response, and ServerMessageId\n"
+	"        and QueuePosition when reported), even after hangup.  With\n"
+	"        the outbox enabled the message is journalled first, and one\n"
+	"        the server cannot take is reported QUEUED and resent from it.\n";
+
+static int sendmsg_exec(struct ast_channel *chan, const char *data)
+{
+	char * parse;
+	char * recipients[IVR_RECIPIENTS_MAX];
+	char tags[IVR_RECIPIENTS_MAX][30];
+	int responses[IVR_RECIPIENTS_MAX];
+	char buffer[IVR_RECIPIENTS_MAX * 32];
+	char name[32];
+	ivr_trace_t traces[IVR_RECIPIENTS_MAX] = {{.entry = ivr_clock_us()}};
+	ivr_receipt_t receipts[IVR_RECIPIENTS_MAX];
+	int response;
+	int succeeded = 0;
+	int count = 1;
+	int async;
+	int i;
+
+	AST_DECLARE_APP_ARGS
+	(
+		args,
+		AST_APP_ARG(recipient);
+		AST_APP_ARG(message);
+		AST_APP_ARG(caller);
+		AST_APP_ARG(options);
+	);
+
+	if (ast_strlen_zero(data))
+	{
+		ast_log( LOG_WARNING, FUNC_SENDMSG " requires two to four arguments (<recipient>[&<recipient>...],<message>[,<caller>[,<options>]])\n");
+		return -1;
+	}
+
+	parse = ast_strdupa(data);
+
+	AST_STANDARD_APP_ARGS(args, parse);
+
+	if (args.argc < 2)
+	{
+		ast_log(LOG_WARNING, FUNC_SENDMSG " requires two to four arguments (<recipient>[&<recipient>...],<message>[,<caller>[,<options>]])\n");
+		return -1;
+	}
+
+	async = !ast_strlen_zero(args.options) && (strchr(args.options, 'a') != 0);
+
+	recipients[0] = args.recipient;
+
+	if ((args.recipient != 0) && (strpbrk(args.recipient, "&@") != 0))
+	{
+		if ((count = ivr_recipients(args.recipient, buffer, sizeof(buffer), recipients)) == 0)
+		{
+			ast_log(LOG_WARNING, FUNC_SENDMSG ": no recipients in '%s'\n", args.recipient);
+			return ivr_setresponse(chan, IVR_RESPONSE_FAIL_INTERNAL);
+		}
+	}
+
+	for (i = 1; i != count; ++i)
+	{
+		traces[i].entry = traces[0].entry;
+	}
+
+	ivr_sendmessage(chan, recipients, count, args.message, args.caller, async, 0, responses, tags, traces, receipts);
+
+	for (i = 0; i != count; ++i)
+	{
+		ivr_trace_finish(chan, "send", recipients[i], &traces[i], responses[i], i == 0);
+	}
+
+	response = IVR_RESPONSE_SUCCESS;
+
+	for (i = 0; i != count; ++i)
+	{
+		if ((responses[i] == IVR_RESPONSE_SUCCESS) || (responses[i] == IVR_RESPONSE_SUCCESS_MESSAGEQUEUED))
+		{
+			if (succeeded++ == 0)
+			{
+				pbx_builtin_setvar_helper(chan, "CRS_MESSAGE_TAG", tags[i]);
+				ivr_setreceipt(chan, &receipts[i], "");
+			}
+
+			if (responses[i] == IVR_RESPONSE_SUCCESS_MESSAGEQUEUED)
+			{
+				response = responses[i];
+			}
+		}
+
+		if (count == 1)
+		{
+			break;
+		}
+
+		snprintf(name, sizeof(name), "CRS_RECIPIENT_%d", i + 1);
+		pbx_builtin_setvar_helper(chan, name, recipients[i]);
+		snprintf(name, sizeof(name), "CRS_RESPONSE_%d", i + 1);
+		pbx_builtin_setvar_helper(chan, name, ivr_response_name(responses[i]));
+		snprintf(name, sizeof(name), "CRS_MESSAGE_TAG_%d", i + 1);
+		pbx_builtin_setvar_helper(chan, name, tags[i]);
+		snprintf(name, sizeof(name), "_%d", i + 1);
+		ivr_setreceipt(chan, &receipts[i], name);
+	}
+
+	if (count != 1)
+	{
+		snprintf(name, sizeof(name), "%d", count);
+		pbx_builtin_setvar_helper(chan, "CRS_RECIPIENT_COUNT", name);
+	}
+
+	// nothing was sent, so a tag from an earlier send must not be queried as this one's
+	if (succeeded == 0)
+	{
+		pbx_builtin_setvar_helper(chan, "CRS_MESSAGE_TAG", NULL);
+		pbx_builtin_setvar_helper(chan, "CRS_SERVER_MESSAGE_ID", NULL);
+		pbx_builtin_setvar_helper(chan, "CRS_QUEUE_POSITION", NULL);
+		response = responses[0];
+	}
+	else if (succeeded != count)
+	{
+		response = IVR_RESPONSE_PARTIAL;
+	}
+
+	return ivr_setresponse(chan, response);
+}
+
+static const char * verifyrecipient_name =
+	FUNC_VERIFYRECIPIENT;
+
+static const char * verifyrecipient_synopsis =
+	"Verify a recipient";
+
+static const char verifyrecipient_description[] =
+	FUNC_VERIFYRECIPIENT "(<recipient>)\n"
+	"  Verify a recipient with the server.  CRS_TRACE_* are set as for\n"
+	"  " FUNC_SENDMSG ".\n";
+
+static int verifyrecipient_exec(struct ast_channel *chan, const char *data)
+{
+	char * parse;
+	ivr_trace_t trace = {.entry = ivr_clock_us()};
+	int response;
+
+	AST_DECLARE_APP_ARGS
+	(
+		args,
+		AST_APP_ARG(recipient);
+	);
+
+	if (ast_strlen_zero(data))
+	{
+		ast_log(LOG_WARNING, FUNC_VERIFYRECIPIENT " requires one argument (<recipient>)\n");
+		return -1;
+	}
+
+	parse = ast_strdupa(data);
+
+	AST_STANDARD_APP_ARGS(args, parse);
+
+	if (args.argc != 1)
+	{
+		ast_log(LOG_WARNING, FUNC_VERIFYRECIPIENT " requires one argument (<recipient>)\n");
+		return -1;
+	}
+
+	response = ivr_verifyrecipient(chan, args.recipient, 0, &trace);
+	ivr_trace_finish(chan, "verify", args.recipient, &trace, response, 1);
+	return ivr_setresponse(chan, response);
+}
+
+static const char * querymessage_name =
+	FUNC_QUERYMESSAGE;
+
+static const char * querymessage_synopsis =
+	"Query the status of a sent message";
+
+static const char querymessage_description[] =
+	FUNC_QUERYMESSAGE "(<tag>)\n"
+	"  Asks the server for the status of the message " FUNC_SENDMSG "\n"
+	"  tagged <tag> (its CRS_MESSAGE_TAG).  CRS_RESPONSE is set to\n"
+	"  QUEUED, DELIVERED or READ, or to an error.  CRS_TRACE_* are set\n"
+	"  as for " FUNC_SENDMSG ".\n";
+
+static int querymessage_exec(struct ast_channel *chan, const char *data)
+{
+	char * parse;
+	ivr_trace_t trace = {.entry = ivr_clock_us()};
+	int response;
+
+	AST_DECLARE_APP_ARGS
+	(
+		args,
+		AST_APP_ARG(tag);
+	);
+
+	if (ast_strlen_zero(data))
+	{
+		ast_log(LOG_WARNING, FUNC_QUERYMESSAGE " requires one argument (<tag>)\n");
+		return -1;
+	}
+
+	parse = ast_strdupa(data);
+
+	AST_STANDARD_APP_ARGS(args, parse);
+
+	if ((args.argc != 1) || ast_strlen_zero(args.tag))
+	{
+		ast_log(LOG_WARNING, FUNC_QUERYMESSAGE " requires one argument (<tag>)\n");
+		return -1;
+	}
+
+	response = ivr_querymessage(chan, args.tag, &trace);
+	ivr_trace_finish(chan, "query", args.tag, &trace, response, 1);
+	return ivr_setresponse(chan, response);
+}
+
+//
+// CRS_SUBSTITUTE(<code>): the text SendMessage sends for <code>, for reading
+// a canned message back to the caller; <code> itself when it has none.
+//
+static int substitute_read(struct ast_channel *chan, const char *cmd, char *data, char *buf, size_t len)
+{
+	if (ast_strlen_zero(data))
+	{
+		ast_log(LOG_WARNING, FUNC_SUBSTITUTE " requires one argument (<code>)\n");
+		return -1;
+	}
+
+	if (!ivr_substitute(data, buf, len))
+	{
+		ast_copy_string(buf, data, len);
+	}
+
+	return 0;
+}
+
+static struct ast_custom_function substitute_function =
+{
+	.name = FUNC_SUBSTITUTE,
+	.read = substitute_read,
+};
+
+static void * ivr_playback_alloc(struct ast_channel *chan, void *params)
+{
+	return params;
+}
+
+static void ivr_playback_release(struct ast_channel *chan, void *data)
+{
+}
+
+//
+// Write the prompt's frames, already in the channel's write format, as the
+// channel asks for samples.  Returning -1 ends the generator.
+//
+static int ivr_playback_generate(struct ast_channel *chan, void *data, int len, int samples)
+{
+	ivr_playback_t * playback = (ivr_playback_t *)data;
+	struct ast_frame f;
+	int written = 0;
+
+	while (written < samples)
+	{
+		if (playback->position == playback->prompt->codec[playback->codec].count)
+		{
+			playback->done = 1;
+			return -1;
+		}
+
+		f = *playback->prompt->codec[playback->codec].frames[playback->position++];
+		f.mallocd = 0;
+		written += f.samples;
+
+		if (ast_write(chan, &f) < 0)
+		{
+			playback->done = 1;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static struct ast_generator ivr_playback_generator =
+{
+	.alloc = ivr_playback_alloc,
+	.release = ivr_playback_release,
+	.generate = ivr_playback_generate,
+};
+
+//
+// The codec of the bank to play prompt in on chan: its write format if the
+// prompt is held in it, otherwise any the channel takes natively.  -1 when
+// there is none.
+//
+static int ivr_prompt_codec(const ivr_prompts_t * bank, const ivr_prompt_t * prompt, struct ast_channel * chan)
+{
+	int codec = -1;
+	unsigned int c;
+
+	ast_channel_lock(chan);
+
+	for (c = 0; (codec < 0) && (c != bank->codec_count); ++c)
+	{
+		if ((prompt->codec[c].count != 0) && (ast_format_cmp(ast_channel_writeformat(chan), bank->codec[c]) == AST_FORMAT_CMP_EQUAL))
+		{
+			codec = c;
+		}
+	}
+
+	for (c = 0; (codec < 0) && (c != bank->codec_count); ++c)
+	{
+		if ((prompt->codec[c].count != 0) && (ast_format_cap_iscompatible_format(ast_channel_nativeformats(chan), bank->codec[c]) != AST_FORMAT_CMP_NOT_EQUAL))
+		{
+			codec = c;
+		}
+	}
+
+	ast_channel_unlock(chan);
+
+	return codec;
+}
+
+//
+// Play one prompt, from the bank when it holds it in a codec the channel
+// takes, otherwise from disk like Playback().  name is a prompt name or a
+// path into the bank's directory.  Returns the digit of digits that stopped
+// it, 0 at the end, -1 on hangup.
+//
+static int ivr_play_prompt(struct ast_channel * chan, const ivr_prompts_t * bank, const char * name, const char * digits)
+{
+	ivr_playback_t playback = {0};
+	const ivr_prompt_t * prompt = 0;
+	struct ast_format * format;
+	struct ast_frame * f;
+	char path[PATH_MAX];
+	const char * base = strrchr(name, '/');
+	int codec = -1;
+	int res = 0;
+
+	if (bank != 0)
+	{
+		if (base == 0)
+		{
+			prompt = ivr_prompt_find(bank, name);
+		}
+		else if (((size_t)(base - name) == strlen(bank->dir)) && !strncmp(name, bank->dir, base - name))
+		{
+			prompt = ivr_prompt_find(bank, base + 1);
+		}
+
+		if (prompt != 0)
+		{
+			codec = ivr_prompt_codec(bank, prompt, chan);
+		}
+	}
+
+	if ((base == 0) && (bank != 0))
+	{
+		snprintf(path, sizeof(path), "%s/%s", bank->dir, name);
+		name = path;
+	}
+
+	if (codec < 0)
+	{
+		return ast_stream_and_wait(chan, name, digits);
+	}
+
+	format = ao2_bump(ast_channel_writeformat(chan));
+
+	if (ast_set_write_format(chan, bank->codec[codec]) != 0)
+	{
+		ao2_cleanup(format);
+		ast_log(LOG_WARNING, "Unable to play prompt %s in %s on %s.\n", prompt->name, ast_format_get_name(bank->codec[codec]), ast_channel_name(chan));
+		return ast_stream_and_wait(chan, name, digits);
+	}
+
+	playback.prompt = prompt;
+	playback.codec = codec;
+
+	if (ast_activate_generator(chan, &ivr_playback_generator, &playback) != 0)
+	{
+		playback.done = 1;
+		res = -1;
+	}
+
+	while (!playback.done)
+	{
+		if (ast_waitfor(chan, 1000) < 0)
+		{
+			res = -1;
+			break;
+		}
+
+		f = ast_read(chan);
+
+		if (f == 0)
+		{
+			res = -1;
+			break;
+		}
+
+		if ((f->frametype == AST_FRAME_DTMF) && (digits != 0) && (strchr(digits, f->subclass.integer) != 0))
+		{
+			res = f->subclass.integer;
+			ast_frfree(f);
+			break;
+		}
+
+		ast_frfree(f);
+	}
+
+	ast_deactivate_generator(chan);
+	ast_set_write_format(chan, format);
+	ao2_cleanup(format);
+
+	return res;
+}
+
+//
+// Play prompts separated by &, stopping early at one of digits.
+//
+static int ivr_play(struct ast_channel * chan, const char * names, const char * digits)
+{
+	ivr_prompts_t * bank = ao2_global_obj_ref(ivr_prompts);
+	char * list = ast_strdupa(names);
+	char * name;
+	int res = 0;
+
+	while ((res == 0) && ((name = strsep(&list, "&")) != 0))
+	{
+		if (name[0] != 0)
+		{
+			res = ivr_play_prompt(chan, bank, name, digits);
+		}
+	}
+
+	ao2_cleanup(bank);
+
+	return res;
+}
+
+//
+// Play prompts and collect up to max digits, ending early at # or when no
+// digit comes within timeout ms.  A digit dialled during the prompts stops
+// them and counts, so callers can dial ahead.  From speculate digits on
+// (0 = never), each longer candidate is sent for verification while the
+// caller may still be dialling.  Returns the number of digits, -1 on hangup.
+//
+static int ivr_collect(struct ast_channel * chan, const char * prompts, char * digits, unsigned int max, unsigned int timeout, unsigned int speculate)
+{
+	unsigned int count = 0;
+	int res;
+
+	res = ivr_play(chan, prompts, AST_DIGIT_ANY);
+
+	if (res == 0)
+	{
+		res = ast_waitfordigit(chan, timeout);
+	}
+
+	while ((res > 0) && (res != '#'))
+	{
+		digits[count++] = res;
+
+		if (count == max)
+		{
+			break;
+		}
+
+		if ((speculate != 0) && (count >= speculate))
+		{
+			digits[count] = 0;
+			ivr_verify_speculate(chan, digits);
+		}
+
+		res = ast_waitfordigit(chan, timeout);
+	}
+
+	digits[count] = 0;
+
+	return (res < 0) ? -1 : (int)count;
+}
+
+static const char * overdial_name =
+	FUNC_OVERDIAL;
+
+static const char * overdial_synopsis =
+	"Run the overdial paging flow";
+
+static const char overdial_description[] =
+	FUNC_OVERDIAL "([<caller>][,<options>])\n"
+	"  Answers, collects a pager alias, verifies it, collects a numeric\n"
+	"  message and sends it, playing the prompts of the [overdial] section\n"
+	"  of crsivr.conf, as the overdial context of the sample dialplan does.\n"
+	"  <caller> defaults to the caller ID.  Sets CRS_RECIPIENT, CRS_MESSAGE,\n"
+	"  and CRS_RESPONSE and CRS_MESSAGE_TAG as " FUNC_SENDMSG " would, or\n"
+	"  CRS_RESPONSE of the verification when it failed.  Returns -1 on\n"
+	"  hangup, otherwise continues in the dialplan.\n"
+	"  Options:\n"
+	"    a - send the message as " FUNC_SENDMSG " option a does, playing\n"
+	"        message_sent as soon as it is queued.\n"
+	"    s - start verifying the alias as soon as alias_min_digits are\n"
+	"        dialled, and again at each further digit, so the answer is\n"
+	"        ready when the caller finishes.\n";
+
+static int overdial_exec(struct ast_channel *chan, const char *data)
+{
+	ivr_overdial_t * overdial;
+	ivr_trace_t trace = {.entry = 0};
+	ivr_trace_t traces[1] = {{.entry = 0}};
+	ivr_receipt_t receipts[1];
+	struct ast_party_caller * party;
+	char * recipients[1];
+	char tags[1][30];
+	int responses[1];
+	char alias[64];
+	char message[64];
+	char prompts[sizeof(overdial->prompt[0]) * 2];
+	char callerid[128];
+	const char * caller;
+	char * parse;
+	unsigned int speculate = 0;
+	int async = 0;
+	int prompt;
+	int response;
+	int res = 0;
+
+	AST_DECLARE_APP_ARGS
+	(
+		args,
+		AST_APP_ARG(caller);
+		AST_APP_ARG(options);
+	);
+
+	parse = ast_strdupa(S_OR(data, ""));
+
+	AST_STANDARD_APP_ARGS(args, parse);
+
+	caller = args.caller;
+
+	if (ast_strlen_zero(caller))
+	{
+		ast_channel_lock(chan);
+		party = ast_channel_caller(chan);
+		ast_callerid_merge(callerid, sizeof(callerid),
+			S_COR(party->id.name.valid, party->id.name.str, NULL),
+			S_COR(party->id.number.valid, party->id.number.str, NULL), "");
+		ast_channel_unlock(chan);
+		caller = callerid;
+	}
+
+	overdial = ao2_global_obj_ref(ivr_overdial);
+
+	if (overdial == 0)
+	{
+		ast_log(LOG_WARNING, FUNC_OVERDIAL ": no configuration loaded\n");
+		return -1;
+	}
+
+	if (!ast_strlen_zero(args.options) && (strchr(args.options, 's') != 0))
+	{
+		speculate = overdial->alias_min_digits;
+	}
+
+	if (!ast_strlen_zero(args.options) && (strchr(args.options, 'a') != 0))
+	{
+		async = 1;
+	}
+
+	if (ast_channel_state(chan) != AST_STATE_UP)
+	{
+		ast_answer(chan);
+	}
+
+	if (ast_safe_sleep(chan, 250) != 0)
+	{
+		ao2_ref(overdial, -1);
+		return -1;
+	}
+
+	snprintf(prompts, sizeof(prompts), "%s&%s", overdial->prompt[IVR_OVERDIAL_WELCOME], overdial->prompt[IVR_OVERDIAL_PAGER_NUMBER]);
+
+	if (ivr_collect(chan, prompts, alias, MIN(overdial->alias_digits, sizeof(alias) - 1), overdial->alias_timeout, speculate) < 0)
+	{
+		ao2_ref(overdial, -1);
+		return -1;
+	}
+
+	pbx_builtin_setvar_helper(chan, "CRS_RECIPIENT", alias);
+	pbx_builtin_setvar_helper(chan, "CRS_MESSAGE", "");
+
+	// no alias dialled: nothing to ask the server
+	if (alias[0] == 0)
+	{
+		response = IVR_RESPONSE_FAIL_RECIPIENTNOTFOUND;
+	}
+	else
+	{
+		trace.entry = ivr_clock_us();
+		response = ivr_verifyrecipient(chan, alias, 1, &trace);
+		ivr_trace_finish(chan, "verify", alias, &trace, response, 1);
+	}
+
+	switch (response)
+	{
+		case IVR_RESPONSE_SUCCESS:
+			prompt = -1;
+			break;
+
+		case IVR_RESPONSE_FAIL_RECIPIENTNOTFOUND:
+			prompt = IVR_OVERDIAL_PAGER_INVALID;
+			break;
+
+		case IVR_RESPONSE_FAIL_RECIPIENTDISABLED:
+			prompt = IVR_OVERDIAL_PAGER_UNAVAILABLE;
+			break;
+
+		case IVR_RESPONSE_FAIL_HANGUP:
+			ivr_setresponse(chan, response);
+			ao2_ref(overdial, -1);
+			return -1;
+
+		default:
+			prompt = IVR_OVERDIAL_SYSTEM_UNAVAILABLE;
+			break;
+	}
+
+	if (prompt < 0)
+	{
+		if (ivr_collect(chan, overdial->prompt[IVR_OVERDIAL_PAGER_MESSAGE], message, MIN(overdial->message_digits, sizeof(message) - 1), overdial->message_timeout, 0) < 0)
+		{
+			ao2_ref(overdial, -1);
+			return -1;
+		}
+
+		pbx_builtin_setvar_helper(chan, "CRS_MESSAGE", message);
+		prompt = IVR_OVERDIAL_MESSAGE_NOT_SENT;
+	}
+
+	if ((prompt == IVR_OVERDIAL_MESSAGE_NOT_SENT) && (message[0] != 0))
+	{
+		recipients[0] = alias;
+		traces[0].entry = ivr_clock_us();
+
+		ivr_sendmessage(chan, recipients, 1, message, caller, async, 1, responses, tags, traces, receipts);
+		ivr_trace_finish(chan, "send", alias, &traces[0], responses[0], 1);
+
+		response = responses[0];
+
+		if ((response == IVR_RESPONSE_SUCCESS) || (response == IVR_RESPONSE_SUCCESS_MESSAGEQUEUED))
+		{
+			pbx_builtin_setvar_helper(chan, "CRS_MESSAGE_TAG", tags[0]);
+			ivr_setreceipt(chan, &receipts[0], "");
+			prompt = IVR_OVERDIAL_MESSAGE_SENT;
+		}
+		else if (response == IVR_RESPONSE_FAIL_HANGUP)
+		{
+			ivr_setresponse(chan, response);
+			ao2_ref(overdial, -1);
+			return -1;
+		}
+		else
+		{
+			prompt = IVR_OVERDIAL_MESSAGE_FAILED;
+		}
+	}
+
+	ivr_setresponse(chan, response);
+
+	if ((ivr_play(chan, overdial->prompt[prompt], "") < 0) || (ast_safe_sleep(chan, 1000) != 0))
+	{
+		res = -1;
+	}
+
+	ao2_ref(overdial, -1);
+
+	return res;
+}
+
+static const char * playback_name =
+	FUNC_PLAYBACK;
+
+static const char * playback_synopsis =
+	"Play prompts held in memory";
+
+static const char playback_description[] =
+	FUNC_PLAYBACK "(<prompt>[&<prompt>...][,<digits>])\n"
+	"  Plays prompts of the [prompts] directory of crsivr.conf from memory,\n"
+	"  pre-encoded in the channel's codec.  <prompt> is a file name\n"
+	"  without the extension, or a path into that directory; other files\n"
+	"  are played from disk.  A digit of <digits> stops the playback and\n"
+	"  is stored in CRS_DIGIT.\n";
+
+static int playback_exec(struct ast_channel *chan, const char *data)
+{
+	char * parse;
+	char digit[2] = {0};
+	int res;
+
+	AST_DECLARE_APP_ARGS
+	(
+		args,
+		AST_APP_ARG(prompts);
+		AST_APP_ARG(digits);
+	);
+
+	if (ast_strlen_zero(data))
+	{
+		ast_log(LOG_WARNING, FUNC_PLAYBACK " requires an argument (<prompt>[&<prompt>...][,<digits>])\n");
+		return -1;
+	}
+
+	parse = ast_strdupa(data);
+
+	AST_STANDARD_APP_ARGS(args, parse);
+
+	if (ast_channel_state(chan) != AST_STATE_UP)
+	{
+		ast_answer(chan);
+	}
+
+	res = ivr_play(chan, args.prompts, S_OR(args.digits, ""));
+
+	if (res > 0)
+	{
+		digit[0] = (char)res;
+	}
+
+	pbx_builtin_setvar_helper(chan, "CRS_DIGIT", digit);
+
+	return (res < 0) ? -1 : 0;
+}
+
+static char * handle_cli_show_cache(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	ivr_cache_t * cache = &ivr_verify_cache;
+	ivr_cache_entry_t * entry;
+	uint64_t now;
+
+	switch (cmd)
+	{
+		case CLI_INIT:
+			e->command = "crsivr show cache";
+			e->usage =
+				"Usage: crsivr show cache\n"
+				"       Lists cached recipient verifications, most recently used first.\n";
+			return NULL;
+
+		case CLI_GENERATE:
+			return NULL;
+	}
+
+	if (a->argc != 3)
+	{
+		return CLI_SHOWUSAGE;
+	}
+
+	ast_mutex_lock(&cache->lock);
+
+	now = ivr_clock_ms();
+
+	ast_cli(a->fd, "%-40s %-20s %s\n", "Client,Recipient", "Result", "Expires");
+
+	if (cache->capacity != 0)
+	{
+		for (entry = cache->lru.lru_next; entry != &cache->lru; entry = entry->lru_next)
+		{
+			ast_cli(a->fd, "%-40s %-20s %llds\n", entry->key, ivr_response_name(entry->value),
+				(entry->expires > now) ? (long long)((entry->expires - now + 999) / 1000) : 0LL);
+		}
+	}
+
+	ast_cli(a->fd, "%u of %u entries, %llu hits, %llu misses, TTL %us OK / %us failed\n",
+		cache->count, cache->capacity, (unsigned long long)cache->hits, (unsigned long long)cache->misses,
+		cache->ttl[1] / 1000, cache->ttl[0] / 1000);
+
+	ast_mutex_unlock(&cache->lock);
+
+	return CLI_SUCCESS;
+}
+
+static char * handle_cli_show_prompts(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	ivr_prompts_t * bank;
+	ivr_prompt_t * prompt;
+	char codecs[128];
+	size_t bytes = 0;
+	unsigned int i;
+	unsigned int c;
+
+	switch (cmd)
+	{
+		case CLI_INIT:
+			e->command = "crsivr show prompts";
+			e->usage =
+				"Usage: crsivr show prompts\n"
+				"       Lists the prompts held in memory and the codecs each is encoded in.\n";
+			return NULL;
+
+		case CLI_GENERATE:
+			return NULL;
+	}
+
+	if (a->argc != 3)
+	{
+		return CLI_SHOWUSAGE;
+	}
+
+	bank = ao2_global_obj_ref(ivr_prompts);
+
+	if (bank == 0)
+	{
+		ast_cli(a->fd, "No prompts in memory.\n");
+		return CLI_SUCCESS;
+	}
+
+	ast_cli(a->fd, "%-40s %8s %s\n", "Prompt", "ms", "Codecs");
+
+	for (i = 0; i != bank->count; ++i)
+	{
+		prompt = bank->prompt[i];
+		codecs[0] = 0;
+
+		for (c = 0; c != bank->codec_count; ++c)
+		{
+			if (prompt->codec[c].count != 0)
+			{
+				snprintf(codecs + strlen(codecs), sizeof(codecs) - strlen(codecs), "%s%s", (codecs[0] != 0) ? "," : "", ast_format_get_name(bank->codec[c]));
+				bytes += prompt->codec[c].bytes;
+			}
+		}
+
+		ast_cli(a->fd, "%-40s %8u %s\n", prompt->name, prompt->ms, codecs);
+	}
+
+	ast_cli(a->fd, "%u prompts from %s, %zu KB\n", bank->count, bank->dir, bytes / 1024);
+
+	ao2_ref(bank, -1);
+
+	return CLI_SUCCESS;
+}
+
+static char * handle_cli_flush_cache(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	char key[64];
+	int count;
+
+	switch (cmd)
+	{
+		case CLI_INIT:
+			e->command = "crsivr flush cache";
+			e->usage =
+				"Usage: crsivr flush cache [<recipient>]\n"
+				"       Drops one recipient, or every recipient, from the verification cache.\n";
+			return NULL;
+
+		case CLI_GENERATE:
+			return NULL;
+	}
+
+	if (a->argc == 3)
+	{
+		count = ivr_cache_flush(&ivr_verify_cache, 0);
+	}
+	else if (a->argc == 4)
+	{
+		snprintf(key, sizeof(key), "%s,%s", ivr_context.client_id, a->argv[3]);
+		count = ivr_cache_flush(&ivr_verify_cache, key);
+	}
+	else
+	{
+		return CLI_SHOWUSAGE;
+	}
+
+	ast_cli(a->fd, "Flushed %d cache entries.\n", count);
+
+	return CLI_SUCCESS;
+}
+
+static char * handle_cli_show_servers(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	ivr_context_t * ivr = &ivr_context;
+	ivr_shard_t * shard;
+	ivr_server_t * server;
+	char text[50];
+	unsigned int i;
+	unsigned int j;
+
+	switch (cmd)
+	{
+		case CLI_INIT:
+			e->command = "crsivr show servers";
+			e->usage =
+				"Usage: crsivr show servers\n"
+				"       Lists each worker's server connections with their protocol,\n"
+				"       response time and last heartbeat round trip.\n";
+			return NULL;
+
+		case CLI_GENERATE:
+			return NULL;
+	}
+
+	if (a->argc != 3)
+	{
+		return CLI_SHOWUSAGE;
+	}
+
+	ast_cli(a->fd, "%-6s %-22s %-6s %-10s %-8s %-9s %-10s %s\n", "Worker", "Server", "Weight", "State", "Protocol", "In flight", "Response", "Ping");
+
+	for (i = 0; i != ivr->shard_count; ++i)
+	{
+		shard = &ivr->shard[i];
+
+		for (j = 0; j != shard->server_count; ++j)
+		{
+			server = &shard->server[j];
+
+			if (0 == inet_ntop(AF_INET, &(server->address.sin_addr), text, sizeof(text)))
+			{
+				ast_copy_string(text, "?", sizeof(text));
+			}
+
+			ast_cli(a->fd, "%-6u %15s:%-6u %-6u %-10s %-8s %-9u %-10llu %llu\n", i, text, ntohs(server->address.sin_port), server->weight,
+				(server->sock_fd.fd >= 0) ? "up" : (server->connect_fd >= 0) ? "connecting" : "down",
+				(server->sock_fd.fd < 0) ? "-" : (server->protocol == IVR_PROTOCOL_HELLO) ? "offered" : (server->protocol == IVR_PROTOCOL_BINARY) ? "2" : "text",
+				server->pending_tail - server->pending_head,
+				(unsigned long long)(server->latency >> 4),
+				(unsigned long long)server->ping_rtt);
+		}
+	}
+
+	return CLI_SUCCESS;
+}
+
+static const char * ivr_stats_names[IVR_STATS] = {"verify", "send", "query", "ping", "connect"};
+
+//
+// Requests waiting in the worker queues, and written to a server but not
+// yet answered.
+//
+static void ivr_stats_depth(ivr_context_t * ivr, unsigned int * queued, unsigned int * in_flight)
+{
+	ivr_shard_t * shard;
+	unsigned int i;
+	unsigned int j;
+
+	*queued = 0;
+	*in_flight = 0;
+
+	for (i = 0; i != ivr->shard_count; ++i)
+	{
+		shard = &ivr->shard[i];
+		*queued += shard->ring_tail - shard->ring_head;
+
+		for (j = 0; j != shard->server_count; ++j)
+		{
+			*in_flight += shard->server[j].pending_tail - shard->server[j].pending_head;
+		}
+	}
+}
+
+static void ivr_cli_histogram(int fd, const char * name, const char * source, const ivr_histogram_t * histogram)
+{
+	uint64_t count = histogram->count;
+
+	if (count == 0)
+	{
+		return;
+	}
+
+	ast_cli(fd, "%-8s %-7s %10llu %9.1f %9.1f %9.1f %9.1f %9.1f\n", name, source, (unsigned long long)count,
+		(histogram->sum / (double)count) / 1000.0,
+		ivr_histogram_percentile(histogram, 500) / 1000.0,
+		ivr_histogram_percentile(histogram, 950) / 1000.0,
+		ivr_histogram_percentile(histogram, 990) / 1000.0,
+		histogram->max / 1000.0);
+}
+
+static char * handle_cli_show_stats(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	ivr_context_t * ivr = &ivr_context;
+	unsigned int queued;
+	unsigned int in_flight;
+	unsigned int i;
+
+	switch (cmd)
+	{
+		case CLI_INIT:
+			e->command = "crsivr show stats";
+			e->usage =
+				"Usage: crsivr show stats\n"
+				"       Shows request latency, in ms, and counters since the last reset.\n"
+				"       'caller' is the time the dialplan waited, queueing included;\n"
+				"       'server' is the time from writing a request to its response.\n";
+			return NULL;
+
+		case CLI_GENERATE:
+			return NULL;
+	}
+
+	if (a->argc != 3)
+	{
+		return CLI_SHOWUSAGE;
+	}
+
+	ivr_stats_depth(ivr, &queued, &in_flight);
+
+	ast_cli(a->fd, "%-8s %-7s %10s %9s %9s %9s %9s %9s\n", "Request", "Source", "Count", "Mean", "p50", "p95", "p99", "Max");
+
+	for (i = 0; i != IVR_STATS; ++i)
+	{
+		ivr_cli_histogram(a->fd, ivr_stats_names[i], "caller", &ivr_stats.caller[i]);
+		ivr_cli_histogram(a->fd, ivr_stats_names[i], "server", &ivr_stats.server[i]);
+	}
+
+	ast_cli(a->fd, "\nQueued: %u  In flight: %u  Channels: %u\n", queued, in_flight, ivr->channel_count);
+	ast_cli(a->fd, "Queue full: %llu  Channels exhausted: %llu  Server timeouts: %llu  Caller timeouts: %llu  Expired: %llu  Cancelled: %llu\n",
+		(unsigned long long)ivr_stats.queue_full, (unsigned long long)ivr_stats.exhausted,
+		(unsigned long long)ivr_stats.server_timeouts, (unsigned long long)ivr_stats.caller_timeouts,
+		(unsigned long long)ivr_stats.expired, (unsigned long long)ivr_stats.cancelled);
+	ast_cli(a->fd, "Connects: %llu  Connect failures: %llu  Disconnects: %llu\n",
+		(unsigned long long)ivr_stats.connects, (unsigned long long)ivr_stats.connect_failures,
+		(unsigned long long)ivr_stats.disconnects);
+	ast_cli(a->fd, "Speculative verifies: %llu  Used: %llu\n",
+		(unsigned long long)ivr_stats.speculative, (unsigned long long)ivr_stats.speculative_used);
+	ast_cli(a->fd, "Responses:");
+
+	for (i = 0; i != ARRAY_LEN(ivr_stats.responses); ++i)
+	{
+		if (ivr_stats.responses[i] != 0)
+		{
+			ast_cli(a->fd, " %s %llu", ivr_response_name(i), (unsigned long long)ivr_stats.responses[i]);
+		}
+	}
+
+	ast_cli(a->fd, "\nCounting for %lld seconds.\n", (long long)(time(0) - ivr_stats.reset));
+
+	return CLI_SUCCESS;
+}
+
+static char * handle_cli_reset_stats(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	switch (cmd)
+	{
+		case CLI_INIT:
+			e->command = "crsivr reset stats";
+			e->usage =
+				"Usage: crsivr reset stats\n"
+				"       Zeroes the request latency histograms and counters.\n";
+			return NULL;
+
+		case CLI_GENERATE:
+			return NULL;
+	}
+
+	if (a->argc != 3)
+	{
+		return CLI_SHOWUSAGE;
+	}
+
+	ivr_stats_reset(&ivr_stats);
+
+	ast_cli(a->fd, "CRS IVR statistics reset.\n");
+
+	return CLI_SUCCESS;
+}
+
+static struct ast_cli_entry ivr_cli[] =
+{
+	AST_CLI_DEFINE(handle_cli_show_servers, "Show the CRS IVR server connections"),
+	AST_CLI_DEFINE(handle_cli_show_stats, "Show the CRS IVR request statistics"),
+	AST_CLI_DEFINE(handle_cli_reset_stats, "Reset the CRS IVR request statistics"),
+	AST_CLI_DEFINE(handle_cli_show_cache, "Show the CRS recipient verification cache"),
+	AST_CLI_DEFINE(handle_cli_flush_cache, "Flush the CRS recipient verification cache"),
+	AST_CLI_DEFINE(handle_cli_show_prompts, "Show the CRS prompts held in memory"),
+};
+
+static const char * manager_stats_name =
+	"CRSIVRStats";
+
+static const char * manager_stats_synopsis =
+	"Show CRS IVR request statistics.";
+
+//
+// Keys are <Request><Source><Value>, e.g. SendCallerP95; latencies in ms.
+// Reset: yes zeroes the statistics after they are reported.
+//
+static int manager_stats(struct mansession *s, const struct message *m)
+{
+	ivr_context_t * ivr = &ivr_context;
+	const char * reset = astman_get_header(m, "Reset");
+	const ivr_histogram_t * histogram;
+	char name[32];
+	unsigned int queued;
+	unsigned int in_flight;
+	unsigned int i;
+	unsigned int j;
+
+	ivr_stats_depth(ivr, &queued, &in_flight);
+
+	astman_start_ack(s, m);
+
+	for (i = 0; i != IVR_STATS; ++i)
+	{
+		// Heartbeats and connects are made by the workers alone.
+		for (j = (i < IVR_STAT_PING) ? 0 : 1; j != 2; ++j)
+		{
+			histogram = (j == 0) ? &ivr_stats.caller[i] : &ivr_stats.server[i];
+
+			snprintf(name, sizeof(name), "%c%s%s", toupper(ivr_stats_names[i][0]), &ivr_stats_names[i][1], (j == 0) ? "Caller" : "Server");
+
+			astman_append(s,
+				"%sCount: %llu\r\n"
+				"%sMean: %.1f\r\n"
+				"%sP50: %.1f\r\n"
+				"%sP95: %.1f\r\n"
+				"%sP99: %.1f\r\n"
+				"%sMax: %.1f\r\n",
+				name, (unsigned long long)histogram->count,
+				name, (histogram->count != 0) ? (histogram->sum / (double)histogram->count) / 1000.0 : 0.0,
+				name, ivr_histogram_percentile(histogram, 500) / 1000.0,
+				name, ivr_histogram_percentile(histogram, 950) / 1000.0,
+				name, ivr_histogram_percentile(histogram, 990) / 1000.0,
+				name, histogram->max / 1000.0);
+		}
+	}
+
+	astman_append(s,
+		"Queued: %u\r\n"
+		"InFlight: %u\r\n"
+		"Channels: %u\r\n"
+		"QueueFull: %llu\r\n"
+		"ChannelsExhausted: %llu\r\n"
+		"ServerTimeouts: %llu\r\n"
+		"CallerTimeouts: %llu\r\n"
+		"Expired: %llu\r\n"
+		"Cancelled: %llu\r\n"
+		"Connects: %llu\r\n"
+		"ConnectFailures: %llu\r\n"
+		"Disconnects: %llu\r\n"
+		"Speculative: %llu\r\n"
+		"SpeculativeUsed: %llu\r\n"
+		"Seconds: %lld\r\n",
+		queued, in_flight, ivr->channel_count,
+		(unsigned long long)ivr_stats.queue_full, (unsigned long long)ivr_stats.exhausted,
+		(unsigned long long)ivr_stats.server_timeouts, (unsigned long long)ivr_stats.caller_timeouts,
+		(unsigned long long)ivr_stats.expired, (unsigned long long)ivr_stats.cancelled,
+		(unsigned long long)ivr_stats.connects, (unsigned long long)ivr_stats.connect_failures,
+		(unsigned long long)ivr_stats.disconnects,
+		(unsigned long long)ivr_stats.speculative, (unsigned long long)ivr_stats.speculative_used,
+		(long long)(time(0) - ivr_stats.reset));
+
+	for (i = 0; i != ARRAY_LEN(ivr_stats.responses); ++i)
+	{
+		if (ivr_stats.responses[i] != 0)
+		{
+			astman_append(s, "Response-%s: %llu\r\n", ivr_response_name(i), (unsigned long long)ivr_stats.responses[i]);
+		}
+	}
+
+	astman_append(s, "\r\n");
+
+	if (ast_true(reset))
+	{
+		ivr_stats_reset(&ivr_stats);
+	}
+
+	return 0;
+}
+
+static int load_address(struct sockaddr_in * address, const char *ip, uint16_t port)
+{
+	address->sin_family = AF_INET;
+	address->sin_port = htons(port);
+
+	if ((ip == 0) || (ip[0] == 0))
+	{
+		return 0;
+	}
+
+  	if (inet_pton(AF_INET, ip, &address->sin_addr) <= 0)
+	{
+		return 0;
+	}
+	else
+	{
+		return 1;
+	}
+}
+
+//
+// Add a server to the pool: ip[:port][,weight]
+//
+static int load_server(ivr_config_t * config, const char * spec, uint16_t port, unsigned int weight)
+{
+	char * text = ast_strdupa(spec);
+	char * ip = strsep(&text, ",");
+	char * sep;
+
+	if (config->server_count == IVR_SERVERS_MAX)
+	{
+		ast_log(LOG_WARNING, "Config file " IVR_CONFIG " lists more than %d servers, ignoring %s.\n", IVR_SERVERS_MAX, spec);
+		return 0;
+	}
+
+	if (text != 0)
+	{
+		weight = strtoul(text, 0, 0);
+	}
+
+	sep = strchr(ip, ':');
+
+	if (sep != 0)
+	{
+		*sep++ = 0;
+		port = (uint16_t)strtoul(sep, 0, 0);
+	}
+
+	if (!load_address(&config->address[config->server_count], ast_strip(ip), port))
+	{
+		ast_log(LOG_WARNING, "Config file " IVR_CONFIG " contains invalid server address %s.\n", spec);
+		return 0;
+	}
+
+	config->weight[config->server_count] = weight;
+	++config->server_count;
+
+	return 1;
+}
+
+//
+// Replace the recipient groups with the [groups] section; a SendMessage in
+// progress keeps the set it started with.
+//
+static void load_groups(struct ast_config * cfg)
+{
+	ivr_groups_t * groups;
+	struct ast_variable * v;
+	unsigned int count = 0;
+
+	for (v = ast_variable_browse(cfg, "groups"); v; v = v->next)
+	{
+		++count;
+	}
+
+	groups = ao2_alloc_options(sizeof(*groups) + (count * sizeof(groups->group[0])), 0, AO2_ALLOC_OPT_LOCK_NOLOCK);
+
+	if (groups == 0)
+	{
+		ast_log(LOG_WARNING, "Unable to allocate %u recipient groups.\n", count);
+		return;
+	}
+
+	groups->count = 0;
+
+	for (v = ast_variable_browse(cfg, "groups"); v; v = v->next)
+	{
+		ast_copy_string(groups->group[groups->count].name, v->name, sizeof(groups->group[0].name));
+		ast_copy_string(groups->group[groups->count].members, v->value, sizeof(groups->group[0].members));
+		++groups->count;
+	}
+
+	ao2_global_obj_replace_unref(ivr_groups, groups);
+	ao2_ref(groups, -1);
+}
+
+//
+// Build a new code table from [messagesubstitution] and swap it in; a
+// SendMessage in progress keeps the table it started with.
+//
+static void load_substitutions(struct ast_config * cfg)
+{
+	ivr_substitutions_t * table;
+	struct ast_variable * v;
+	unsigned int count = 0;
+	unsigned int slots = 8;
+	unsigned int i;
+
+	for (v = ast_variable_browse(cfg, "messagesubstitution"); v; v = v->next)
+	{
+		++count;
+	}
+
+	while (slots < (count * 2))
+	{
+		slots <<= 1;
+	}
+
+	table = ao2_alloc_options(sizeof(*table) + (slots * sizeof(table->slot[0])), 0, AO2_ALLOC_OPT_LOCK_NOLOCK);
+
+	if (table == 0)
+	{
+		ast_log(LOG_WARNING, "Unable to allocate %u message substitutions.\n", count);
+		return;
+	}
+
+	memset(table->slot, 0, slots * sizeof(table->slot[0]));
+	table->mask = slots - 1;
+
+	for (v = ast_variable_browse(cfg, "messagesubstitution"); v; v = v->next)
+	{
+		if ((v->name[0] == 0) || (strlen(v->name) >= sizeof(table->slot[0].code)))
+		{
+			ast_log(LOG_WARNING, "Message substitution code '%s' is not usable, ignored.\n", v->name);
+			continue;
+		}
+
+		if (strlen(v->value) >= sizeof(table->slot[0].text))
+		{
+			ast_log(LOG_WARNING, "Message substitution %s is longer than %d characters, truncated.\n", v->name, IVR_MESSAGE_MAX - 1);
+		}
+
+		for (i = ast_str_hash(v->name) & table->mask; (table->slot[i].code[0] != 0) && strcmp(table->slot[i].code, v->name); i = (i + 1) & table->mask)
+		{
+		}
+
+		ast_copy_string(table->slot[i].code, v->name, sizeof(table->slot[i].code));
+		ast_copy_string(table->slot[i].text, v->value, sizeof(table->slot[i].text));
+	}
+
+	ao2_global_obj_replace_unref(ivr_substitutions, table);
+	ao2_ref(table, -1);
+}
+
+static void ivr_prompt_destroy(void * obj)
+{
+	ivr_prompt_t * prompt = (ivr_prompt_t *)obj;
+	unsigned int c;
+	unsigned int i;
+
+	for (c = 0; c != IVR_PROMPT_CODECS_MAX; ++c)
+	{
+		for (i = 0; i != prompt->codec[c].count; ++i)
+		{
+			ast_frfree(prompt->codec[c].frames[i]);
+		}
+
+		ast_free(prompt->codec[c].frames);
+	}
+}
+
+static void ivr_prompts_destroy(void * obj)
+{
+	ivr_prompts_t * bank = (ivr_prompts_t *)obj;
+	unsigned int i;
+
+	for (i = 0; i != bank->count; ++i)
+	{
+		ao2_cleanup(bank->prompt[i]);
+	}
+
+	for (i = 0; i != bank->codec_count; ++i)
+	{
+		ao2_cleanup(bank->codec[i]);
+	}
+}
+
+static ivr_prompt_t * ivr_prompt_find(const ivr_prompts_t * bank, const char * name)
+{
+	unsigned int i;
+
+	for (i = 0; i != bank->count; ++i)
+	{
+		if (!strcmp(bank->prompt[i]->name, name))
+		{
+			return bank->prompt[i];
+		}
+	}
+
+	return 0;
+}
+
+static int ivr_prompt_append(ivr_prompt_t * prompt, unsigned int codec, struct ast_frame * f)
+{
+	struct ast_frame ** frames = prompt->codec[codec].frames;
+	unsigned int count = prompt->codec[codec].count;
+
+	// grow by doubling
+	if ((count & (count - 1)) == 0)
+	{
+		frames = ast_realloc(frames, ((count != 0) ? (count * 2) : 1) * sizeof(*frames));
+
+		if (frames == 0)
+		{
+			return 0;
+		}
+
+		prompt->codec[codec].frames = frames;
+	}
+
+	if ((frames[count] = ast_frdup(f)) == 0)
+	{
+		return 0;
+	}
+
+	prompt->codec[codec].bytes += f->datalen;
+	++prompt->codec[codec].count;
+
+	return 1;
+}
+
+//
+// Read a prompt file and encode it in each codec of the bank.  A codec with
+// no translation path is left empty; the prompt is then played in another.
+//
+static ivr_prompt_t * ivr_prompt_load(const ivr_prompts_t * bank, const char * name, const char * ext, const struct stat * st)
+{
+	char path[PATH_MAX];
+	struct ast_trans_pvt * translators[IVR_PROMPT_CODECS_MAX] = {0};
+	int failed[IVR_PROMPT_CODECS_MAX] = {0};
+	struct ast_filestream * fs;
+	struct ast_frame * f;
+	struct ast_frame * out;
+	struct ast_frame * next;
+	ivr_prompt_t * prompt;
+	uint64_t samples = 0;
+	unsigned int rate = 8000;
+	unsigned int c;
+	int ok = 1;
+
+	snprintf(path, sizeof(path), "%s/%s", bank->dir, name);
+
+	fs = ast_readfile(path, ext, 0, O_RDONLY, 0, 0);
+
+	if (fs == 0)
+	{
+		ast_log(LOG_WARNING, "Unable to read prompt %s.%s.\n", path, ext);
+		return 0;
+	}
+
+	prompt = ao2_alloc_options(sizeof(*prompt), ivr_prompt_destroy, AO2_ALLOC_OPT_LOCK_NOLOCK);
+
+	if (prompt == 0)
+	{
+		ast_closestream(fs);
+		return 0;
+	}
+
+	memset(prompt, 0, sizeof(*prompt));
+	ast_copy_string(prompt->name, name, sizeof(prompt->name));
+	prompt->mtime = st->st_mtime;
+	prompt->size = st->st_size;
+
+	while (ok && ((f = ast_readframe(fs)) != 0))
+	{
+		if (f->frametype != AST_FRAME_VOICE)
+		{
+			continue;
+		}
+
+		samples += f->samples;
+		rate = ast_format_get_sample_rate(f->subclass.format);
+
+		for (c = 0; ok && (c != bank->codec_count); ++c)
+		{
+			if (ast_format_cmp(f->subclass.format, bank->codec[c]) == AST_FORMAT_CMP_EQUAL)
+			{
+				ok = ivr_prompt_append(prompt, c, f);
+				continue;
+			}
+
+			if ((translators[c] == 0) && !failed[c])
+			{
+				translators[c] = ast_translator_build_path(bank->codec[c], f->subclass.format);
+
+				if (translators[c] == 0)
+				{
+					ast_log(LOG_WARNING, "No translation from %s to %s for prompt %s.\n",
+						ast_format_get_name(f->subclass.format), ast_format_get_name(bank->codec[c]), name);
+					failed[c] = 1;
+				}
+			}
+
+			if (translators[c] == 0)
+			{
+				continue;
+			}
+
+			out = ast_translate(translators[c], f, 0);
+
+			for (next = out; ok && (next != 0); next = AST_LIST_NEXT(next, frame_list))
+			{
+				ok = ivr_prompt_append(prompt, c, next);
+			}
+
+			if (out != 0)
+			{
+				ast_frfree(out);
+			}
+		}
+	}
+
+	ast_closestream(fs);
+
+	for (c = 0; c != bank->codec_count; ++c)
+	{
+		if (translators[c] != 0)
+		{
+			ast_translator_free_path(translators[c]);
+		}
+	}
+
+	if (!ok)
+	{
+		ast_log(LOG_WARNING, "Unable to hold prompt %s in memory.\n", path);
+		ao2_ref(prompt, -1);
+		return 0;
+	}
+
+	prompt->ms = (unsigned int)((samples * 1000) / ((rate != 0) ? rate : 8000));
+
+	return prompt;
+}
+
+//
+// Load every sound file of the [prompts] directory into a new bank and swap
+// it in.  A playback in progress keeps the bank it started with.
+//
+static void load_prompts(struct ast_config * cfg)
+{
+	ivr_prompts_t * old = ao2_global_obj_ref(ivr_prompts);
+	ivr_prompts_t * bank;
+	ivr_prompt_t * prompt;
+	struct ast_format * format;
+	struct dirent * entry;
+	struct stat st;
+	DIR * dir;
+	const char * val;
+	char path[PATH_MAX];
+	char name[64];
+	char * codecs;
+	char * codec;
+	char * ext;
+	unsigned int count = 0;
+	unsigned int reused = 0;
+	int same;
+	unsigned int i;
+
+	val = ast_variable_retrieve(cfg, "prompts", "dir");
+
+	if ((val != 0) && (val[0] != 0))
+	{
+		ast_copy_string(path, val, sizeof(path));
+	}
+	else
+	{
+		snprintf(path, sizeof(path), "%s/%s", ast_config_AST_DATA_DIR, IVR_PROMPT_DIR);
+	}
+
+	dir = opendir(path);
+
+	if (dir == 0)
+	{
+		ast_log(LOG_WARNING, "Unable to open prompt directory %s (%s); prompts are played from disk.\n", path, strerror(errno));
+		ao2_global_obj_release(ivr_prompts);
+		ao2_cleanup(old);
+		return;
+	}
+
+	while ((entry = readdir(dir)) != 0)
+	{
+		++count;
+	}
+
+	rewinddir(dir);
+
+	bank = ao2_alloc_options(sizeof(*bank) + (count * sizeof(bank->prompt[0])), ivr_prompts_destroy, AO2_ALLOC_OPT_LOCK_NOLOCK);
+
+	if (bank == 0)
+	{
+		closedir(dir);
+		ao2_cleanup(old);
+		return;
+	}
+
+	memset(bank, 0, sizeof(*bank));
+	ast_copy_string(bank->dir, path, sizeof(bank->dir));
+
+	val = ast_variable_retrieve(cfg, "prompts", "codecs");
+	codecs = ast_strdupa(((val != 0) && (val[0] != 0)) ? val : IVR_PROMPT_CODECS);
+
+	while (((codec = strsep(&codecs, ",")) != 0) && (bank->codec_count != IVR_PROMPT_CODECS_MAX))
+	{
+		codec = ast_strip(codec);
+
+		if ((format = ast_format_cache_get(codec)) == 0)
+		{
+			ast_log(LOG_WARNING, "Unknown prompt codec '%s', ignored.\n", codec);
+			continue;
+		}
+
+		bank->codec[bank->codec_count++] = format;
+	}
+
+	// prompts of the previous bank can be kept only if encoded the same way
+	same = (old != 0) && !strcmp(old->dir, bank->dir) && (old->codec_count == bank->codec_count);
+
+	for (i = 0; same && (i != bank->codec_count); ++i)
+	{
+		same = (ast_format_cmp(old->codec[i], bank->codec[i]) == AST_FORMAT_CMP_EQUAL);
+	}
+
+	while (((entry = readdir(dir)) != 0) && (bank->count != count))
+	{
+		ext = strrchr(entry->d_name, '.');
+
+		if ((entry->d_name[0] == '.') || (ext == 0) || ((size_t)(ext - entry->d_name) >= sizeof(name)))
+		{
+			continue;
+		}
+
+		if (ast_get_format_for_file_ext(ext + 1) == 0)
+		{
+			continue;
+		}
+
+		snprintf(path, sizeof(path), "%s/%s", bank->dir, entry->d_name);
+
+		if ((stat(path, &st) != 0) || !S_ISREG(st.st_mode))
+		{
+			continue;
+		}
+
+		ast_copy_string(name, entry->d_name, (ext - entry->d_name) + 1);
+
+		// the first of several files of one name wins, as it would for Playback()
+		if (ivr_prompt_find(bank, name) != 0)
+		{
+			continue;
+		}
+
+		prompt = same ? ivr_prompt_find(old, name) : 0;
+
+		if ((prompt != 0) && (prompt->mtime == st.st_mtime) && (prompt->size == st.st_size))
+		{
+			ao2_ref(prompt, +1);
+			++reused;
+		}
+		else
+		{
+			prompt = ivr_prompt_load(bank, name, ext + 1, &st);
+		}
+
+		if (prompt != 0)
+		{
+			bank->prompt[bank->count++] = prompt;
+		}
+	}
+
+	closedir(dir);
+
+	ast_log(LOG_NOTICE, "Loaded %u prompts from %s (%u unchanged) in %u codecs.\n", bank->count, bank->dir, reused, bank->codec_count);
+
+	ao2_global_obj_replace_unref(ivr_prompts, bank);
+	ao2_ref(bank, -1);
+	ao2_cleanup(old);
+}
+
+static void load_overdial(struct ast_config * cfg)
+{
+	ivr_overdial_t * overdial;
+	const char * val;
+	unsigned int i;
+
+	overdial = ao2_alloc_options(sizeof(*overdial), 0, AO2_ALLOC_OPT_LOCK_NOLOCK);
+
+	if (overdial == 0)
+	{
+		return;
+	}
+
+	for (i = 0; i != IVR_OVERDIAL_PROMPTS; ++i)
+	{
+		val = ast_variable_retrieve(cfg, "overdial", ivr_overdial_keys[i][0]);
+		ast_copy_string(overdial->prompt[i], (val != 0) ? val : ivr_overdial_keys[i][1], sizeof(overdial->prompt[i]));
+	}
+
+	val = ast_variable_retrieve(cfg, "overdial", "alias_digits");
+	overdial->alias_digits = ((val != 0) && (atoi(val) > 0)) ? atoi(val) : 4;
+
+	val = ast_variable_retrieve(cfg, "overdial", "alias_min_digits");
+	overdial->alias_min_digits = ((val != 0) && (atoi(val) > 0)) ? MIN((unsigned int)atoi(val), overdial->alias_digits) : overdial->alias_digits;
+
+	val = ast_variable_retrieve(cfg, "overdial", "alias_timeout");
+	overdial->alias_timeout = (((val != 0) && (atoi(val) > 0)) ? atoi(val) : 10) * 1000;
+
+	val = ast_variable_retrieve(cfg, "overdial", "message_digits");
+	overdial->message_digits = ((val != 0) && (atoi(val) > 0)) ? atoi(val) : 20;
+
+	val = ast_variable_retrieve(cfg, "overdial", "message_timeout");
+	overdial->message_timeout = (((val != 0) && (atoi(val) > 0)) ? atoi(val) : 20) * 1000;
+
+	ao2_global_obj_replace_unref(ivr_overdial, overdial);
+	ao2_ref(overdial, -1);
+}
+
+//
+// [trace] settings take effect on reload; a new file name closes the old file.
+//
+static void load_trace(struct ast_config * cfg, ivr_trace_log_t * log)
+{
+	const char * val;
+	char path[PATH_MAX];
+
+	path[0] = 0;
+	val = ast_variable_retrieve(cfg, "trace", "enabled");
+
+	if ((val != 0) && ast_true(val))
+	{
+		val = ast_variable_retrieve(cfg, "trace", "file");
+
+		if (val != 0)
+		{
+			ast_copy_string(path, val, sizeof(path));
+		}
+		else
+		{
+			snprintf(path, sizeof(path), "%s/%s", ast_config_AST_LOG_DIR, IVR_TRACE_FILE);
+		}
+	}
+
+	ast_mutex_lock(&log->lock);
+
+	if (strcmp(path, log->path) && (log->file != 0))
+	{
+		fclose(log->file);
+		log->file = 0;
+	}
+
+	ast_copy_string(log->path, path, sizeof(log->path));
+
+	val = ast_variable_retrieve(cfg, "trace", "sample");
+	log->sample = (val != 0) ? strtoul(val, 0, 0) : IVR_TRACE_SAMPLE;
+
+	val = ast_variable_retrieve(cfg, "trace", "slow");
+	log->slow = ((val != 0) ? strtoull(val, 0, 0) : IVR_TRACE_SLOW) * 1000;
+
+	val = ast_variable_retrieve(cfg, "trace", "size");
+	log->size = ((val != 0) ? strtoull(val, 0, 0) : IVR_TRACE_SIZE) * 1024 * 1024;
+
+	val = ast_variable_retrieve(cfg, "trace", "rotate");
+	log->rotate = (val != 0) ? strtoul(val, 0, 0) : IVR_TRACE_ROTATE;
+
+	ast_mutex_unlock(&log->lock);
+}
+
+static int load_config(ivr_context_t * ivr, int reload)
+{
+	ivr_config_t * m;
+	struct ast_config *cfg;
+	struct ast_variable *var;
+	struct ast_flags config_flags = { reload ? CONFIG_FLAG_FILEUNCHANGED : 0 };
+	const char *val;
+	unsigned long port;
+	uint16_t port16;
+	unsigned long channels;
+	int backend;
+	char * cpus;
+	char * cpu;
+
+	ivr_context.config_ready = 0;
+
+	cfg = ast_config_load(IVR_CONFIG, config_flags);
+
+	if (cfg == 0)
+	{
+		ast_log(LOG_ERROR, "Config file " IVR_CONFIG " not found.  Aborting.\n");
+		return 0;
+	}
+
+	if (cfg == CONFIG_STATUS_FILEUNCHANGED)
+	{
+		return 0;
+	}
+
+	else if (cfg == CONFIG_STATUS_FILEINVALID)
+	{
+		ast_log(LOG_ERROR, "Config file " IVR_CONFIG " is in an invalid format.  Aborting.\n");
+		return 0;
+	}
+	else
+	{
+		m = ao2_alloc(sizeof(*m), 0);
+
+		if (m == 0)
+		{
+			ast_config_destroy(cfg);
+			return 0;
+		}
+
+		val = ast_variable_retrieve(cfg, "server", "client_id");
+
+		if (val == 0)
+		{
+			val = "default";
+		}
+
+		ast_copy_string(m->client_id, val, sizeof(m->client_id));
+		ast_copy_string(ivr->client_id, val, sizeof(ivr->client_id));
+
+
+		port = ULONG_MAX;
+
+		val = ast_variable_retrieve(cfg, "server", "port");
+
+		if (val != 0)
+		{
+			port = strtoul(val, 0, 0);
+		}
+
+		port16 = (port == ULONG_MAX) ? IVR_SERVER_PORT : (uint16_t)port;
+
+		val = ast_variable_retrieve(cfg, "server", "primary_ip");
+
+		if (val != 0)
+		{
+			load_server(m, val, port16, 1);
+		}
+
+		val = ast_variable_retrieve(cfg, "server", "secondary_ip");
+
+		if (val != 0)
+		{
+			load_server(m, val, port16, 1);
+		}
+
+		for (var = ast_variable_browse(cfg, "server"); var != 0; var = var->next)
+		{
+			if (0 == strcasecmp(var->name, "server"))
+			{
+				load_server(m, var->value, port16, 1);
+			}
+		}
+
+		m->pipeline = IVR_PIPELINE;
+		val = ast_variable_retrieve(cfg, "server", "pipeline");
+
+		if (val != 0)
+		{
+			m->pipeline = atoi(val);
+		}
+
+		if ((m->pipeline < 1) || (m->pipeline > IVR_PIPELINE_MAX))
+		{
+			m->pipeline = IVR_PIPELINE;
+		}
+
+		// untagged verifies are matched by arrival order, so are tagged unless told otherwise
+		val = ast_variable_retrieve(cfg, "server", "tagged");
+		m->tagged = (val == 0) || ast_true(val);
+
+		val = ast_variable_retrieve(cfg, "server", "protocol");
+		m->protocol = ((val != 0) && (strtoul(val, 0, 0) == IVR_PROTOCOL_TEXT)) ? IVR_PROTOCOL_TEXT : IVR_PROTOCOL_BINARY;
+
+		val = ast_variable_retrieve(cfg, "server", "connect_timeout");
+		m->socket.connect_timeout = (val != 0) ? strtoul(val, 0, 0) : IVR_CONNECT_TIMEOUT;
+
+		if (m->socket.connect_timeout == 0)
+		{
+			m->socket.connect_timeout = IVR_CONNECT_TIMEOUT;
+		}
+
+		val = ast_variable_retrieve(cfg, "server", "reconnect");
+		m->socket.reconnect = (val != 0) ? strtoul(val, 0, 0) : IVR_CONNECT_SEC;
+
+		val = ast_variable_retrieve(cfg, "server", "nodelay");
+		m->socket.nodelay = (val == 0) || ast_true(val);
+
+		val = ast_variable_retrieve(cfg, "server", "keepalive");
+		m->socket.keepalive = (val != 0) && ast_true(val);
+
+		val = ast_variable_retrieve(cfg, "server", "keepidle");
+		m->socket.keepidle = (val != 0) ? atoi(val) : 0;
+
+		val = ast_variable_retrieve(cfg, "server", "keepintvl");
+		m->socket.keepintvl = (val != 0) ? atoi(val) : 0;
+
+		val = ast_variable_retrieve(cfg, "server", "keepcnt");
+		m->socket.keepcnt = (val != 0) ? atoi(val) : 0;
+
+		val = ast_variable_retrieve(cfg, "server", "user_timeout");
+		m->socket.user_timeout = (val != 0) ? strtoul(val, 0, 0) : 0;
+
+		val = ast_variable_retrieve(cfg, "server", "verify_timeout");
+		ivr->verify_timeout = ((val != 0) && (atoi(val) > 0)) ? atoi(val) : IVR_TIMEOUT;
+
+		val = ast_variable_retrieve(cfg, "server", "send_timeout");
+		ivr->send_timeout = ((val != 0) && (atoi(val) > 0)) ? atoi(val) : IVR_TIMEOUT;
+
+		val = ast_variable_retrieve(cfg, "server", "query_timeout");
+		ivr->query_timeout = ((val != 0) && (atoi(val) > 0)) ? atoi(val) : IVR_TIMEOUT;
+
+		channels = IVR_CHANNELS;
+		val = ast_variable_retrieve(cfg, "channels", "initial");
+
+		if (val != 0)
+		{
+			channels = strtoul(val, 0, 0);
+		}
+
+		if ((channels == 0) || (channels > IVR_CHANNEL_SLOT_MASK))
+		{
+			channels = IVR_CHANNELS;
+		}
+
+		ivr->channel_initial = (unsigned int)channels;
+
+		channels = IVR_CHANNELS_MAX;
+		val = ast_variable_retrieve(cfg, "channels", "max");
+
+		if (val != 0)
+		{
+			channels = strtoul(val, 0, 0);
+		}
+
+		if (channels > IVR_CHANNEL_SLOT_MASK)
+		{
+			channels = IVR_CHANNEL_SLOT_MASK;
+		}
+
+		if (channels < ivr->channel_initial)
+		{
+			channels = ivr->channel_initial;
+		}
+
+		ivr->channel_max = (unsigned int)channels;
+
+		val = ast_variable_retrieve(cfg, "workers", "shards");
+		ivr->shards = (val != 0) ? atoi(val) : IVR_SHARDS;
+
+		if ((ivr->shards < 1) || (ivr->shards > IVR_SHARDS_MAX))
+		{
+			ivr->shards = IVR_SHARDS;
+		}
+
+		if (reload && (ivr->shard_count != 0) && (ivr->shards != ivr->shard_count))
+		{
+			ast_log(LOG_NOTICE, "IVR worker count change takes effect when the module is loaded again.\n");
+		}
+
+		val = ast_variable_retrieve(cfg, "workers", "queue");
+		channels = (val != 0) ? strtoul(val, 0, 0) : IVR_QUEUE;
+
+		if ((channels < 16) || (channels > IVR_QUEUE_MAX))
+		{
+			channels = IVR_QUEUE;
+		}
+
+		for (ivr->queue = 16; ivr->queue < channels; ivr->queue <<= 1)
+		{
+		}
+
+		val = ast_variable_retrieve(cfg, "workers", "backend");
+		backend = ((val != 0) && !strcasecmp(val, "io_uring")) ? IVR_BACKEND_URING : IVR_BACKEND_PPOLL;
+
+#ifndef HAVE_LIBURING
+		if (backend == IVR_BACKEND_URING)
+		{
+			ast_log(LOG_WARNING, "IVR built without liburing; the workers use ppoll.\n");
+			backend = IVR_BACKEND_PPOLL;
+		}
+#endif
+
+		if (reload && (ivr->shard_count != 0) && (backend != ivr->backend))
+		{
+			ast_log(LOG_NOTICE, "IVR worker backend change takes effect when the module is loaded again.\n");
+		}
+		else
+		{
+			ivr->backend = backend;
+		}
+
+		val = ast_variable_retrieve(cfg, "cache", "size");
+		channels = (val != 0) ? strtoul(val, 0, 0) : IVR_CACHE;
+
+		if (channels > IVR_CACHE_MAX)
+		{
+			channels = IVR_CACHE_MAX;
+		}
+
+		if ((channels != ivr_verify_cache.capacity) && !ivr_cache_configure(&ivr_verify_cache, channels))
+		{
+			ast_log(LOG_WARNING, "Unable to allocate %lu entry verification cache.\n", channels);
+		}
+
+		val = ast_variable_retrieve(cfg, "cache", "positive_ttl");
+		ivr_verify_cache.ttl[1] = ((val != 0) ? strtoul(val, 0, 0) : IVR_CACHE_POSITIVE_SEC) * 1000;
+
+		val = ast_variable_retrieve(cfg, "cache", "negative_ttl");
+		ivr_verify_cache.ttl[0] = ((val != 0) ? strtoul(val, 0, 0) : IVR_CACHE_NEGATIVE_SEC) * 1000;
+
+		val = ast_variable_retrieve(cfg, "messages", "size");
+		channels = (val != 0) ? strtoul(val, 0, 0) : IVR_MESSAGES;
+
+		if (channels > IVR_CACHE_MAX)
+		{
+			channels = IVR_CACHE_MAX;
+		}
+
+		if ((channels != ivr_message_cache.capacity) && !ivr_cache_configure(&ivr_message_cache, channels))
+		{
+			ast_log(LOG_WARNING, "Unable to allocate %lu entry message status table.\n", channels);
+		}
+
+		ivr_outbox.window = m->pipeline;
+
+		val = ast_variable_retrieve(cfg, "outbox", "enabled");
+
+		if (reload && (ivr_outbox.records != 0) != ((val != 0) && ast_true(val)))
+		{
+			ast_log(LOG_NOTICE, "IVR outbox changes take effect when the module is loaded again.\n");
+		}
+		else if (!reload)
+		{
+			ivr_outbox.capacity = 0;
+
+			if ((val != 0) && ast_true(val))
+			{
+				val = ast_variable_retrieve(cfg, "outbox", "records");
+				ivr_outbox.capacity = (val != 0) ? strtoul(val, 0, 0) : IVR_OUTBOX;
+
+				if (ivr_outbox.capacity == 0)
+				{
+					ivr_outbox.capacity = IVR_OUTBOX;
+				}
+
+				val = ast_variable_retrieve(cfg, "outbox", "file");
+
+				if (val != 0)
+				{
+					ast_copy_string(ivr_outbox.path, val, sizeof(ivr_outbox.path));
+				}
+				else
+				{
+					snprintf(ivr_outbox.path, sizeof(ivr_outbox.path), "%s/%s", ast_config_AST_SPOOL_DIR, IVR_OUTBOX_FILE);
+				}
+			}
+		}
+
+		val = ast_variable_retrieve(cfg, "messages", "retention");
+		ivr_message_cache.ttl[1] = ((val != 0) ? strtoul(val, 0, 0) : IVR_MESSAGES_SEC) * 1000;
+		ivr_message_cache.ttl[0] = ivr_message_cache.ttl[1];
+
+		load_groups(cfg);
+		load_substitutions(cfg);
+		load_prompts(cfg);
+		load_overdial(cfg);
+		load_trace(cfg, &ivr_trace_log);
+
+		ivr->cpu_count = 0;
+		val = ast_variable_retrieve(cfg, "workers", "affinity");
+
+		if (val != 0)
+		{
+			cpus = ast_strdupa(val);
+
+			while (((cpu = strsep(&cpus, ",")) != 0) && (ivr->cpu_count != IVR_SHARDS_MAX))
+			{
+				cpu = ast_strip(cpu);
+
+				if (!ast_strlen_zero(cpu))
+				{
+					ivr->cpus[ivr->cpu_count++] = atoi(cpu);
+				}
+			}
+		}
+
+		if (m->server_count == 0)
+		{
+			ast_log(LOG_WARNING, "Config file " IVR_CONFIG " contains no valid server address.\n");
+		}
+		else
+		{
+			ivr->config_ready = 1;
+		}
+
+		// the benchmarks take a reference from another thread
+		ast_mutex_lock(&ivr_mutex);
+		SWAP(ivr->config, m);
+		ast_mutex_unlock(&ivr_mutex);
+
+		ao2_cleanup(m);
+
+		ast_config_destroy(cfg);
+		cfg = 0;
+
+		return 1;
+	}
+}
+
+
+//
+// Hand the current configuration to every worker.
+//
+static int ivr_configure(ivr_context_t * ivr)
+{
+	unsigned int i;
+
+	// a configuration the worker has not taken yet is superseded
+	for (i = 0; i != ivr->shard_count; ++i)
+	{
+		ao2_cleanup(__sync_lock_test_and_set(&ivr->shard[i].config, ao2_bump(ivr->config)));
+		ivr_shard_wake(&ivr->shard[i]);
+	}
+
+	return 1;
+}
+
+static int reload(void)
+{
+	ivr_context_t * ivr = &ivr_context;
+
+	if (load_config(ivr, 1))
+	{
+		if (ivr->config_ready != 0)
+		{
+			if (!ivr_configure(ivr))
+			{
+				return AST_MODULE_LOAD_DECLINE;
+			}
+
+			ast_log(LOG_NOTICE, "Sent reconfiguration to worker threads.\n");
+		}
+	}
+
+	return AST_MODULE_LOAD_SUCCESS;
+}
+
+#ifdef TEST_FRAMEWORK
+
+#define IVR_TEST_REQUESTS		10000			// default benchmark requests
+#define IVR_TEST_THREADS		32				// default benchmark caller threads
+#define IVR_TEST_CLIENTS		(IVR_SHARDS_MAX * 2)
+
+//
+// Stub server for the benchmarks: answers every request with OK, tagged
+// when the request carries a tag, as soon as it is read.  It accepts the
+// protocol 2 offer.
+//
+typedef struct
+{
+	int						listen_fd;
+	struct sockaddr_in		address;
+	volatile int			stop;
+	pthread_t				thread;
+	volatile uint64_t		requests;
+} ivr_test_server_t;
+
+typedef struct
+{
+	ivr_context_t *			ivr;					// the benchmark's own workers and channel pool
+	int						code;
+	unsigned int			requests;				// per thread
+	ivr_histogram_t			latency;
+	volatile unsigned int	failures;
+} ivr_test_load_t;
+
+//
+// Reply to the complete frames in rx.  Returns the bytes consumed.
+//
+static int ivr_test_server_frames(ivr_test_server_t * server, int fd, char * rx, int length, int * protocol)
+{
+	const char response[2] = {IVR_RESPONSE_SUCCESS, 0};
+	char tx[4096];
+	int tx_length = 0;
+	char * frame;
+	char * end;
+	char * field[6];
+	int fields;
+	int size;
+	int i = 0;
+
+	while ((*protocol == IVR_PROTOCOL_BINARY) && ((length - i) >= IVR_FRAME_HEADER))
+	{
+		size = ((unsigned char)rx[i] << 8) | (unsigned char)rx[i + 1];
+
+		if ((size < IVR_FRAME_HEADER) || ((length - i) < size))
+		{
+			break;
+		}
+
+		memcpy(&tx[tx_length], &rx[i], IVR_FRAME_HEADER);
+		tx[tx_length + 2] = IVR_RESPONSE_FRAME;
+		tx[tx_length + 3] = 0;
+		tx_length += ivr_frame_end(&tx[tx_length], ivr_frame_field(&tx[tx_length], IVR_FRAME_HEADER, IVR_FIELD_RESPONSE, response));
+		i += size;
+
+		__sync_fetch_and_add(&server->requests, 1);
+
+		if (tx_length > (int)(sizeof(tx) - 64))
 		{
-			pbx_builtin_setvar_helper(chan, "CRS_RESPONSE", "OK");
-			return 0;
+			break;
 		}
+	}
 
-		case IVR_RESPONSE_FAIL_UNKNOWNREQUEST:
+	while ((*protocol != IVR_PROTOCOL_BINARY) && (i < length) && ((end = memchr(&rx[i], ']', length - i)) != 0))
+	{
+		frame = memchr(&rx[i], '[', end - &rx[i]);
+		i = (end - rx) + 1;
+
+		if ((frame == 0) || ((end - frame) < 3) || (frame[2] != ':'))
 		{
-			pbx_builtin_setvar_helper(chan, "CRS_RESPONSE", "UNKNOWN_REQ");
-			return 0;
+			continue;
 		}
 
-		case IVR_RESPONSE_FAIL_RECIPIENTNOTFOUND:
+		*end = 0;
+		field[0] = &frame[3];
+
+		for (fields = 1; (fields != ARRAY_LEN(field)) && ((field[fields] = strchr(field[fields - 1], ',')) != 0); ++fields)
 		{
-			pbx_builtin_setvar_helper(chan, "CRS_RESPONSE", "RECIPIENT_INVALID");
-			return 0;
+			*field[fields]++ = 0;
 		}
 
-		case IVR_RESPONSE_FAIL_RECIPIENTDISABLED:
+		// [s:client,tag,...], [q:client,tag,...], [v:client,tag,alias] and [p:client,tag] carry a tag.
+		if ((((frame[1] == IVR_REQUEST_SENDMESSAGE) || (frame[1] == IVR_REQUEST_QUERYMESSAGE)) && (fields > 1)) ||
+			((frame[1] == IVR_REQUEST_VERIFYRECIPIENT) && (fields > 2)) || ((frame[1] == IVR_REQUEST_PING) && (fields > 1)))
 		{
-			pbx_builtin_setvar_helper(chan, "CRS_RESPONSE", "RECIPIENT_DISABLED");
-			return 0;
+			tx_length += snprintf(&tx[tx_length], sizeof(tx) - tx_length, "[%c:%s,%c]", IVR_RESPONSE_FRAME, field[1], IVR_RESPONSE_SUCCESS);
 		}
-
-		case IVR_RESPONSE_FAIL_SYSTEMNOTAVAILABLE:
+		else
 		{
-			pbx_builtin_setvar_helper(chan, "CRS_RESPONSE", "SYSTEM_UNAVAIL");
-			return 0;
+			tx[tx_length++] = IVR_RESPONSE_SUCCESS;
 		}
 
-		case IVR_RESPONSE_FAIL_HANGUP:
+		// the client sends nothing more until it has the answer
+		if (frame[1] == IVR_REQUEST_HELLO)
 		{
-			pbx_builtin_setvar_helper(chan, "CRS_RESPONSE", "HANGUP");
-			return 0;
+			*protocol = IVR_PROTOCOL_BINARY;
+			break;
 		}
 
-		default:
-		case IVR_RESPONSE_FAIL_INTERNAL:
+		__sync_fetch_and_add(&server->requests, 1);
+
+		if (tx_length > (int)(sizeof(tx) - 64))
 		{
-			pbx_builtin_setvar_helper(chan, "CRS_RESPONSE", "ERROR_INTERNAL");
-			return 0;
+			break;
 		}
 	}
-}
-
-static const char * sendmsg_name =
-	FUNC_SENDMSG;
 
-static const char * sendmsg_synopsis =
-	"Send a text message to the server.";
+	if ((tx_length != 0) && (write(fd, tx, tx_length) != tx_length))
+	{
+		ast_log(LOG_WARNING, "IVR test server write failed (%s).\n", strerror(errno));
+	}
 
-static const char sendmsg_description[] =
-	FUNC_SENDMSG "(<recipient>,<message>[,<caller>])\n"
-	"  Sends a message to the server, specifying the recipient, the\n"
-	"  message, and an optional caller.\n";
+	return i;
+}
 
-static int sendmsg_exec(struct ast_channel *chan, const char *data)
+static void * ivr_test_server_task(void * arg)
 {
-	char * parse;
-	int response;
+	ivr_test_server_t * server = (ivr_test_server_t *)arg;
+	struct pollfd fds[1 + IVR_TEST_CLIENTS];
+	char rx[IVR_TEST_CLIENTS][1024];
+	int rx_length[IVR_TEST_CLIENTS];
+	int protocol[IVR_TEST_CLIENTS];
+	int count = 1;
+	int consumed;
+	int length;
+	int fd;
+	int i;
 
-	AST_DECLARE_APP_ARGS
-	(
-		args,
-		AST_APP_ARG(recipient);
-		AST_APP_ARG(message);
-		AST_APP_ARG(caller);
-	);
+	fds[0].fd = server->listen_fd;
+	fds[0].events = POLLIN;
 
-	if (ast_strlen_zero(data))
+	while (!server->stop)
 	{
-		ast_log( LOG_WARNING, FUNC_SENDMSG " requires two or three arguments (<recipient>,<message>[,<caller>])\n");
-		return -1;
-	}
+		if (poll(fds, count, 100) <= 0)
+		{
+			continue;
+		}
 
-	parse = ast_strdupa(data);
+		if ((fds[0].revents & POLLIN) && ((fd = accept(server->listen_fd, 0, 0)) >= 0))
+		{
+			if (count == ARRAY_LEN(fds))
+			{
+				close(fd);
+			}
+			else
+			{
+				fds[count].fd = fd;
+				fds[count].events = POLLIN;
+				fds[count].revents = 0;
+				rx_length[count - 1] = 0;
+				protocol[count - 1] = IVR_PROTOCOL_TEXT;
+				++count;
+			}
+		}
 
-	AST_STANDARD_APP_ARGS(args, parse);
+		for (i = 1; i < count; ++i)
+		{
+			if (fds[i].revents == 0)
+			{
+				continue;
+			}
 
-	if (args.argc < 2)
-	{
-		ast_log(LOG_WARNING, FUNC_SENDMSG " requires two or three arguments (<recipient>,<message>[,<caller>])\n");
-		return -1;
-	}
+			length = read(fds[i].fd, &rx[i - 1][rx_length[i - 1]], sizeof(rx[0]) - rx_length[i - 1]);
 
-	response = ivr_sendmessage(chan, args.recipient, args.message, args.caller);
-	return ivr_setresponse(chan, response);
-}
+			if (length <= 0)
+			{
+				close(fds[i].fd);
+				fds[i] = fds[--count];
+				rx_length[i - 1] = rx_length[count - 1];
+				protocol[i - 1] = protocol[count - 1];
+				memcpy(rx[i - 1], rx[count - 1], rx_length[i - 1]);
+				--i;
+				continue;
+			}
 
-static const char * verifyrecipient_name =
-	FUNC_VERIFYRECIPIENT;
+			rx_length[i - 1] += length;
+			consumed = ivr_test_server_frames(server, fds[i].fd, rx[i - 1], rx_length[i - 1], &protocol[i - 1]);
+			rx_length[i - 1] -= consumed;
+			memmove(rx[i - 1], &rx[i - 1][consumed], rx_length[i - 1]);
 
-static const char * verifyrecipient_synopsis =
-	"Verify a recipient";
+			if (rx_length[i - 1] == sizeof(rx[0]))
+			{
+				rx_length[i - 1] = 0;
+			}
+		}
+	}
 
-static const char verifyrecipient_description[] =
-	FUNC_VERIFYRECIPIENT "(<recipient>)\n"
-	"  Verify a recipient with the server.\n";
+	for (i = 1; i < count; ++i)
+	{
+		close(fds[i].fd);
+	}
 
-static int verifyrecipient_exec(struct ast_channel *chan, const char *data)
+	return 0;
+}
+
+static int ivr_test_server_start(ivr_test_server_t * server)
 {
-	char * parse;
-	int response;
+	socklen_t length = sizeof(server->address);
 
-	AST_DECLARE_APP_ARGS
-	(
-		args,
-		AST_APP_ARG(recipient);
-	);
+	memset(server, 0, sizeof(*server));
+	server->address.sin_family = AF_INET;
+	server->address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
 
-	if (ast_strlen_zero(data))
+	if ((server->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
 	{
-		ast_log(LOG_WARNING, FUNC_VERIFYRECIPIENT " requires one argument (<recipient>)\n");
-		return -1;
+		return 0;
 	}
 
-	parse = ast_strdupa(data);
-
-	AST_STANDARD_APP_ARGS(args, parse);
-
-	if (args.argc != 1)
+	if ((bind(server->listen_fd, (struct sockaddr *)&server->address, sizeof(server->address)) != 0) ||
+		(getsockname(server->listen_fd, (struct sockaddr *)&server->address, &length) != 0) ||
+		(listen(server->listen_fd, IVR_TEST_CLIENTS) != 0) ||
+		(ast_pthread_create(&server->thread, 0, ivr_test_server_task, server) != 0))
 	{
-		ast_log(LOG_WARNING, FUNC_VERIFYRECIPIENT " requires one argument (<recipient>)\n");
-		return -1;
+		close(server->listen_fd);
+		return 0;
 	}
 
-	response = ivr_verifyrecipient(chan, args.recipient);
-	return ivr_setresponse(chan, response);
+	return 1;
 }
 
-static int load_address(struct sockaddr_in * address, const char *ip, uint16_t port)
+static void ivr_test_server_stop(ivr_test_server_t * server)
 {
-	address->sin_family = AF_INET;
-	address->sin_port = htons(port);
+	server->stop = 1;
+	pthread_join(server->thread, 0);
+	close(server->listen_fd);
+}
 
-	if ((ip == 0) || (ip[0] == 0))
-	{
-		return 0;
-	}
+//
+// One benchmark caller: a channel slot used for request after request, as
+// a dialplan channel would, waiting on the slot's event fd.
+//
+static void * ivr_test_load_task(void * arg)
+{
+	ivr_test_load_t * load = (ivr_test_load_t *)arg;
+	ivr_context_t * ivr = load->ivr;
+	ivr_channel_t * ivr_chan = ivr_channel_acquire(ivr);
+	ivr_request_t request;
+	uint64_t started;
+	unsigned int i;
+	int response;
 
-  	if (inet_pton(AF_INET, ip, &address->sin_addr) <= 0)
+	if (ivr_chan == 0)
 	{
+		__sync_fetch_and_add(&load->failures, load->requests);
 		return 0;
 	}
-	else
+
+	for (i = 0; i != load->requests; ++i)
 	{
-		return 1;
+		memset(&request, 0, sizeof(request));
+		request.code = load->code;
+		request.index = ivr_channel_begin(ivr_chan);
+		request.deadline = ivr_clock_ms() + IVR_TIMEOUT;
+		snprintf(request.param[0], sizeof(request.param[0]), "%u", 1000 + (i % 9000));
+
+		if (load->code == IVR_REQUEST_SENDMESSAGE)
+		{
+			ast_copy_string(request.message, "benchmark", sizeof(request.message));
+			ast_copy_string(request.param[2], "test", sizeof(request.param[2]));
+		}
+
+		started = ivr_clock_us();
+
+		if (!ivr_shard_send(ivr_shard(ivr, request.index), &request))
+		{
+			__sync_fetch_and_add(&load->failures, 1);
+			continue;
+		}
+
+		response = ivr_wait_fd(ivr_chan, IVR_TIMEOUT);
+
+		ivr_histogram_record(&load->latency, ivr_clock_us() - started);
+
+		if (response != IVR_RESPONSE_SUCCESS)
+		{
+			__sync_fetch_and_add(&load->failures, 1);
+		}
 	}
+
+	ivr_channel_release(ivr_chan);
+
+	return 0;
 }
 
-static int load_config(ivr_context_t * ivr, int reload)
+//
+// Start workers and a channel pool of the benchmark's own, set up like the
+// live ones but pointed at a stub server, drive requests of one kind through
+// them from many threads, and hold the throughput and latency to the
+// [benchmark] thresholds in crsivr.conf.  Live calls cannot reach the
+// benchmark's slots or workers, so they are served as usual meanwhile.
+//
+static enum ast_test_result_state ivr_test_benchmark(struct ast_test * test, int code)
 {
-	ivr_request_t * m = &ivr->config_request;
-	struct ast_config *cfg;
-	struct ast_flags config_flags = { reload ? CONFIG_FLAG_FILEUNCHANGED : 0 };
-	const char *val;
-	unsigned long port;
-	uint16_t port16;
-
-	ivr_context.config_ready = 0;
+	ivr_context_t * ivr = &ivr_context;
+	ivr_context_t * bench;
+	struct ast_flags config_flags = {0};
+	struct ast_config * cfg;
+	const char * val;
+	ivr_test_server_t server;
+	ivr_test_load_t * load;
+	ivr_config_t * config;
+	ivr_config_t * live;
+	pthread_t threads[256];
+	unsigned int thread_count = IVR_TEST_THREADS;
+	unsigned int requests = IVR_TEST_REQUESTS;
+	double min_rate = 0;
+	double max_p99 = 0;
+	unsigned int max_failures = 0;
+	enum ast_test_result_state result = AST_TEST_PASS;
+	uint64_t started;
+	uint64_t elapsed;
+	double rate;
+	unsigned int i;
+
+	if (!ivr->initialized || (ivr->config == 0))
+	{
+		ast_test_status_update(test, "IVR subsystem is not loaded.\n");
+		return AST_TEST_FAIL;
+	}
 
 	cfg = ast_config_load(IVR_CONFIG, config_flags);
 
-	if (cfg == 0)
+	if ((cfg != 0) && (cfg != CONFIG_STATUS_FILEINVALID))
 	{
-		ast_log(LOG_ERROR, "Config file " IVR_CONFIG " not found.  Aborting.\n");
-		return 0;
+		if ((val = ast_variable_retrieve(cfg, "benchmark", "requests")) != 0)
+		{
+			requests = strtoul(val, 0, 0);
+		}
+
+		if ((val = ast_variable_retrieve(cfg, "benchmark", "threads")) != 0)
+		{
+			thread_count = strtoul(val, 0, 0);
+		}
+
+		if ((val = ast_variable_retrieve(cfg, "benchmark", "min_rate")) != 0)
+		{
+			min_rate = strtod(val, 0);
+		}
+
+		if ((val = ast_variable_retrieve(cfg, "benchmark", "max_p99")) != 0)
+		{
+			max_p99 = strtod(val, 0);
+		}
+
+		if ((val = ast_variable_retrieve(cfg, "benchmark", "max_failures")) != 0)
+		{
+			max_failures = strtoul(val, 0, 0);
+		}
+
+		ast_config_destroy(cfg);
 	}
 
-	if (cfg == CONFIG_STATUS_FILEUNCHANGED)
+	thread_count = MAX(1, MIN(thread_count, ARRAY_LEN(threads)));
+	requests = MAX(requests, thread_count);
+
+	if ((load = ast_calloc(1, sizeof(*load))) == 0)
 	{
-		return 0;
+		return AST_TEST_FAIL;
 	}
 
-	else if (cfg == CONFIG_STATUS_FILEINVALID)
+	load->code = code;
+	load->requests = requests / thread_count;
+
+	if (!ivr_test_server_start(&server))
 	{
-		ast_log(LOG_ERROR, "Config file " IVR_CONFIG " is in an invalid format.  Aborting.\n");
-		return 0;
+		ast_test_status_update(test, "Unable to start the stub server (%s).\n", strerror(errno));
+		ast_free(load);
+		return AST_TEST_FAIL;
 	}
-	else
-	{
-		val = ast_variable_retrieve(cfg, "server", "client_id");
 
-		if (val == 0)
-		{
-			val = "default";
-		}
+	config = ao2_alloc_options(sizeof(*config), 0, AO2_ALLOC_OPT_LOCK_NOLOCK);
+	bench = ast_calloc(1, sizeof(*bench));
 
-		ast_copy_string(m->client_id, val, sizeof(m->client_id));
+	if ((config == 0) || (bench == 0))
+	{
+		ao2_cleanup(config);
+		ast_free(bench);
+		ivr_test_server_stop(&server);
+		ast_free(load);
+		return AST_TEST_FAIL;
+	}
+
+	// a reload may replace the live configuration meanwhile
+	ast_mutex_lock(&ivr_mutex);
+	live = ao2_bump(ivr->config);
+	ast_mutex_unlock(&ivr_mutex);
 
+	*config = *live;
+	config->server_count = 1;
+	config->address[0] = server.address;
+	config->weight[0] = 1;
+	ao2_ref(live, -1);
+
+	ast_copy_string(bench->client_id, ivr->client_id, sizeof(bench->client_id));
+	bench->config = config;
+	bench->config_ready = 1;
+	bench->channel_initial = thread_count;
+	bench->channel_max = thread_count;
+	bench->shards = ivr->shard_count;
+	bench->backend = ivr->backend;
+	bench->queue = ivr->queue;
+	bench->cpu_count = ivr->cpu_count;
+	memcpy(bench->cpus, ivr->cpus, sizeof(bench->cpus));
+
+	load->ivr = bench;
+
+	if (!ivr_load(bench))
+	{
+		ast_test_status_update(test, "Unable to start the benchmark workers.\n");
+		ivr_unload(bench);
+		ao2_ref(config, -1);
+		ast_free(bench);
+		ivr_test_server_stop(&server);
+		ast_free(load);
+		return AST_TEST_FAIL;
+	}
 
-		port = ULONG_MAX;
+	ivr_configure(bench);
 
-		val = ast_variable_retrieve(cfg, "server", "port");
+	started = ivr_clock_us();
 
-		if (val != 0)
+	for (i = 0; i != thread_count; ++i)
+	{
+		if (ast_pthread_create(&threads[i], 0, ivr_test_load_task, load) != 0)
 		{
-			port = strtoul(val, 0, 0);
+			thread_count = i;
+			break;
 		}
+	}
 
-		port16 = (port == ULONG_MAX) ? 55001 : (uint16_t)port;
+	for (i = 0; i != thread_count; ++i)
+	{
+		pthread_join(threads[i], 0);
+	}
 
-		val = ast_variable_retrieve(cfg, "server", "primary_ip");
-		m->valid[0] = load_address(&m->address[0], val, port16);
+	elapsed = ivr_clock_us() - started;
 
-		val = ast_variable_retrieve(cfg, "server", "secondary_ip");
-		m->valid[1] = load_address(&m->address[1], val, port16);
+	ivr_unload(bench);
+	ao2_ref(config, -1);
+	ast_free(bench);
 
-		m->code = IVR_REQUEST_CONFIG;
+	ivr_test_server_stop(&server);
 
-		if (m->valid[0] == 0)
-		{
-			ast_log(LOG_WARNING, "Config file " IVR_CONFIG " contains invalid primary server address.\n");
-		}
-		else
-		{
-			ivr->config_ready = 1;
-		}
+	rate = (load->latency.count * 1000000.0) / (elapsed ? elapsed : 1);
 
-		ast_config_destroy(cfg);
-		cfg = 0;
+	ast_test_status_update(test, "%u threads, %llu requests in %.3f s: %.0f requests/s, %u failed\n",
+		thread_count, (unsigned long long)load->latency.count, elapsed / 1000000.0, rate, load->failures);
+	ast_test_status_update(test, "latency ms: p50 %.3f, p95 %.3f, p99 %.3f, max %.3f\n",
+		ivr_histogram_percentile(&load->latency, 500) / 1000.0,
+		ivr_histogram_percentile(&load->latency, 950) / 1000.0,
+		ivr_histogram_percentile(&load->latency, 990) / 1000.0,
+		load->latency.max / 1000.0);
 
-		return 1;
+	if (load->failures > max_failures)
+	{
+		ast_test_status_update(test, "%u requests failed, limit %u.\n", load->failures, max_failures);
+		result = AST_TEST_FAIL;
 	}
-}
 
+	if ((min_rate != 0) && (rate < min_rate))
+	{
+		ast_test_status_update(test, "Throughput %.0f requests/s is below %.0f.\n", rate, min_rate);
+		result = AST_TEST_FAIL;
+	}
 
-static int reload(void)
-{
-	ivr_context_t * ivr = &ivr_context;
-	ivr_request_t * m = &ivr->config_request;
+	if ((max_p99 != 0) && ((ivr_histogram_percentile(&load->latency, 990) / 1000.0) > max_p99))
+	{
+		ast_test_status_update(test, "p99 latency is above %.3f ms.\n", max_p99);
+		result = AST_TEST_FAIL;
+	}
 
-	if (load_config(ivr, 1))
+	ast_free(load);
+
+	return result;
+}
+
+AST_TEST_DEFINE(benchmark_verify)
+{
+	switch (cmd)
 	{
-		if (ivr->config_ready != 0)
-		{
-			if (sizeof(*m) != write(ivr->pipe_request_fd[1], m, sizeof(*m)))
-			{
-				ast_log(LOG_ERROR, "Unable to reconfigure worker thread.\n");
-				return 0;
-			}
+		case TEST_INIT:
+			info->name = "benchmark_verify";
+			info->category = "/apps/crsivr/";
+			info->summary = "Recipient verification throughput and latency";
+			info->description =
+				"Sends verify requests from many threads through the workers to a\n"
+				"stub server, checking the [benchmark] thresholds in crsivr.conf.\n"
+				"It has workers and channel slots of its own; live calls are\n"
+				"not affected.";
+			return AST_TEST_NOT_RUN;
+
+		case TEST_EXECUTE:
+			break;
+	}
 
-			ast_log(LOG_NOTICE, "Sent reconfiguration to worker thread.\n");
-		}
+	return ivr_test_benchmark(test, IVR_REQUEST_VERIFYRECIPIENT);
+}
+
+AST_TEST_DEFINE(benchmark_send)
+{
+	switch (cmd)
+	{
+		case TEST_INIT:
+			info->name = "benchmark_send";
+			info->category = "/apps/crsivr/";
+			info->summary = "SendMessage throughput and latency";
+			info->description =
+				"Sends messages from many threads through the workers to a stub\n"
+				"server, checking the [benchmark] thresholds in crsivr.conf.\n"
+				"It has workers and channel slots of its own; live calls are\n"
+				"not affected.";
+			return AST_TEST_NOT_RUN;
+
+		case TEST_EXECUTE:
+			break;
 	}
 
-	return 1;
+	return ivr_test_benchmark(test, IVR_REQUEST_SENDMESSAGE);
 }
 
+#endif
+
 static int load_module(void)
 {
 	ivr_context_t * ivr = &ivr_context;
-	ivr_request_t * m = &ivr->config_request;
 	int res;
 
+	ivr_stats_reset(&ivr_stats);
+
 	res = load_config(ivr, 0);
 
 	if (res == 0)
@@ -1159,7 +7564,13 @@ static int load_module(void)
 		return AST_MODULE_LOAD_DECLINE;
 	}
 
-	if (0 == ivr_load())
+	if (0 == ivr_load(ivr))
+	{
+		unload_module();
+		return AST_MODULE_LOAD_FAILURE;
+	}
+
+	if ((ivr_outbox.capacity != 0) && !ivr_outbox_start(&ivr_outbox))
 	{
 		unload_module();
 		return AST_MODULE_LOAD_FAILURE;
@@ -1167,18 +7578,26 @@ static int load_module(void)
 
 	if (ivr->config_ready)
 	{
-		if (sizeof(*m) != write(ivr->pipe_request_fd[1], m, sizeof(*m)))
+		if (!ivr_configure(ivr))
 		{
-			ast_log(LOG_ERROR, "Unable to configure worker thread.\n");
 			unload_module();
 			return AST_MODULE_LOAD_FAILURE;
 		}
 
-		ast_log(LOG_NOTICE, "Sent configuration to worker thread.\n");
+		ast_log(LOG_NOTICE, "Sent configuration to worker threads.\n");
 	}
 
 	res = ast_register_application(sendmsg_name, sendmsg_exec, sendmsg_synopsis, sendmsg_description);
 	res |= ast_register_application(verifyrecipient_name, verifyrecipient_exec, verifyrecipient_synopsis, verifyrecipient_description);
+	res |= ast_register_application(querymessage_name, querymessage_exec, querymessage_synopsis, querymessage_description);
+	res |= ast_register_application(playback_name, playback_exec, playback_synopsis, playback_description);
+	res |= ast_register_application(overdial_name, overdial_exec, overdial_synopsis, overdial_description);
+	res |= ast_custom_function_register(&substitute_function);
+	res |= ast_cli_register_multiple(ivr_cli, ARRAY_LEN(ivr_cli));
+	res |= ast_manager_register(manager_stats_name, EVENT_FLAG_REPORTING, manager_stats, manager_stats_synopsis);
+
+	AST_TEST_REGISTER(benchmark_verify);
+	AST_TEST_REGISTER(benchmark_send);
 
 	if (res)
 	{
@@ -1196,11 +7615,40 @@ static int unload_module(void)
 
 	res = ast_unregister_application(sendmsg_name);
 	res |= ast_unregister_application(verifyrecipient_name);
-
-	ivr_unload();
+	res |= ast_unregister_application(querymessage_name);
+	res |= ast_unregister_application(playback_name);
+	res |= ast_unregister_application(overdial_name);
+	res |= ast_custom_function_unregister(&substitute_function);
+	ast_cli_unregister_multiple(ivr_cli, ARRAY_LEN(ivr_cli));
+	ast_manager_unregister(manager_stats_name);
+	AST_TEST_UNREGISTER(benchmark_verify);
+	AST_TEST_UNREGISTER(benchmark_send);
+
+	ivr_outbox_stop(&ivr_outbox);
+	ivr_unload(&ivr_context);
+	ivr_trace_close(&ivr_trace_log);
+
+	ivr_cache_configure(&ivr_verify_cache, 0);
+	ivr_cache_configure(&ivr_message_cache, 0);
+
+	ao2_cleanup(ivr_context.config);
+	ivr_context.config = 0;
+	ao2_global_obj_release(ivr_groups);
+	ao2_global_obj_release(ivr_substitutions);
+	ao2_global_obj_release(ivr_prompts);
+	ao2_global_obj_release(ivr_overdial);
 
 	return res;
 }
 
-AST_MODULE_INFO_STANDARD(ASTERISK_GPL_KEY, "CRS IVR Support Functions");
+//
+// Prompts are encoded at load, so the file formats and codecs must be there first.
+//
+AST_MODULE_INFO(ASTERISK_GPL_KEY, AST_MODFLAG_DEFAULT, "CRS IVR Support Functions",
+	.support_level = AST_MODULE_SUPPORT_EXTENDED,
+	.load = load_module,
+	.unload = unload_module,
+	.reload = reload,
+	.optional_modules = "format_wav,format_pcm,format_gsm,format_g722,codec_ulaw,codec_alaw,codec_gsm,codec_g722,codec_resample",
+);
 
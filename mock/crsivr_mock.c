@@ -0,0 +1,970 @@
+/*
+ * CRS Sparkgap protocol stand-in server
+ *
+ * Answers the requests app_crsivr sends so the module can be exercised and
+ * benchmarked without a paging server:
+ *
+ *   [v:client,alias]  [v:client,tag,alias]     verify recipient
+ *   [s:client,tag,recipient,message,caller]    send message
+ *   [q:client,tag,message tag]                 query message
+ *   [p:client]  [p:client,tag]                 heartbeat
+ *   [h:client,2]  [h:client,tag,2]             protocol 2 offer
+ *
+ * Tagged requests are answered [r:<tag>,<response>], in any order;
+ * untagged requests with the bare response character, in order.
+ *
+ * The offer is accepted with a bare 0; frames follow in both directions:
+ * uint16 length, uint8 opcode, uint8 field count, uint64 id, then fields
+ * of uint8 type, uint16 length and value.  Responses echo the id, in any
+ * order, with the response, and for a message a message id and the queue
+ * position.
+ *
+ * Usage: crsivr_mock [-a address] [-p port] [-s script] [-l latency]
+ *                    [-t probability:ms] [-f fault] ... [-r seconds] [-P 1]
+ *
+ *   -s script    lines of "<alias> <response> [ms]": the response (and
+ *                latency) for a recipient; others get 0 (OK), and
+ *                queries b (DELIVERED)
+ *   -l latency   fixed:<ms>, uniform:<min ms>:<max ms>, exp:<mean ms> or
+ *                normal:<mean ms>:<sd ms> (default fixed:0)
+ *   -t p:ms      a fraction p of responses take ms longer (latency tail)
+ *   -f fault     drop:<p>           close the connection instead of answering
+ *                stall:<p>:<ms>     stop reading the connection for ms
+ *                garble:<p>         answer with garbage bytes
+ *                slowaccept:<ms>    accept connections ms after they arrive
+ *   -r seconds   throughput report interval, 0 = off (default 1)
+ *   -P 1         refuse the protocol 2 offer, like a server that only
+ *                speaks text
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MOCK_PORT				55001
+#define MOCK_CONNECTIONS		256
+#define MOCK_RX_BUFFER			4096
+#define MOCK_SCRIPT_MAX			4096
+
+#define MOCK_LATENCY_FIXED		0
+#define MOCK_LATENCY_UNIFORM	1
+#define MOCK_LATENCY_EXP		2
+#define MOCK_LATENCY_NORMAL		3
+
+#define MOCK_FRAME_HEADER		12
+#define MOCK_FIELD_RECIPIENT	1
+#define MOCK_FIELD_RESPONSE		5
+#define MOCK_FIELD_REFERENCE	6
+#define MOCK_FIELD_POSITION		7
+
+typedef struct
+{
+	int						type;
+	double					a;						// ms
+	double					b;						// ms
+} mock_latency_t;
+
+typedef struct
+{
+	char					alias[32];
+	char					response;
+	int						latency;				// ms, -1 = the configured distribution
+} mock_script_t;
+
+typedef struct
+{
+	int						fd;
+	unsigned int			generation;				// bumped when the slot is reused
+	uint64_t				stalled;				// usec the connection is read again
+	uint64_t				ordered;				// due time of the last untagged response
+	int						protocol;				// 1 = text, 2 = frames
+	int						rx_length;
+	char					rx[MOCK_RX_BUFFER];
+} mock_connection_t;
+
+typedef struct
+{
+	uint64_t				due;					// usec
+	uint64_t				sequence;				// keeps responses due together in order
+	int						connection;
+	unsigned int			generation;
+	int						length;
+	char					data[64];
+} mock_response_t;
+
+typedef struct
+{
+	uint64_t				requests;
+	uint64_t				responses;
+	uint64_t				accepts;
+	uint64_t				drops;
+	uint64_t				stalls;
+	uint64_t				garbles;
+} mock_counters_t;
+
+static mock_latency_t mock_latency = {MOCK_LATENCY_FIXED, 0, 0};
+static double mock_tail_p = 0;
+static double mock_tail_ms = 0;
+static double mock_drop_p = 0;
+static double mock_stall_p = 0;
+static double mock_stall_ms = 0;
+static double mock_garble_p = 0;
+static double mock_accept_ms = 0;
+static int mock_protocol = 2;
+static uint64_t mock_message_id = 0;
+
+static mock_script_t mock_script[MOCK_SCRIPT_MAX];
+static unsigned int mock_script_count = 0;
+
+static mock_connection_t mock_connections[MOCK_CONNECTIONS];
+
+static mock_response_t * mock_heap = 0;
+static unsigned int mock_heap_count = 0;
+static unsigned int mock_heap_size = 0;
+static uint64_t mock_heap_sequence = 0;
+
+static mock_counters_t mock_total;
+static volatile sig_atomic_t mock_stop = 0;
+
+static uint64_t mock_clock_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+static double mock_random(void)
+{
+	return (random() + 0.5) / ((double)RAND_MAX + 1.0);
+}
+
+static uint64_t mock_latency_sample(void)
+{
+	double ms;
+
+	switch (mock_latency.type)
+	{
+		case MOCK_LATENCY_UNIFORM:
+			ms = mock_latency.a + ((mock_latency.b - mock_latency.a) * mock_random());
+			break;
+
+		case MOCK_LATENCY_EXP:
+			ms = -mock_latency.a * log(mock_random());
+			break;
+
+		case MOCK_LATENCY_NORMAL:
+			ms = mock_latency.a + (mock_latency.b * sqrt(-2.0 * log(mock_random())) * cos(2.0 * M_PI * mock_random()));
+			break;
+
+		default:
+			ms = mock_latency.a;
+			break;
+	}
+
+	if ((mock_tail_p != 0) && (mock_random() < mock_tail_p))
+	{
+		ms += mock_tail_ms;
+	}
+
+	return (ms > 0) ? (uint64_t)(ms * 1000) : 0;
+}
+
+static const mock_script_t * mock_script_find(const char * alias)
+{
+	unsigned int i;
+
+	for (i = 0; i != mock_script_count; ++i)
+	{
+		if (0 == strcmp(mock_script[i].alias, alias))
+		{
+			return &mock_script[i];
+		}
+	}
+
+	return 0;
+}
+
+static int mock_script_load(const char * path)
+{
+	FILE * file = fopen(path, "r");
+	char line[256];
+	char alias[32];
+	char response;
+	int latency;
+	int fields;
+
+	if (file == 0)
+	{
+		fprintf(stderr, "Unable to open %s (%s).\n", path, strerror(errno));
+		return 0;
+	}
+
+	while (fgets(line, sizeof(line), file) && (mock_script_count != MOCK_SCRIPT_MAX))
+	{
+		if ((line[0] == '#') || (line[0] == ';'))
+		{
+			continue;
+		}
+
+		latency = -1;
+		fields = sscanf(line, "%31s %c %d", alias, &response, &latency);
+
+		if (fields < 2)
+		{
+			continue;
+		}
+
+		strcpy(mock_script[mock_script_count].alias, alias);
+		mock_script[mock_script_count].response = response;
+		mock_script[mock_script_count].latency = latency;
+		++mock_script_count;
+	}
+
+	fclose(file);
+
+	return 1;
+}
+
+//
+// Response queue: a binary heap ordered by due time, then by arrival.
+//
+static int mock_heap_before(const mock_response_t * a, const mock_response_t * b)
+{
+	return (a->due < b->due) || ((a->due == b->due) && (a->sequence < b->sequence));
+}
+
+static void mock_heap_push(mock_response_t * response)
+{
+	unsigned int i;
+	unsigned int parent;
+
+	if (mock_heap_count == mock_heap_size)
+	{
+		mock_heap_size = mock_heap_size ? (mock_heap_size * 2) : 1024;
+		mock_heap = realloc(mock_heap, mock_heap_size * sizeof(*mock_heap));
+
+		if (mock_heap == 0)
+		{
+			fprintf(stderr, "Out of memory.\n");
+			exit(1);
+		}
+	}
+
+	response->sequence = mock_heap_sequence++;
+
+	for (i = mock_heap_count++; i != 0; i = parent)
+	{
+		parent = (i - 1) / 2;
+
+		if (!mock_heap_before(response, &mock_heap[parent]))
+		{
+			break;
+		}
+
+		mock_heap[i] = mock_heap[parent];
+	}
+
+	mock_heap[i] = *response;
+}
+
+static void mock_heap_pop(void)
+{
+	mock_response_t last = mock_heap[--mock_heap_count];
+	unsigned int i = 0;
+	unsigned int child;
+
+	while ((child = (i * 2) + 1) < mock_heap_count)
+	{
+		if (((child + 1) < mock_heap_count) && mock_heap_before(&mock_heap[child + 1], &mock_heap[child]))
+		{
+			++child;
+		}
+
+		if (!mock_heap_before(&mock_heap[child], &last))
+		{
+			break;
+		}
+
+		mock_heap[i] = mock_heap[child];
+		i = child;
+	}
+
+	mock_heap[i] = last;
+}
+
+static void mock_close(int slot)
+{
+	mock_connection_t * connection = &mock_connections[slot];
+
+	if (connection->fd >= 0)
+	{
+		close(connection->fd);
+		connection->fd = -1;
+		++connection->generation;
+	}
+}
+
+//
+// Count a request, apply the faults and work out its answer from the
+// script.  Returns 0 when the connection was dropped, otherwise the
+// response character, with its latency in *latency.
+//
+static char mock_answer(int slot, char code, const char * alias, uint64_t now, uint64_t * latency)
+{
+	mock_connection_t * connection = &mock_connections[slot];
+	const mock_script_t * script = 0;
+	char answer = '0';
+
+	++mock_total.requests;
+
+	if ((mock_drop_p != 0) && (mock_random() < mock_drop_p))
+	{
+		++mock_total.drops;
+		mock_close(slot);
+		return 0;
+	}
+
+	if ((mock_stall_p != 0) && (mock_random() < mock_stall_p))
+	{
+		++mock_total.stalls;
+		connection->stalled = now + (uint64_t)(mock_stall_ms * 1000);
+	}
+
+	switch (code)
+	{
+		case 'v':
+		case 's':
+			script = (alias != 0) ? mock_script_find(alias) : 0;
+			break;
+
+		case 'q':
+			answer = 'b';
+			break;
+
+		case 'p':
+			break;
+
+		default:
+			answer = '5';
+			break;
+	}
+
+	if (script != 0)
+	{
+		answer = script->response;
+	}
+
+	*latency = ((script != 0) && (script->latency >= 0)) ? ((uint64_t)script->latency * 1000) : mock_latency_sample();
+
+	return answer;
+}
+
+//
+// Work out the answer to one request frame (without brackets) and queue it.
+// Returns 0 when the connection was dropped.
+//
+static int mock_request(int slot, char * frame, uint64_t now)
+{
+	mock_connection_t * connection = &mock_connections[slot];
+	mock_response_t response;
+	char * field[6];
+	const char * tag = 0;
+	const char * alias = 0;
+	char code;
+	int fields;
+	uint64_t latency = 0;
+
+	if ((frame[0] == 0) || (frame[1] != ':'))
+	{
+		return 1;
+	}
+
+	code = frame[0];
+	field[0] = &frame[2];
+
+	for (fields = 1; (fields != 6) && ((field[fields] = strchr(field[fields - 1], ',')) != 0); ++fields)
+	{
+		*field[fields]++ = 0;
+	}
+
+	// Accepted at once, so the answer goes out before any response to a frame.
+	if ((code == 'h') && (mock_protocol >= 2) && (fields > 1) && (atoi(field[fields - 1]) >= 2))
+	{
+		++mock_total.requests;
+		connection->protocol = 2;
+		response.data[0] = '0';
+	}
+	else
+	{
+		switch (code)
+		{
+			case 'v':
+				tag = (fields > 2) ? field[1] : 0;
+				alias = (fields > 1) ? field[fields - 1] : 0;
+				break;
+
+			case 's':
+				tag = (fields > 1) ? field[1] : 0;
+				alias = (fields > 2) ? field[2] : 0;
+				break;
+
+			case 'q':
+			case 'p':
+				tag = (fields > 1) ? field[1] : 0;
+				break;
+		}
+
+		if ((response.data[0] = mock_answer(slot, code, alias, now, &latency)) == 0)
+		{
+			return 0;
+		}
+	}
+
+	if ((mock_garble_p != 0) && (code != 'h') && (mock_random() < mock_garble_p))
+	{
+		++mock_total.garbles;
+		response.length = snprintf(response.data, sizeof(response.data), "[%c%c\x01garbled", 'r' + (int)(random() % 8), (int)(random() % 256));
+	}
+	else if (tag != 0)
+	{
+		response.length = snprintf(response.data, sizeof(response.data), "[r:%.40s,%c]", tag, response.data[0]);
+	}
+	else
+	{
+		response.length = 1;
+	}
+
+	response.due = now + latency;
+	response.connection = slot;
+	response.generation = connection->generation;
+
+	// Untagged responses are matched by order, so they may not overtake each other.
+	if (tag == 0)
+	{
+		if (response.due < connection->ordered)
+		{
+			response.due = connection->ordered;
+		}
+
+		connection->ordered = response.due;
+	}
+
+	mock_heap_push(&response);
+
+	return 1;
+}
+
+static int mock_field(char * data, int length, int type, const void * value, int size)
+{
+	data[length] = type;
+	data[length + 1] = (char)(size >> 8);
+	data[length + 2] = (char)size;
+	memcpy(&data[length + 3], value, size);
+	++data[3];
+
+	return length + 3 + size;
+}
+
+//
+// Answer one protocol 2 request frame of length bytes.  Returns 0 when the
+// connection was dropped.
+//
+static int mock_request_binary(int slot, const char * frame, int length, uint64_t now)
+{
+	mock_connection_t * connection = &mock_connections[slot];
+	mock_response_t response;
+	const unsigned char * bytes = (const unsigned char *)frame;
+	char alias[32] = "";
+	char reference[24];
+	unsigned char position[4];
+	uint64_t latency;
+	char answer;
+	int fields = bytes[3];
+	int size;
+	int i = MOCK_FRAME_HEADER;
+
+	while ((fields-- != 0) && ((i + 3) <= length))
+	{
+		size = (bytes[i + 1] << 8) | bytes[i + 2];
+
+		if ((bytes[i] == MOCK_FIELD_RECIPIENT) && (size < (int)sizeof(alias)) && ((i + 3 + size) <= length))
+		{
+			memcpy(alias, &frame[i + 3], size);
+			alias[size] = 0;
+		}
+
+		i += 3 + size;
+	}
+
+	if ((answer = mock_answer(slot, frame[2], (alias[0] != 0) ? alias : 0, now, &latency)) == 0)
+	{
+		return 0;
+	}
+
+	if ((mock_garble_p != 0) && (mock_random() < mock_garble_p))
+	{
+		++mock_total.garbles;
+		response.length = snprintf(response.data, sizeof(response.data), "%c%c%cgarbled", 0, 3, 'r' + (int)(random() % 8));
+	}
+	else
+	{
+		memcpy(response.data, frame, MOCK_FRAME_HEADER);
+		response.data[2] = 'r';
+		response.data[3] = 0;
+		response.length = mock_field(response.data, MOCK_FRAME_HEADER, MOCK_FIELD_RESPONSE, &answer, 1);
+
+		if ((frame[2] == 's') && (answer == '0'))
+		{
+			size = snprintf(reference, sizeof(reference), "M%llu", (unsigned long long)++mock_message_id);
+			response.length = mock_field(response.data, response.length, MOCK_FIELD_REFERENCE, reference, size);
+
+			position[0] = (unsigned char)(mock_heap_count >> 24);
+			position[1] = (unsigned char)(mock_heap_count >> 16);
+			position[2] = (unsigned char)(mock_heap_count >> 8);
+			position[3] = (unsigned char)mock_heap_count;
+			response.length = mock_field(response.data, response.length, MOCK_FIELD_POSITION, position, 4);
+		}
+
+		response.data[0] = (char)(response.length >> 8);
+		response.data[1] = (char)response.length;
+	}
+
+	response.due = now + latency;
+	response.connection = slot;
+	response.generation = connection->generation;
+
+	mock_heap_push(&response);
+
+	return 1;
+}
+
+static void mock_receive(int slot, uint64_t now)
+{
+	mock_connection_t * connection = &mock_connections[slot];
+	char * start;
+	char * end;
+	int length;
+	int i;
+
+	length = read(connection->fd, &connection->rx[connection->rx_length], sizeof(connection->rx) - connection->rx_length);
+
+	if (length <= 0)
+	{
+		mock_close(slot);
+		return;
+	}
+
+	connection->rx_length += length;
+
+	for (i = 0; i != connection->rx_length; )
+	{
+		// checked at every frame: the offer switches the stream
+		if (connection->protocol == 2)
+		{
+			if ((connection->rx_length - i) < 2)
+			{
+				break;
+			}
+
+			length = ((unsigned char)connection->rx[i] << 8) | (unsigned char)connection->rx[i + 1];
+
+			if (length < MOCK_FRAME_HEADER)
+			{
+				mock_close(slot);
+				return;
+			}
+
+			if ((connection->rx_length - i) < length)
+			{
+				break;
+			}
+
+			if (!mock_request_binary(slot, &connection->rx[i], length, now))
+			{
+				return;
+			}
+
+			i += length;
+			continue;
+		}
+
+		start = memchr(&connection->rx[i], '[', connection->rx_length - i);
+
+		if (start == 0)
+		{
+			i = connection->rx_length;
+			break;
+		}
+
+		end = memchr(start, ']', connection->rx_length - (start - connection->rx));
+
+		if (end == 0)
+		{
+			i = start - connection->rx;
+			break;
+		}
+
+		*end = 0;
+		i = (end - connection->rx) + 1;
+
+		if (!mock_request(slot, start + 1, now))
+		{
+			return;
+		}
+	}
+
+	if ((i == 0) && (connection->rx_length == sizeof(connection->rx)))
+	{
+		i = connection->rx_length;
+	}
+
+	connection->rx_length -= i;
+	memmove(connection->rx, &connection->rx[i], connection->rx_length);
+}
+
+static void mock_send_due(uint64_t now)
+{
+	mock_response_t * response;
+	mock_connection_t * connection;
+
+	while ((mock_heap_count != 0) && (mock_heap[0].due <= now))
+	{
+		response = &mock_heap[0];
+		connection = &mock_connections[response->connection];
+
+		if ((connection->fd >= 0) && (connection->generation == response->generation))
+		{
+			if (write(connection->fd, response->data, response->length) != response->length)
+			{
+				mock_close(response->connection);
+			}
+			else
+			{
+				++mock_total.responses;
+			}
+		}
+
+		mock_heap_pop();
+	}
+}
+
+static void mock_accept(int listen_fd)
+{
+	int fd = accept(listen_fd, 0, 0);
+	int value = 1;
+	int i;
+
+	if (fd < 0)
+	{
+		return;
+	}
+
+	for (i = 0; (i != MOCK_CONNECTIONS) && (mock_connections[i].fd >= 0); ++i)
+	{
+	}
+
+	if (i == MOCK_CONNECTIONS)
+	{
+		close(fd);
+		return;
+	}
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value));
+
+	mock_connections[i].fd = fd;
+	mock_connections[i].stalled = 0;
+	mock_connections[i].ordered = 0;
+	mock_connections[i].protocol = 1;
+	mock_connections[i].rx_length = 0;
+
+	++mock_total.accepts;
+}
+
+static void mock_report(double seconds, const mock_counters_t * last)
+{
+	unsigned int connections = 0;
+	unsigned int i;
+
+	for (i = 0; i != MOCK_CONNECTIONS; ++i)
+	{
+		connections += (mock_connections[i].fd >= 0);
+	}
+
+	printf("%8.0f req/s %8.0f resp/s  %u connections  %u queued  %llu accepts  %llu dropped  %llu stalled  %llu garbled\n",
+		(mock_total.requests - last->requests) / seconds,
+		(mock_total.responses - last->responses) / seconds,
+		connections, mock_heap_count,
+		(unsigned long long)mock_total.accepts, (unsigned long long)mock_total.drops,
+		(unsigned long long)mock_total.stalls, (unsigned long long)mock_total.garbles);
+
+	fflush(stdout);
+}
+
+static int mock_latency_parse(const char * spec)
+{
+	if (sscanf(spec, "fixed:%lf", &mock_latency.a) == 1)
+	{
+		mock_latency.type = MOCK_LATENCY_FIXED;
+	}
+	else if (sscanf(spec, "uniform:%lf:%lf", &mock_latency.a, &mock_latency.b) == 2)
+	{
+		mock_latency.type = MOCK_LATENCY_UNIFORM;
+	}
+	else if (sscanf(spec, "exp:%lf", &mock_latency.a) == 1)
+	{
+		mock_latency.type = MOCK_LATENCY_EXP;
+	}
+	else if (sscanf(spec, "normal:%lf:%lf", &mock_latency.a, &mock_latency.b) == 2)
+	{
+		mock_latency.type = MOCK_LATENCY_NORMAL;
+	}
+	else
+	{
+		return 0;
+	}
+
+	return 1;
+}
+
+static int mock_fault_parse(const char * spec)
+{
+	if (sscanf(spec, "drop:%lf", &mock_drop_p) == 1)
+	{
+		return 1;
+	}
+
+	if (sscanf(spec, "stall:%lf:%lf", &mock_stall_p, &mock_stall_ms) == 2)
+	{
+		return 1;
+	}
+
+	if (sscanf(spec, "garble:%lf", &mock_garble_p) == 1)
+	{
+		return 1;
+	}
+
+	if (sscanf(spec, "slowaccept:%lf", &mock_accept_ms) == 1)
+	{
+		return 1;
+	}
+
+	return 0;
+}
+
+static void mock_signal(int signo)
+{
+	(void)signo;
+	mock_stop = 1;
+}
+
+static void mock_usage(void)
+{
+	fprintf(stderr,
+		"usage: crsivr_mock [-a address] [-p port] [-s script] [-l latency] [-t p:ms] [-f fault] ... [-r seconds] [-P 1]\n"
+		"  latency: fixed:<ms> uniform:<min>:<max> exp:<mean> normal:<mean>:<sd>\n"
+		"  fault:   drop:<p> stall:<p>:<ms> garble:<p> slowaccept:<ms>\n");
+}
+
+int main(int argc, char ** argv)
+{
+	struct sockaddr_in address = {.sin_family = AF_INET, .sin_port = htons(MOCK_PORT), .sin_addr.s_addr = htonl(INADDR_ANY)};
+	struct pollfd fds[1 + MOCK_CONNECTIONS];
+	int slots[1 + MOCK_CONNECTIONS];
+	mock_counters_t last;
+	uint64_t accept_due = 0;
+	uint64_t report_due;
+	uint64_t started;
+	uint64_t now;
+	double report = 1;
+	int listen_fd;
+	int timeout;
+	int count;
+	int value = 1;
+	int option;
+	int i;
+
+	while ((option = getopt(argc, argv, "a:p:s:l:t:f:r:P:h")) != -1)
+	{
+		switch (option)
+		{
+			case 'a':
+				if (inet_pton(AF_INET, optarg, &address.sin_addr) != 1)
+				{
+					fprintf(stderr, "Invalid address %s.\n", optarg);
+					return 1;
+				}
+				break;
+
+			case 'p':
+				address.sin_port = htons(atoi(optarg));
+				break;
+
+			case 's':
+				if (!mock_script_load(optarg))
+				{
+					return 1;
+				}
+				break;
+
+			case 'l':
+				if (!mock_latency_parse(optarg))
+				{
+					mock_usage();
+					return 1;
+				}
+				break;
+
+			case 't':
+				if (sscanf(optarg, "%lf:%lf", &mock_tail_p, &mock_tail_ms) != 2)
+				{
+					mock_usage();
+					return 1;
+				}
+				break;
+
+			case 'f':
+				if (!mock_fault_parse(optarg))
+				{
+					mock_usage();
+					return 1;
+				}
+				break;
+
+			case 'r':
+				report = atof(optarg);
+				break;
+
+			case 'P':
+				mock_protocol = atoi(optarg);
+				break;
+
+			default:
+				mock_usage();
+				return 1;
+		}
+	}
+
+	signal(SIGINT, mock_signal);
+	signal(SIGTERM, mock_signal);
+	signal(SIGPIPE, SIG_IGN);
+	srandom(time(0));
+
+	for (i = 0; i != MOCK_CONNECTIONS; ++i)
+	{
+		mock_connections[i].fd = -1;
+	}
+
+	listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(value));
+
+	if ((listen_fd < 0) || (bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) != 0) || (listen(listen_fd, 64) != 0))
+	{
+		fprintf(stderr, "Unable to listen on port %u (%s).\n", ntohs(address.sin_port), strerror(errno));
+		return 1;
+	}
+
+	printf("Listening on port %u, %u scripted recipients.\n", ntohs(address.sin_port), mock_script_count);
+	fflush(stdout);
+
+	memset(&last, 0, sizeof(last));
+	started = mock_clock_us();
+	report_due = started + (uint64_t)(report * 1000000);
+
+	while (!mock_stop)
+	{
+		now = mock_clock_us();
+		count = 0;
+
+		// With slow accepts the listener is ignored until the delay has passed.
+		if (now >= accept_due)
+		{
+			fds[count].fd = listen_fd;
+			fds[count].events = POLLIN;
+			slots[count++] = -1;
+		}
+
+		for (i = 0; i != MOCK_CONNECTIONS; ++i)
+		{
+			if ((mock_connections[i].fd >= 0) && (mock_connections[i].stalled <= now))
+			{
+				fds[count].fd = mock_connections[i].fd;
+				fds[count].events = POLLIN;
+				slots[count++] = i;
+			}
+		}
+
+		timeout = 100;
+
+		if ((mock_heap_count != 0) && (((mock_heap[0].due - now) / 1000) < (uint64_t)timeout))
+		{
+			timeout = (mock_heap[0].due > now) ? (int)((mock_heap[0].due - now + 999) / 1000) : 0;
+		}
+
+		if (accept_due > now)
+		{
+			timeout = ((accept_due - now) / 1000) < (uint64_t)timeout ? (int)((accept_due - now + 999) / 1000) : timeout;
+		}
+
+		if ((poll(fds, count, timeout) < 0) && (errno != EINTR))
+		{
+			fprintf(stderr, "poll failed (%s).\n", strerror(errno));
+			break;
+		}
+
+		now = mock_clock_us();
+
+		for (i = 0; i != count; ++i)
+		{
+			if (fds[i].revents == 0)
+			{
+				continue;
+			}
+
+			if (slots[i] < 0)
+			{
+				if ((mock_accept_ms != 0) && (accept_due == 0))
+				{
+					accept_due = now + (uint64_t)(mock_accept_ms * 1000);
+					continue;
+				}
+
+				mock_accept(listen_fd);
+				accept_due = 0;
+			}
+			else if (mock_connections[slots[i]].fd == fds[i].fd)
+			{
+				mock_receive(slots[i], now);
+			}
+		}
+
+		mock_send_due(mock_clock_us());
+
+		if ((report != 0) && (now >= report_due))
+		{
+			mock_report(report, &last);
+			last = mock_total;
+			report_due += (uint64_t)(report * 1000000);
+		}
+	}
+
+	now = mock_clock_us();
+
+	printf("%llu requests, %llu responses in %.1f s (%.0f req/s).\n",
+		(unsigned long long)mock_total.requests, (unsigned long long)mock_total.responses,
+		(now - started) / 1000000.0, mock_total.requests / ((now - started) / 1000000.0));
+
+	return 0;
+}